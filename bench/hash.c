@@ -0,0 +1,61 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Open addressing hash table: inserts and lookups with random keys
+
+typedef struct {
+  uint64_t key;
+  uint64_t value;
+} Entry;
+
+static uint64_t Hash(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return key;
+}
+
+static void Insert(Entry *table, uint64_t mask, uint64_t key, uint64_t value) {
+  uint64_t slot = Hash(key) & mask;
+  while (table[slot].key != 0 && table[slot].key != key) {
+    slot = (slot + 1) & mask;
+  }
+  table[slot].key = key;
+  table[slot].value = value;
+}
+
+static uint64_t Find(const Entry *table, uint64_t mask, uint64_t key) {
+  uint64_t slot = Hash(key) & mask;
+  while (table[slot].key != 0) {
+    if (table[slot].key == key) {
+      return table[slot].value;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  long scale = argc > 1 ? atol(argv[1]) : 1;
+  uint64_t n = 50000 * scale;
+
+  uint64_t capacity = 1;
+  while (capacity < 2 * n) {
+    capacity *= 2;
+  }
+
+  Entry *table = (Entry *)calloc(capacity, sizeof(Entry));
+  for (uint64_t i = 1; i <= n; ++i) {
+    Insert(table, capacity - 1, Hash(i) | 1, i);
+  }
+
+  uint64_t checksum = 0;
+  for (uint64_t i = 1; i <= 2 * n; ++i) {
+    checksum += Find(table, capacity - 1, Hash(i) | 1);
+  }
+
+  free(table);
+  printf("%llu\n", (unsigned long long)checksum);
+  return 0;
+}
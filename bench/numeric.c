@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+// Tight floating point loops: dense matrix multiplication
+
+int main(int argc, char **argv) {
+  long scale = argc > 1 ? atol(argv[1]) : 1;
+  long n = 64;
+
+  double *a = (double *)malloc(n * n * sizeof(double));
+  double *b = (double *)malloc(n * n * sizeof(double));
+  double *c = (double *)malloc(n * n * sizeof(double));
+
+  for (long i = 0; i < n * n; ++i) {
+    a[i] = (double)(i % 17) / 16.0;
+    b[i] = (double)(i % 13) / 12.0;
+  }
+
+  double checksum = 0;
+  for (long round = 0; round < 4 * scale; ++round) {
+    for (long i = 0; i < n; ++i) {
+      for (long j = 0; j < n; ++j) {
+        double sum = 0;
+        for (long k = 0; k < n; ++k) {
+          sum += a[i * n + k] * b[k * n + j];
+        }
+        c[i * n + j] = sum;
+      }
+    }
+    checksum += c[round % (n * n)];
+  }
+
+  free(a);
+  free(b);
+  free(c);
+  printf("%f\n", checksum);
+  return 0;
+}
@@ -0,0 +1,63 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Quicksort of pseudo-random integers, branchy code with recursion
+
+static uint32_t Next(uint32_t *state) {
+  *state = *state * 1664525u + 1013904223u;
+  return *state >> 8;
+}
+
+static void Sort(uint32_t *data, long left, long right) {
+  while (left < right) {
+    uint32_t pivot = data[(left + right) / 2];
+    long i = left;
+    long j = right;
+    while (i <= j) {
+      while (data[i] < pivot) {
+        ++i;
+      }
+      while (data[j] > pivot) {
+        --j;
+      }
+      if (i <= j) {
+        uint32_t tmp = data[i];
+        data[i] = data[j];
+        data[j] = tmp;
+        ++i;
+        --j;
+      }
+    }
+
+    if (j - left < right - i) {
+      Sort(data, left, j);
+      left = i;
+    } else {
+      Sort(data, i, right);
+      right = j;
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  long scale = argc > 1 ? atol(argv[1]) : 1;
+  long n = 100000 * scale;
+
+  uint32_t *data = (uint32_t *)malloc(n * sizeof(uint32_t));
+  uint32_t state = 42;
+  for (long i = 0; i < n; ++i) {
+    data[i] = Next(&state);
+  }
+
+  Sort(data, 0, n - 1);
+
+  uint64_t checksum = 0;
+  for (long i = 0; i < n; ++i) {
+    checksum = checksum * 31 + data[i];
+  }
+
+  free(data);
+  printf("%llu\n", (unsigned long long)checksum);
+  return 0;
+}
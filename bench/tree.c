@@ -0,0 +1,66 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Unbalanced binary search trees are built and destroyed, a lot of small
+// short-living allocations
+
+typedef struct Node {
+  struct Node *left;
+  struct Node *right;
+  uint64_t key;
+} Node;
+
+static Node *Insert(Node *root, uint64_t key) {
+  Node *node = (Node *)malloc(sizeof(Node));
+  node->left = NULL;
+  node->right = NULL;
+  node->key = key;
+
+  if (!root) {
+    return node;
+  }
+
+  Node *current = root;
+  for (;;) {
+    Node **next = key < current->key ? &current->left : &current->right;
+    if (!*next) {
+      *next = node;
+      return root;
+    }
+    current = *next;
+  }
+}
+
+static uint64_t Sum(const Node *node) {
+  return node ? node->key + Sum(node->left) + Sum(node->right) : 0;
+}
+
+static void Destroy(Node *node) {
+  if (!node) {
+    return;
+  }
+  Destroy(node->left);
+  Destroy(node->right);
+  free(node);
+}
+
+int main(int argc, char **argv) {
+  long scale = argc > 1 ? atol(argv[1]) : 1;
+
+  uint64_t state = 7;
+  uint64_t checksum = 0;
+  for (long round = 0; round < 10 * scale; ++round) {
+    Node *root = NULL;
+    for (int i = 0; i < 5000; ++i) {
+      state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+      root = Insert(root, state >> 16);
+    }
+
+    checksum += Sum(root);
+    Destroy(root);
+  }
+
+  printf("%llu\n", (unsigned long long)checksum);
+  return 0;
+}
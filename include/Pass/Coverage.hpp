@@ -0,0 +1,36 @@
+#ifndef COVERAGE_HPP
+#define COVERAGE_HPP
+
+#include <cstdint>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "Pass/CycleReport.hpp"
+
+namespace dot {
+
+// Flags written by the coverage pass: node<block> [covered=0|1] per block,
+// or node<terminator> -> node<block> [covered=0|1] per edge
+class Coverage {
+public:
+  // False if the line isn't a coverage line
+  bool ParseLine(const std::string &line);
+
+  bool Empty() const { return blocks_.empty() && edges_.empty(); }
+
+  // Nodes of blocks which never ran are grayed out, edges which were never
+  // taken or touch such nodes are dashed. With edge coverage a block never
+  // ran if none of its recorded in-edges was taken.
+  std::string GrayOut(const std::string &graph, const GraphCosts &costs) const;
+
+private:
+  std::unordered_map<uint64_t, bool> blocks_;
+  std::set<std::pair<uint64_t, uint64_t>> covered_edges_;
+  std::set<std::pair<uint64_t, uint64_t>> edges_;
+};
+
+} // namespace dot
+
+#endif // COVERAGE_HPP
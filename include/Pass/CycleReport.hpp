@@ -0,0 +1,60 @@
+#ifndef CYCLE_REPORT_HPP
+#define CYCLE_REPORT_HPP
+
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+
+namespace dot {
+
+// Parts of a static graph needed to weigh execution counts by instruction
+// costs: cost=N attributes written by the pass and clusters of functions
+// and blocks nodes are in
+struct GraphCosts {
+  std::unordered_map<uint64_t, uint64_t> costs;
+  // Node -> block cluster it is in
+  std::unordered_map<uint64_t, uint64_t> blocks;
+  // Block -> function cluster it is in
+  std::unordered_map<uint64_t, uint64_t> functions;
+  // Function -> its first block
+  std::unordered_map<uint64_t, uint64_t> entry_blocks;
+  std::unordered_map<uint64_t, std::string> labels;
+
+  // Nodes without cost, e.g. of graphs written before costs, weigh 1
+  uint64_t GetCost(uint64_t node) const;
+};
+
+// Expects labels already resolved with ResolveStringRefs
+GraphCosts ParseGraphCosts(const std::string &graph);
+
+// Estimated cycles, execution count times cost, summed per function and
+// per block over all graph files. Files could be added from several
+// threads.
+class CycleReport {
+public:
+  // Cycles of nodes outside of blocks aren't counted. Graphs without costs
+  // are skipped.
+  void Add(const GraphCosts &graph,
+           const std::unordered_map<uint64_t, uint64_t> &cycles);
+
+  // Top functions and blocks by their share of all cycles, nothing if no
+  // graph had costs
+  void Print(std::ostream &out, size_t top) const;
+
+private:
+  struct Entry {
+    std::string label;
+    uint64_t cycles{0};
+  };
+
+  mutable std::mutex mutex_;
+  std::unordered_map<uint64_t, Entry> functions_;
+  std::unordered_map<uint64_t, Entry> blocks_;
+  uint64_t total_{0};
+};
+
+} // namespace dot
+
+#endif // CYCLE_REPORT_HPP
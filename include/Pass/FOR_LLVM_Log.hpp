@@ -3,6 +3,15 @@
 
 #include <cstdint>
 
+// Passed to LogDynamicMemoryAccess. Origin of memory known at compile time
+// is or-ed in, heap allocations are found by runtime.
+enum MemoryAccessKind : uint64_t {
+  kMemoryAccessLoad = 0,
+  kMemoryAccessStore = 1,
+  kMemoryAccessStack = 2,
+  kMemoryAccessGlobal = 4,
+};
+
 extern "C" {
 
 // One-shot
@@ -13,10 +22,81 @@ void PrintNPassesEdges(const char* out_file_name);
 void AddUsage(uint64_t node);
 void PrintUsages(const char* out_file_name);
 
-void AddDynamicallyAllocatedMemory(uint64_t node, void* memory);
+void AddDynamicallyAllocatedMemory(uint64_t node, void* memory, uint64_t size);
 void LogIfMemoryIsDynamicallyAllocated(uint64_t node, void* memory);
+void LogDynamicMemoryAccess(uint64_t node, void* memory, uint64_t size,
+                            uint64_t kind);
 void RemoveDynamicallAllocatedMemory(uint64_t node, void* memory);
-void PrintAllocatedMemoryInfo(const char* out_file_name);
+void ReallocDynamicallyAllocatedMemory(uint64_t node, void* old_memory,
+                                       void* new_memory, uint64_t size);
+void RegisterAllocationSite(uint64_t node, const char* name);
+void PrintAllocatedMemoryInfo(const char* out_file_name,
+                              const char* pool_candidates_file_name);
+void PrintMemoryOffsetsInfo(const char* out_file_name);
+// Not called by instrumented code, benchmarks start batches from scratch
+void ResetAllocatedMemoryInfo();
+void EnableFalseSharing(uint64_t period);
+void PrintFalseSharing(const char* out_file_name);
+// Loops and functions accesses are rolled up into, parent of a function is 0
+void RegisterMemoryScope(uint64_t scope, uint64_t parent, const char* name);
+// Pairs of access node and its innermost scope
+void RegisterMemoryAccesses(const uint64_t* accesses, uint64_t size);
+void EnterMemoryScope(uint64_t scope);
+void PrintMemoryBandwidth(const char* out_file_name,
+                          const char* report_file_name);
+
+void LogMemoryStride(uint64_t node, void* memory, uint64_t size);
+void PrintMemoryStrides(const char* out_file_name);
+
+void RegisterFunction(uint64_t function, const char* name);
+void EnterFunction(uint64_t function);
+void ExitFunction(uint64_t function);
+void CountContextBlock(uint64_t block);
+// Block and edge counts are printed if counts_file_name isn't null
+void PrintCallingContexts(const char* out_file_name,
+                          const char* counts_file_name);
+
+void TimeFunctionEnter(uint64_t function);
+void TimeFunctionExit(uint64_t function);
+void TimeBlock(uint64_t block);
+void PrintTimes(const char* out_file_name);
+
+void ProfileValue(uint64_t site, uint64_t value);
+void PrintValueProfile(const char* out_file_name);
+
+void RecordTripCount(uint64_t loop, uint64_t trips);
+void PrintTripCounts(const char* out_file_name);
+
+void RegisterCoverage(const uint8_t* flags, const uint64_t* ids,
+                      uint64_t size, uint64_t edges);
+void PrintCoverage(const char* out_file_name);
+
+// Substitute pthread and std::mutex lock functions at call sites, the site
+// of the next call is set by SetLockSite. Results are the ones of wrapped
+// functions.
+void SetLockSite(uint64_t site);
+int ProfiledMutexLock(void* mutex);
+int ProfiledMutexTrylock(void* mutex);
+int ProfiledMutexTimedlock(void* mutex, const void* abstime);
+int ProfiledMutexUnlock(void* mutex);
+int ProfiledRwlockRdlock(void* rwlock);
+int ProfiledRwlockWrlock(void* rwlock);
+int ProfiledRwlockTryrdlock(void* rwlock);
+int ProfiledRwlockTrywrlock(void* rwlock);
+int ProfiledRwlockTimedrdlock(void* rwlock, const void* abstime);
+int ProfiledRwlockTimedwrlock(void* rwlock, const void* abstime);
+int ProfiledRwlockUnlock(void* rwlock);
+int ProfiledSpinLock(void* lock);
+int ProfiledSpinTrylock(void* lock);
+int ProfiledSpinUnlock(void* lock);
+int ProfiledCondWait(void* cond, void* mutex);
+int ProfiledCondTimedwait(void* cond, void* mutex, const void* abstime);
+void ProfiledStdMutexLock(void* mutex);
+bool ProfiledStdMutexTryLock(void* mutex);
+void ProfiledStdMutexUnlock(void* mutex);
+// lock is std::unique_lock<std::mutex> of libstdc++
+void ProfiledStdConditionWait(void* condition, void* lock);
+void PrintLockContention(const char* out_file_name);
 
 }
 
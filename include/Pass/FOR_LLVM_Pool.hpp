@@ -0,0 +1,24 @@
+#ifndef POOL_HPP
+#define POOL_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// Allocations bigger than that are forwarded to malloc
+constexpr size_t kPoolMaxAllocationSize = 256;
+
+extern "C" {
+
+// Thread-local size-class pool allocator. Substitutes malloc/calloc at
+// selected allocation sites. PoolFree/PoolRealloc accept any pointer and
+// forward the ones not owned by the pool to free/realloc. With glibc free
+// and realloc are interposed by them, so pooled memory could be freed
+// anywhere, and the pool is linked only into programs which use it.
+void *PoolAlloc(size_t size);
+void *PoolCalloc(size_t count, size_t size);
+void *PoolRealloc(void *memory, size_t size);
+void PoolFree(void *memory);
+
+}
+
+#endif // POOL_HPP
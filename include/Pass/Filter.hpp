@@ -0,0 +1,50 @@
+#ifndef FILTER_HPP
+#define FILTER_HPP
+
+#include <llvm/IR/Function.h>
+#include <llvm/Support/GlobPattern.h>
+#include <llvm/Support/Regex.h>
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace pass {
+
+// Selects functions to instrument with rules, one per line of a filter file:
+//
+//   [+|-]<fun|module|src>:<glob or /regex/>
+//
+// Functions are matched by mangled and demangled names, modules by name and
+// sources by file of function debug info, or by module source file without
+// it. A function passes if no "-" rule matches it and, for every kind having
+// "+" rules, one of them does. A rule without sign is a "+" one.
+class FunctionFilter {
+public:
+  FunctionFilter() = default;
+  explicit FunctionFilter(const std::vector<std::string> &rules);
+
+  bool Allows(const llvm::Function &F) const;
+
+private:
+  enum Kind { kFunction, kModule, kSource, kKinds };
+
+  // Rules don't move, glob patterns may refer to their text
+  struct Rule {
+    Kind kind;
+    bool allow;
+    std::string pattern;
+    std::optional<llvm::GlobPattern> glob;
+    std::optional<llvm::Regex> regex;
+
+    bool Matches(llvm::StringRef value) const;
+  };
+
+  std::vector<std::unique_ptr<Rule>> rules_;
+  bool has_allow_[kKinds] = {};
+};
+
+} // namespace pass
+
+#endif // FILTER_HPP
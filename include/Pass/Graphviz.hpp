@@ -2,7 +2,13 @@
 #define GRAPHVIZ_H
 
 #include <fstream>
+#include <optional>
+#include <set>
+#include <string>
 #include <string_view>
+#include <utility>
+
+#include "Pass/StringTable.hpp"
 
 namespace dot {
 
@@ -23,12 +29,13 @@ public:
   ~GraphvizSubgraphBuilder();
 
 private:
-  explicit GraphvizSubgraphBuilder(std::ofstream &out);
+  GraphvizSubgraphBuilder(std::ofstream &out, StringTable *strings);
 
   void Start(uint64_t subgraph_id, std::string_view label);
 
 private:
   std::ofstream &out_;
+  StringTable *strings_;
 };
 
 class GraphvizBuilder {
@@ -59,18 +66,73 @@ public:
   GraphvizSubgraphBuilder StartSubgraph(uint64_t subgraph_id,
                                         std::string_view label);
 
+  // Attributes are appended as is, e.g. "cost=3"
   void AddNode(uint64_t node_id, std::string_view name,
-               Color color = Color::Gray);
-  void AddEdge(uint64_t from_node, uint64_t to_node, Color color);
+               Color color = Color::Gray, std::string_view attributes = {});
+  // Node filled from green for 0 to red for 1, as runtime heat is colored
+  // by Concat scripts
+  void AddHeatNode(uint64_t node_id, std::string_view name, double heat,
+                   std::string_view attributes = {});
+  void AddEdge(uint64_t from_node, uint64_t to_node, Color color,
+               std::string_view attributes = {});
+
+  // Labels are written to the table and referenced by index
+  void UseStringTable(StringTable *strings);
+
+  // label="..." or strref=N attribute
+  static std::string FormatLabel(std::string_view name, StringTable *strings);
 
 private:
+  void WriteNode(uint64_t node_id, std::string_view name,
+                 std::string_view color, std::string_view attributes);
+
   static const char *ColorToString(Color color);
+  static std::string HeatToString(double heat);
 
 private:
   std::ofstream out_;
   int nextNodeId_;
   
   bool with_end_{true};
+  StringTable *strings_{nullptr};
+};
+
+// Graph of a module written either to one file or, when split, to a file
+// per function and an index file with function nodes and calls between
+// them. Function files are laid out separately, so graphs of large modules
+// could still be rendered.
+class GraphvizPartition {
+public:
+  // Files are <name>.dot, or <name>.<function id>.dot and <name>.index.dot
+  GraphvizPartition(const std::string &name, bool split, StringTable *strings);
+
+  bool IsSplit() const { return split_; }
+
+  // Builder for nodes and edges of a function. File of previous function is
+  // closed. Functions without body only go to the index.
+  GraphvizBuilder &StartFunction(uint64_t function_id, std::string_view name,
+                                 bool has_body);
+
+  // Call from instruction node. When split, it also becomes edge between
+  // function nodes in the index, and the function file gets a node of the
+  // callee
+  void AddCall(uint64_t from_node, uint64_t caller_id, uint64_t callee_id,
+               std::string_view callee_name, GraphvizBuilder::Color color);
+
+private:
+  GraphvizBuilder Open(const std::string &filename);
+
+private:
+  std::string name_;
+  bool split_;
+  StringTable *strings_;
+
+  // Whole graph when not split
+  std::optional<GraphvizBuilder> index_;
+  std::optional<GraphvizBuilder> function_;
+  std::set<std::pair<uint64_t, uint64_t>> calls_;
+  // Callees with a node in the current function file
+  std::set<uint64_t> callees_;
 };
 
 } // namespace dot
@@ -0,0 +1,15 @@
+#ifndef PASS_HPP
+#define PASS_HPP
+
+#include <llvm/IR/Module.h>
+#include <llvm/IR/PassManager.h>
+
+namespace pass {
+
+// Writes static graphs of passes enabled with PASS_LIST without instrumenting
+// the module. Graph files are named after module identifier, as in plugin.
+void BuildStaticGraphs(llvm::Module &M, llvm::ModuleAnalysisManager &MAM);
+
+} // namespace pass
+
+#endif // PASS_HPP
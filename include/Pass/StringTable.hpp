@@ -0,0 +1,39 @@
+#ifndef STRING_TABLE_HPP
+#define STRING_TABLE_HPP
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace dot {
+
+// Labels shared by graph files of a module. Graph files reference them with
+// strref=N attributes and name the table in "// strings: <file>" line. Every
+// graph of a module is rewritten by one compiler process, so the process
+// starts the table anew when it opens it first and appends afterwards:
+// passes share labels, and labels of previous builds don't pile up.
+class StringTable {
+public:
+  explicit StringTable(std::string filename);
+
+  const std::string &GetFilename() const { return filename_; }
+
+  // Index of already escaped label, it is added to the table if new
+  uint64_t Intern(std::string_view label);
+
+private:
+  std::string filename_;
+  std::ofstream out_;
+  std::unordered_map<std::string, uint64_t> indexes_;
+};
+
+// Replaces strref=N attributes with labels from the table named in graph.
+// Graph without string table is returned as is. Tables are read once and
+// cached, so graph files of a module could be resolved from several threads.
+std::string ResolveStringRefs(const std::string &graph);
+
+} // namespace dot
+
+#endif // STRING_TABLE_HPP
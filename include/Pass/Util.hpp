@@ -2,12 +2,25 @@
 #define UTIL_HPP
 
 #include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
 
 namespace util {
 
 std::ofstream OpenFile(const char *env_var_to_take_name,
                        const char *backup_name);
 
+// Reads non-empty lines of a file. Everything after '#' is a comment.
+std::vector<std::string> ReadLines(const char *filename);
+
+// Number of worker threads from env variable, number of cores by default
+size_t GetJobs(const char *env_var_name);
+
+// Calls task for every index in [0, size) from at most `jobs` threads
+void ParallelFor(size_t size, size_t jobs,
+                 const std::function<void(size_t)> &task);
+
 } // namespace util
 
 #endif // UTIL_HPP
\ No newline at end of file
@@ -0,0 +1,186 @@
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Builds every kernel without instrumentation and with each pass alone, runs
+// them and writes wall time, slowdown, peak RSS and size of produced files
+// as CSV.
+
+namespace fs = std::filesystem;
+
+struct Options {
+  std::string compiler{"clang++"};
+  std::string plugin;
+  std::string include_dir;
+  std::vector<std::string> runtime_sources;
+  std::string out_file_name{"bench.csv"};
+  std::string scale{"1"};
+  int repeats{3};
+  std::vector<std::string> kernels;
+};
+
+// Empty pass list means build without pass plugin
+const char *const kConfigs[] = {
+    "", "control_flow", "def_use", "memory", "memory_stride",
+};
+
+struct RunResult {
+  double wall_seconds;
+  long peak_rss_kb;
+};
+
+Options ParseOptions(int argc, char *argv[]) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc) {
+        throw std::runtime_error("Missing value for " + arg);
+      }
+      return argv[++i];
+    };
+
+    if (arg == "--compiler") {
+      options.compiler = value();
+    } else if (arg == "--plugin") {
+      options.plugin = value();
+    } else if (arg == "--include") {
+      options.include_dir = value();
+    } else if (arg == "--runtime") {
+      options.runtime_sources.push_back(value());
+    } else if (arg == "--out") {
+      options.out_file_name = value();
+    } else if (arg == "--scale") {
+      options.scale = value();
+    } else if (arg == "--repeats") {
+      options.repeats = std::stoi(value());
+    } else {
+      options.kernels.push_back(arg);
+    }
+  }
+
+  return options;
+}
+
+void Build(const Options &options, const fs::path &kernel,
+           const std::string &config, const fs::path &work_dir) {
+  std::string command = "cd " + work_dir.string() + " && ";
+  if (!config.empty()) {
+    command += "PASS_LIST=" + config + " ";
+  }
+
+  command += options.compiler + " -O0 -w ";
+  if (!config.empty()) {
+    command += "-fpass-plugin=" + options.plugin + " ";
+  }
+  command += kernel.string() + " ";
+  for (const auto &source : options.runtime_sources) {
+    command += source + " ";
+  }
+  command += "-I" + options.include_dir + " -o kernel";
+
+  if (std::system(command.c_str()) != 0) {
+    throw std::runtime_error("Can't build: " + command);
+  }
+}
+
+RunResult Run(const Options &options, const fs::path &work_dir) {
+  auto start = std::chrono::steady_clock::now();
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (chdir(work_dir.c_str()) != 0 ||
+        !freopen("stdout", "w", stdout)) {
+      _exit(EXIT_FAILURE);
+    }
+    execl("./kernel", "./kernel", options.scale.c_str(), nullptr);
+    _exit(EXIT_FAILURE);
+  }
+
+  int status = 0;
+  rusage usage{};
+  wait4(pid, &status, 0, &usage);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    throw std::runtime_error("Kernel failed in " + work_dir.string());
+  }
+
+  return {elapsed.count(), usage.ru_maxrss};
+}
+
+// Graphs written at compile time and runtime info written by the kernel
+uintmax_t GetOutputSize(const fs::path &work_dir) {
+  uintmax_t size = 0;
+  for (const auto &entry : fs::directory_iterator(work_dir)) {
+    auto filename = entry.path().filename();
+    if (entry.is_regular_file() && filename != "kernel" &&
+        filename != "stdout") {
+      size += entry.file_size();
+    }
+  }
+
+  return size;
+}
+
+int main(int argc, char *argv[]) {
+  Options options = ParseOptions(argc, argv);
+  if (options.plugin.empty() || options.kernels.empty()) {
+    std::cerr << "Usage: " << argv[0]
+              << " --plugin <pass.so> --include <dir> [--runtime <src>]..."
+                 " [--compiler <cxx>] [--out <csv>] [--scale <n>]"
+                 " [--repeats <n>] <kernel>..."
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::ofstream out{options.out_file_name};
+  out << "kernel,passes,wall_s,slowdown,peak_rss_kb,output_bytes\n";
+
+  for (const auto &kernel : options.kernels) {
+    fs::path kernel_path = fs::absolute(kernel);
+    double baseline = 0;
+
+    for (const std::string config : kConfigs) {
+      fs::path work_dir = fs::absolute("bench_work") / kernel_path.stem() /
+                          (config.empty() ? "plain" : config);
+      fs::remove_all(work_dir);
+      fs::create_directories(work_dir);
+
+      Build(options, kernel_path, config, work_dir);
+
+      // The best of several runs is the least noisy
+      RunResult best{0, 0};
+      for (int i = 0; i < options.repeats; ++i) {
+        RunResult result = Run(options, work_dir);
+        if (i == 0 || result.wall_seconds < best.wall_seconds) {
+          best.wall_seconds = result.wall_seconds;
+        }
+        best.peak_rss_kb = std::max(best.peak_rss_kb, result.peak_rss_kb);
+      }
+
+      if (config.empty()) {
+        baseline = best.wall_seconds;
+      }
+
+      out << kernel_path.stem().string() << ","
+          << (config.empty() ? "plain" : config) << "," << best.wall_seconds
+          << "," << best.wall_seconds / baseline << "," << best.peak_rss_kb
+          << "," << GetOutputSize(work_dir) << std::endl;
+    }
+  }
+
+  std::cout << "Results are written to " << options.out_file_name
+            << std::endl;
+  return 0;
+}
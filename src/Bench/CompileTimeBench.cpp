@@ -0,0 +1,280 @@
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Generates synthetic modules with many functions, deep CFGs and large
+// switches, compiles them with each pass alone and -ftime-trace, and writes
+// time spent by the plugin per phase as CSV.
+
+namespace fs = std::filesystem;
+
+struct Options {
+  std::string compiler{"clang"};
+  std::string plugin;
+  std::string out_file_name{"compile_time.csv"};
+  int scale{1};
+};
+
+struct ModuleShape {
+  const char *name;
+  int functions;
+  // Nesting of if-else chain in every function
+  int depth;
+  int switch_cases;
+};
+
+const ModuleShape kShapes[] = {
+    {"small", 100, 4, 16},
+    {"deep", 200, 32, 8},
+    {"switch", 200, 4, 256},
+    {"large", 2000, 8, 64},
+};
+
+// Pass name in PASS_LIST and its time trace scope, empty one means build
+// without pass plugin
+struct Config {
+  const char *passes;
+  const char *scope;
+};
+
+const Config kConfigs[] = {
+    {"", ""},
+    {"control_flow", "ControlFlowBuilderPass"},
+    {"def_use", "DefUseBuilderPass"},
+    {"memory", "MemoryAllocPass"},
+    {"memory_stride", "MemoryStridePass"},
+};
+
+const char *GetName(const Config &config) {
+  return *config.passes ? config.passes : "plain";
+}
+
+// Time in microseconds
+struct PassTimes {
+  uint64_t instructions{0};
+  uint64_t compile{0};
+  uint64_t pass{0};
+  uint64_t build_graph{0};
+  uint64_t render_labels{0};
+  uint64_t instrument{0};
+};
+
+Options ParseOptions(int argc, char *argv[]) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc) {
+        throw std::runtime_error("Missing value for " + arg);
+      }
+      return argv[++i];
+    };
+
+    if (arg == "--compiler") {
+      options.compiler = value();
+    } else if (arg == "--plugin") {
+      options.plugin = value();
+    } else if (arg == "--out") {
+      options.out_file_name = value();
+    } else if (arg == "--scale") {
+      options.scale = std::stoi(value());
+    } else {
+      throw std::runtime_error("Unknown argument " + arg);
+    }
+  }
+
+  return options;
+}
+
+// Generation
+
+void GenerateFunction(std::ostream &out, const ModuleShape &shape, int index) {
+  out << "int f" << index << "(int x) {\n";
+  out << "  int acc = x;\n";
+
+  for (int level = 0; level < shape.depth; ++level) {
+    out << std::string(2 * level + 2, ' ') << "if (acc % " << level + 2
+        << " != 0) {\n";
+    out << std::string(2 * level + 4, ' ') << "acc = acc * " << level + 3
+        << " + " << index << ";\n";
+  }
+  for (int level = shape.depth - 1; level >= 0; --level) {
+    out << std::string(2 * level + 2, ' ') << "} else {\n";
+    out << std::string(2 * level + 4, ' ') << "acc ^= " << level + 1
+        << ";\n";
+    out << std::string(2 * level + 2, ' ') << "}\n";
+  }
+
+  out << "  switch (acc & " << shape.switch_cases * 2 - 1 << ") {\n";
+  for (int i = 0; i < shape.switch_cases; ++i) {
+    out << "  case " << i << ":\n";
+    out << "    acc += " << (i * 7 + index) % 101 << ";\n";
+    out << "    break;\n";
+  }
+  out << "  default:\n";
+  out << "    acc -= 1;\n";
+  out << "  }\n";
+
+  out << "  for (int i = 0; i < (acc & 7); ++i) {\n";
+  out << "    acc += i * x;\n";
+  out << "  }\n";
+
+  // Calls make call edges, functions only call previous ones
+  if (index > 0) {
+    out << "  if (acc < 0) {\n";
+    out << "    acc += f" << index - 1 << "(x - 1);\n";
+    out << "  }\n";
+  }
+
+  out << "  return acc;\n";
+  out << "}\n\n";
+}
+
+void GenerateModule(const fs::path &path, const ModuleShape &shape,
+                    int functions) {
+  std::ofstream out{path};
+  for (int i = 0; i < functions; ++i) {
+    GenerateFunction(out, shape, i);
+  }
+
+  out << "int main(int argc, char **argv) { return f" << functions - 1
+      << "(argc) & 1; }\n";
+}
+
+// Measurement
+
+// Event objects of Chrome trace format written by -ftime-trace
+std::vector<std::string> ReadTraceEvents(const fs::path &path) {
+  std::ifstream in{path};
+  if (!in) {
+    throw std::runtime_error("Can't open time trace " + path.string());
+  }
+
+  std::stringstream buffer;
+  buffer << in.rdbuf();
+  std::string trace = buffer.str();
+
+  std::vector<std::string> events;
+  std::regex event_regex{R"(\{"pid"[^{}]*(\{[^{}]*\}[^{}]*)?\})"};
+  for (auto it = std::sregex_iterator(trace.begin(), trace.end(), event_regex);
+       it != std::sregex_iterator(); ++it) {
+    events.push_back(it->str());
+  }
+
+  return events;
+}
+
+std::string GetField(const std::string &event, const std::string &field) {
+  std::smatch match;
+  std::regex field_regex{"\"" + field + R"re(":("([^"]*)"|(\d+)))re"};
+  if (!std::regex_search(event, match, field_regex)) {
+    return "";
+  }
+
+  return match[2].matched ? match[2].str() : match[3].str();
+}
+
+// Phase scopes are reported as totals, nested RenderLabel is excluded from
+// BuildGraph
+PassTimes ParseTrace(const fs::path &path, const Config &config) {
+  PassTimes times;
+  std::map<std::string, uint64_t> totals;
+
+  for (const auto &event : ReadTraceEvents(path)) {
+    std::string name = GetField(event, "name");
+    std::string dur = GetField(event, "dur");
+    if (dur.empty()) {
+      continue;
+    }
+
+    if (name == config.scope) {
+      times.pass += std::stoull(dur);
+      times.instructions +=
+          std::strtoull(GetField(event, "detail").c_str(), nullptr, 10);
+    } else if (name.rfind("Total ", 0) == 0) {
+      totals[name.substr(6)] = std::stoull(dur);
+    }
+  }
+
+  times.compile = totals["ExecuteCompiler"];
+  times.render_labels = totals["RenderLabel"];
+  times.build_graph = totals["BuildGraph"] - std::min(totals["BuildGraph"],
+                                                      times.render_labels);
+  times.instrument = totals["Instrument"];
+
+  return times;
+}
+
+PassTimes Compile(const Options &options, const fs::path &module,
+                  const Config &config, const fs::path &work_dir) {
+  std::string command = "cd " + work_dir.string() + " && ";
+  if (*config.passes) {
+    command += std::string("PASS_LIST=") + config.passes + " ";
+  }
+
+  command += options.compiler + " -O0 -w -c -ftime-trace ";
+  // Per label scopes are too short, but they are still counted in totals
+  command += "-ftime-trace-granularity=100 ";
+  if (*config.passes) {
+    command += "-fpass-plugin=" + options.plugin + " ";
+  }
+  command += module.string() + " -o module.o";
+
+  if (std::system(command.c_str()) != 0) {
+    throw std::runtime_error("Can't compile: " + command);
+  }
+
+  return ParseTrace(work_dir / "module.json", config);
+}
+
+double PerKiloInstructions(uint64_t time, uint64_t instructions) {
+  return instructions ? 1000.0 * time / instructions : 0;
+}
+
+int main(int argc, char *argv[]) {
+  Options options = ParseOptions(argc, argv);
+  if (options.plugin.empty()) {
+    std::cerr << "Usage: " << argv[0]
+              << " --plugin <pass.so> [--compiler <cc>] [--out <csv>]"
+                 " [--scale <n>]"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::ofstream out{options.out_file_name};
+  out << "module,passes,instructions,compile_us,pass_us,build_graph_us,"
+         "render_labels_us,instrument_us,pass_us_per_1k_instructions\n";
+
+  for (const auto &shape : kShapes) {
+    fs::path module_dir = fs::absolute("compile_time_work") / shape.name;
+    fs::remove_all(module_dir);
+    fs::create_directories(module_dir);
+
+    fs::path module = module_dir / "module.c";
+    GenerateModule(module, shape, shape.functions * options.scale);
+
+    for (const auto &config : kConfigs) {
+      fs::path work_dir = module_dir / GetName(config);
+      fs::create_directories(work_dir);
+
+      PassTimes times = Compile(options, module, config, work_dir);
+
+      out << shape.name << "," << GetName(config) << ","
+          << times.instructions << "," << times.compile << ","
+          << times.pass << "," << times.build_graph << ","
+          << times.render_labels << "," << times.instrument << ","
+          << PerKiloInstructions(times.pass, times.instructions) << std::endl;
+    }
+  }
+
+  std::cout << "Results are written to " << options.out_file_name
+            << std::endl;
+  return 0;
+}
@@ -0,0 +1,151 @@
+#include "Pass/FOR_LLVM_Pool.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Compares pool allocator used for substituted allocation sites with malloc
+// on allocation-heavy workloads. Prints CSV to stdout.
+
+struct Allocator {
+  const char *name;
+  void *(*alloc)(size_t);
+  void (*free)(void *);
+};
+
+const Allocator kAllocators[] = {
+    {"malloc", std::malloc, std::free},
+    {"pool", PoolAlloc, PoolFree},
+};
+
+// Every workload returns number of alloc + free pairs it made
+
+// Object is freed right after allocation
+uint64_t Churn(const Allocator &allocator, uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; ++i) {
+    auto *memory = static_cast<volatile char *>(allocator.alloc(32));
+    memory[0] = 1;
+    allocator.free(const_cast<char *>(memory));
+  }
+
+  return iterations;
+}
+
+// Window of live objects of random small sizes, the oldest one dies first
+uint64_t Window(const Allocator &allocator, uint64_t iterations) {
+  constexpr size_t kWindowSize = 4096;
+
+  std::mt19937 rng{42};
+  std::uniform_int_distribution<size_t> size_dist{1, kPoolMaxAllocationSize};
+  std::vector<void *> window(kWindowSize, nullptr);
+
+  for (uint64_t i = 0; i < iterations; ++i) {
+    void *&slot = window[i % kWindowSize];
+    allocator.free(slot);
+    slot = allocator.alloc(size_dist(rng));
+    static_cast<char *>(slot)[0] = 1;
+  }
+
+  for (void *memory : window) {
+    allocator.free(memory);
+  }
+
+  return iterations;
+}
+
+// Linked list is built and then torn down
+uint64_t List(const Allocator &allocator, uint64_t iterations) {
+  struct Node {
+    Node *next;
+    uint64_t payload[5];
+  };
+
+  constexpr uint64_t kListSize = 10000;
+
+  for (uint64_t built = 0; built < iterations; built += kListSize) {
+    Node *head = nullptr;
+    for (uint64_t i = 0; i < kListSize; ++i) {
+      auto *node = static_cast<Node *>(allocator.alloc(sizeof(Node)));
+      node->next = head;
+      node->payload[0] = i;
+      head = node;
+    }
+
+    while (head) {
+      Node *next = head->next;
+      allocator.free(head);
+      head = next;
+    }
+  }
+
+  return iterations;
+}
+
+struct Workload {
+  const char *name;
+  uint64_t (*run)(const Allocator &, uint64_t);
+};
+
+const Workload kWorkloads[] = {
+    {"churn", Churn},
+    {"window", Window},
+    {"list", List},
+};
+
+double MeasureOpsPerSecond(const Workload &workload,
+                           const Allocator &allocator, uint64_t iterations,
+                           size_t n_threads) {
+  std::vector<std::thread> threads;
+  std::vector<uint64_t> ops(n_threads, 0);
+
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n_threads; ++i) {
+    threads.emplace_back(
+        [&, i] { ops[i] = workload.run(allocator, iterations); });
+  }
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  uint64_t total_ops = 0;
+  for (auto thread_ops : ops) {
+    total_ops += thread_ops;
+  }
+
+  return total_ops / elapsed.count();
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t iterations = argc > 1 ? std::stoull(argv[1]) : 10'000'000;
+  size_t max_threads =
+      argc > 2 ? std::stoull(argv[2]) : std::thread::hardware_concurrency();
+  max_threads = std::max<size_t>(max_threads, 1);
+
+  std::cout << "workload,threads,allocator,mops_per_s,speedup\n";
+  for (const auto &workload : kWorkloads) {
+    for (size_t n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+      double baseline = 0;
+      for (const auto &allocator : kAllocators) {
+        double ops_per_s =
+            MeasureOpsPerSecond(workload, allocator, iterations, n_threads);
+        if (baseline == 0) {
+          baseline = ops_per_s;
+        }
+
+        std::cout << workload.name << "," << n_threads << "," << allocator.name
+                  << "," << ops_per_s / 1e6 << "," << ops_per_s / baseline
+                  << "\n";
+      }
+    }
+  }
+
+  return 0;
+}
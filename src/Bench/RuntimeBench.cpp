@@ -0,0 +1,284 @@
+#include "Pass/FOR_LLVM_Log.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Measures cost of the runtime entry points instrumented code calls, so
+// changes of runtime data structures could be compared in isolation from
+// the pass. Prints CSV to stdout.
+
+// Node ids are pointers in instrumented code, so they are sparse
+constexpr uint64_t kNodeBase = 0x5555'0000'0000;
+constexpr uint64_t kNodeStride = 48;
+
+// Fake allocations never dereferenced by runtime, every thread has its own
+constexpr uint64_t kMemoryBase = 0x7f00'0000'0000;
+constexpr uint64_t kThreadMemorySpan = 0x1'0000'0000;
+constexpr uint64_t kAllocationSize = 64;
+constexpr uint64_t kAllocationSites = 16;
+
+// Ids are precomputed, so random generation is not measured
+constexpr size_t kSequenceSize = 1 << 16;
+
+enum class Distribution { kUniform, kSkewed };
+
+const char *GetName(Distribution distribution) {
+  return distribution == Distribution::kUniform ? "uniform" : "skewed";
+}
+
+// Indexes in [0, size). Skewed one is Zipf-like: few indexes are hot, like
+// nodes of an inner loop.
+std::vector<uint64_t> MakeIndexes(Distribution distribution, uint64_t size,
+                                  uint64_t seed) {
+  std::mt19937_64 rng{seed};
+  std::uniform_real_distribution<double> unit{0, 1};
+
+  std::vector<uint64_t> indexes(kSequenceSize);
+  for (auto &index : indexes) {
+    double u = unit(rng);
+    if (distribution == Distribution::kSkewed) {
+      u = std::pow(u, 4);
+    }
+    index = std::min<uint64_t>(u * size, size - 1);
+  }
+
+  return indexes;
+}
+
+uint64_t GetNode(uint64_t index) { return kNodeBase + index * kNodeStride; }
+
+void *GetMemory(size_t thread, uint64_t index) {
+  return reinterpret_cast<void *>(kMemoryBase + thread * kThreadMemorySpan +
+                                  index * kAllocationSize);
+}
+
+// Every benchmark makes `iterations` runtime calls in a thread. `size` is
+// either number of nodes or number of live allocations.
+
+void BenchAddUsage(const std::vector<uint64_t> &indexes, uint64_t, size_t,
+                   uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; ++i) {
+    AddUsage(GetNode(indexes[i % kSequenceSize]));
+  }
+}
+
+// Pair of calls makes one edge, as for instrumented branch
+void BenchPasses(const std::vector<uint64_t> &indexes, uint64_t, size_t,
+                 uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i += 2) {
+    PrepareIncreasePasses(GetNode(indexes[i % kSequenceSize]));
+    IncreaseNPasses(GetNode(indexes[(i + 1) % kSequenceSize]));
+  }
+}
+
+// Pair of calls makes one call of instrumented function, `size` functions
+// are called from the same context
+void BenchEnterExit(const std::vector<uint64_t> &indexes, uint64_t, size_t,
+                    uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i += 2) {
+    uint64_t function = GetNode(indexes[i % kSequenceSize]);
+    EnterFunction(function);
+    ExitFunction(function);
+  }
+}
+
+// Same as above, but functions are timed instead of counted in contexts
+void BenchTimeEnterExit(const std::vector<uint64_t> &indexes, uint64_t,
+                        size_t, uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i += 2) {
+    uint64_t function = GetNode(indexes[i % kSequenceSize]);
+    TimeFunctionEnter(function);
+    TimeFunctionExit(function);
+  }
+}
+
+void AddLiveAllocations(uint64_t live, size_t thread) {
+  for (uint64_t i = 0; i < live; ++i) {
+    AddDynamicallyAllocatedMemory(GetNode(i % kAllocationSites),
+                                  GetMemory(thread, i), kAllocationSize);
+  }
+}
+
+void RemoveLiveAllocations(uint64_t live, size_t thread) {
+  for (uint64_t i = 0; i < live; ++i) {
+    RemoveDynamicallAllocatedMemory(GetNode(i % kAllocationSites),
+                                    GetMemory(thread, i));
+  }
+}
+
+// Allocations made or freed by Add and Remove benchmarks follow the live
+// ones, so they are added to the same tree
+void AddExtraAllocations(uint64_t live, size_t thread, uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; ++i) {
+    AddDynamicallyAllocatedMemory(GetNode(i % kAllocationSites),
+                                  GetMemory(thread, live + i),
+                                  kAllocationSize);
+  }
+}
+
+void RemoveExtraAllocations(uint64_t live, size_t thread,
+                            uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; ++i) {
+    RemoveDynamicallAllocatedMemory(GetNode(i % kAllocationSites),
+                                    GetMemory(thread, live + i));
+  }
+}
+
+void BenchAdd(const std::vector<uint64_t> &, uint64_t live, size_t thread,
+              uint64_t iterations) {
+  AddExtraAllocations(live, thread, iterations);
+}
+
+void BenchRemove(const std::vector<uint64_t> &, uint64_t live, size_t thread,
+                 uint64_t iterations) {
+  RemoveExtraAllocations(live, thread, iterations);
+}
+
+// Picked allocation is freed and allocated again, so number of live ones
+// stays the same
+void BenchAllocFree(const std::vector<uint64_t> &indexes, uint64_t,
+                    size_t thread, uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i += 2) {
+    uint64_t index = indexes[i % kSequenceSize];
+    uint64_t node = GetNode(index % kAllocationSites);
+    RemoveDynamicallAllocatedMemory(node, GetMemory(thread, index));
+    AddDynamicallyAllocatedMemory(node, GetMemory(thread, index),
+                                  kAllocationSize);
+  }
+}
+
+// Every other access misses, as stack and global memory does
+void BenchLogMemory(const std::vector<uint64_t> &indexes, uint64_t live,
+                    size_t thread, uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; ++i) {
+    uint64_t index = indexes[i % kSequenceSize];
+    LogIfMemoryIsDynamicallyAllocated(
+        GetNode(index % kAllocationSites),
+        GetMemory(thread, i % 2 == 0 ? index : live + index));
+  }
+}
+
+// Same as above through the entry point the memory pass emits, with field
+// offsets and bandwidth. About every fourth access is a store.
+void BenchLogAccess(const std::vector<uint64_t> &indexes, uint64_t live,
+                    size_t thread, uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; ++i) {
+    uint64_t index = indexes[i % kSequenceSize];
+    LogDynamicMemoryAccess(
+        GetNode(index % kAllocationSites),
+        GetMemory(thread, i % 2 == 0 ? index : live + index), sizeof(uint64_t),
+        index % 4 == 0 ? kMemoryAccessStore : kMemoryAccessLoad);
+  }
+}
+
+using Setup = void (*)(uint64_t live, size_t thread, uint64_t iterations);
+
+struct Benchmark {
+  const char *name;
+  void (*run)(const std::vector<uint64_t> &, uint64_t, size_t, uint64_t);
+  // `size` live allocations are made by each thread before measurement
+  bool needs_live;
+  // Not measured, run by each thread before and after `run`
+  Setup before{nullptr};
+  Setup after{nullptr};
+};
+
+const Benchmark kBenchmarks[] = {
+    {"AddUsage", BenchAddUsage, false},
+    {"IncreaseNPasses", BenchPasses, false},
+    {"EnterExitFunction", BenchEnterExit, false},
+    {"TimeFunctionEnterExit", BenchTimeEnterExit, false},
+    {"AddDynamicallyAllocatedMemory", BenchAdd, true, nullptr,
+     RemoveExtraAllocations},
+    {"RemoveDynamicallAllocatedMemory", BenchRemove, true,
+     AddExtraAllocations},
+    {"AllocFree", BenchAllocFree, true},
+    {"LogIfMemoryIsDynamicallyAllocated", BenchLogMemory, true},
+    {"LogDynamicMemoryAccess", BenchLogAccess, true},
+};
+
+const uint64_t kSizes[] = {16, 1024, 65536};
+
+// Returns average wall time of a call seen by the slowest thread
+double MeasureNsPerOp(const Benchmark &benchmark, Distribution distribution,
+                      uint64_t size, uint64_t iterations, size_t n_threads) {
+  std::vector<std::vector<uint64_t>> indexes;
+  for (size_t i = 0; i < n_threads; ++i) {
+    indexes.push_back(MakeIndexes(distribution, size, i + 1));
+  }
+
+  std::atomic<size_t> ready{0};
+  std::vector<double> elapsed_ns(n_threads, 0);
+  std::vector<std::thread> threads;
+
+  for (size_t i = 0; i < n_threads; ++i) {
+    threads.emplace_back([&, i] {
+      if (benchmark.needs_live) {
+        AddLiveAllocations(size, i);
+      }
+      if (benchmark.before) {
+        benchmark.before(size, i, iterations);
+      }
+
+      ready++;
+      while (ready.load() != n_threads) {
+      }
+
+      auto start = std::chrono::steady_clock::now();
+      benchmark.run(indexes[i], size, i, iterations);
+      elapsed_ns[i] = std::chrono::duration<double, std::nano>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+
+      if (benchmark.after) {
+        benchmark.after(size, i, iterations);
+      }
+      if (benchmark.needs_live) {
+        RemoveLiveAllocations(size, i);
+      }
+    });
+  }
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  // Allocation history grows with every call, it would slow down next
+  // batches
+  ResetAllocatedMemoryInfo();
+
+  return *std::max_element(elapsed_ns.begin(), elapsed_ns.end()) / iterations;
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t iterations = argc > 1 ? std::stoull(argv[1]) : 1'000'000;
+  size_t max_threads =
+      argc > 2 ? std::stoull(argv[2]) : std::thread::hardware_concurrency();
+  max_threads = std::max<size_t>(max_threads, 1);
+
+  std::cout << "function,distribution,size,threads,ns_per_op,mops_per_s\n";
+  for (const auto &benchmark : kBenchmarks) {
+    for (auto distribution : {Distribution::kUniform, Distribution::kSkewed}) {
+      for (uint64_t size : kSizes) {
+        for (size_t n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+          double ns_per_op = MeasureNsPerOp(benchmark, distribution, size,
+                                            iterations, n_threads);
+
+          std::cout << benchmark.name << "," << GetName(distribution) << ","
+                    << size << "," << n_threads << "," << ns_per_op << ","
+                    << n_threads * 1e3 / ns_per_op << "\n";
+        }
+      }
+    }
+  }
+
+  return 0;
+}
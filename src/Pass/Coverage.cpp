@@ -0,0 +1,85 @@
+#include "Pass/Coverage.hpp"
+
+#include <regex>
+#include <sstream>
+#include <unordered_set>
+
+namespace dot {
+
+namespace {
+
+const char kUncoveredFillColor[] = "#EEEEEE";
+const char kUncoveredFontColor[] = "#999999";
+
+} // namespace
+
+bool Coverage::ParseLine(const std::string &line) {
+  static const std::regex coverage_regex(
+      R"(\s*node(\d+)(?:\s*->\s*node(\d+))?\s*\[covered=([01])\];?\s*)");
+
+  std::smatch match;
+  if (!std::regex_match(line, match, coverage_regex)) {
+    return false;
+  }
+
+  uint64_t from = std::stoull(match[1].str());
+  bool covered = match[3].str() == "1";
+  if (!match[2].matched) {
+    // Flags of the same block from several modules are merged
+    blocks_[from] = blocks_[from] || covered;
+    return true;
+  }
+
+  std::pair<uint64_t, uint64_t> edge{from, std::stoull(match[2].str())};
+  edges_.insert(edge);
+  if (covered) {
+    covered_edges_.insert(edge);
+  }
+  return true;
+}
+
+std::string Coverage::GrayOut(const std::string &graph,
+                              const GraphCosts &costs) const {
+  std::unordered_map<uint64_t, bool> blocks = blocks_;
+  for (const auto &edge : edges_) {
+    bool &covered = blocks[edge.second];
+    covered = covered || covered_edges_.count(edge);
+  }
+
+  std::unordered_set<uint64_t> uncovered;
+  for (const auto &[node, block] : costs.blocks) {
+    auto block_it = blocks.find(block);
+    if (block_it != blocks.end() && !block_it->second) {
+      uncovered.insert(node);
+    }
+  }
+
+  auto is_dashed = [&](uint64_t from, uint64_t to) {
+    return uncovered.count(from) || uncovered.count(to) ||
+           (edges_.count({from, to}) && !covered_edges_.count({from, to}));
+  };
+
+  std::regex edge_regex(R"((\s*node(\d+) -> node(\d+) \[)(.*))");
+
+  std::stringstream out;
+  std::string line;
+  std::stringstream ss{graph};
+  while (std::getline(ss, line)) {
+    std::smatch match;
+    if (std::regex_match(line, match, edge_regex) &&
+        is_dashed(std::stoull(match[2].str()), std::stoull(match[3].str()))) {
+      out << match[1].str() << "style=dashed, " << match[4].str() << "\n";
+    } else {
+      out << line << "\n";
+    }
+  }
+
+  for (uint64_t node : uncovered) {
+    out << "node" << node << " [fillcolor=\"" << kUncoveredFillColor
+        << "\", fontcolor=\"" << kUncoveredFontColor << "\"];\n";
+  }
+
+  return out.str();
+}
+
+} // namespace dot
@@ -0,0 +1,152 @@
+#include "Pass/CycleReport.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <regex>
+#include <sstream>
+#include <vector>
+
+namespace dot {
+
+namespace {
+
+constexpr size_t kMaxLabelLength = 60;
+
+// Label without escapes and line breaks, short enough for a report line
+std::string ShortenLabel(std::string label) {
+  size_t escape = label.find('\\');
+  if (escape != std::string::npos) {
+    label.resize(escape);
+  }
+  if (label.size() > kMaxLabelLength) {
+    label.resize(kMaxLabelLength - 3);
+    label += "...";
+  }
+  return label;
+}
+
+} // namespace
+
+uint64_t GraphCosts::GetCost(uint64_t node) const {
+  auto cost_it = costs.find(node);
+  return cost_it != costs.end() ? cost_it->second : 1;
+}
+
+GraphCosts ParseGraphCosts(const std::string &graph) {
+  GraphCosts costs;
+  std::regex cluster_regex(R"(\s*subgraph cluster_(\d+) \{.*)");
+  std::regex label_regex(R"re(\s*label="(.*)";\s*)re");
+  std::regex node_regex(R"(\s*node(\d+)\s*\[.*)");
+  std::regex cost_regex(R"(, cost=(\d+)\];\s*$)");
+
+  // Function clusters are the outermost ones, blocks are nested in them
+  std::vector<uint64_t> clusters;
+  bool expect_label = false;
+
+  std::string line;
+  std::stringstream ss{graph};
+  while (std::getline(ss, line)) {
+    std::smatch match;
+    if (std::regex_match(line, match, cluster_regex)) {
+      uint64_t cluster = std::stoull(match[1].str());
+      if (clusters.size() == 1) {
+        costs.functions[cluster] = clusters[0];
+        costs.entry_blocks.try_emplace(clusters[0], cluster);
+      }
+      clusters.push_back(cluster);
+      expect_label = true;
+    } else if (line == "}") {
+      if (!clusters.empty()) {
+        clusters.pop_back();
+      }
+    } else if (expect_label && std::regex_match(line, match, label_regex)) {
+      costs.labels[clusters.back()] = match[1].str();
+      expect_label = false;
+    } else if (std::regex_match(line, match, node_regex)) {
+      uint64_t node = std::stoull(match[1].str());
+      if (clusters.size() >= 2) {
+        costs.blocks[node] = clusters[1];
+      }
+
+      std::smatch cost_match;
+      if (std::regex_search(line, cost_match, cost_regex)) {
+        costs.costs[node] = std::stoull(cost_match[1].str());
+      }
+    }
+  }
+
+  return costs;
+}
+
+void CycleReport::Add(const GraphCosts &graph,
+                      const std::unordered_map<uint64_t, uint64_t> &cycles) {
+  if (graph.costs.empty()) {
+    return;
+  }
+
+  auto get_label = [&](uint64_t cluster) {
+    auto label_it = graph.labels.find(cluster);
+    return label_it != graph.labels.end() ? ShortenLabel(label_it->second)
+                                          : std::to_string(cluster);
+  };
+
+  std::lock_guard<std::mutex> lock{mutex_};
+  for (const auto &[node, node_cycles] : cycles) {
+    auto block_it = graph.blocks.find(node);
+    if (block_it == graph.blocks.end()) {
+      continue;
+    }
+
+    uint64_t block = block_it->second;
+    uint64_t function = graph.functions.at(block);
+
+    auto &function_entry = functions_[function];
+    if (function_entry.label.empty()) {
+      function_entry.label = get_label(function);
+    }
+    function_entry.cycles += node_cycles;
+
+    auto &block_entry = blocks_[block];
+    if (block_entry.label.empty()) {
+      block_entry.label = function_entry.label + ": " + get_label(block);
+    }
+    block_entry.cycles += node_cycles;
+
+    total_ += node_cycles;
+  }
+}
+
+void CycleReport::Print(std::ostream &out, size_t top) const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  if (total_ == 0) {
+    return;
+  }
+
+  auto print = [&](const char *title,
+                   const std::unordered_map<uint64_t, Entry> &entries) {
+    std::vector<const Entry *> sorted;
+    for (const auto &[id, entry] : entries) {
+      sorted.push_back(&entry);
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              [](const Entry *lhs, const Entry *rhs) {
+                return lhs->cycles > rhs->cycles;
+              });
+    if (sorted.size() > top) {
+      sorted.resize(top);
+    }
+
+    out << title << ":\n";
+    for (const Entry *entry : sorted) {
+      out << std::fixed << std::setprecision(1) << std::setw(7)
+          << 100.0 * entry->cycles / total_ << "% " << std::setw(14)
+          << entry->cycles << "  " << entry->label << "\n";
+    }
+  };
+
+  out << "Estimated cycles: " << total_ << "\n";
+  print("Functions", functions_);
+  print("Blocks", blocks_);
+}
+
+} // namespace dot
@@ -1,10 +1,35 @@
 #include "Pass/FOR_LLVM_Log.hpp"
+#include "Pass/FOR_LLVM_Pool.hpp"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <sstream>
 #include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 namespace {
 
@@ -16,6 +41,82 @@ std::string InterpolateColor(double ratio) {
   return std::string(buffer);
 }
 
+uint64_t ReadTimestamp() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Values are spread by the power of two they fit in: 0, 1, 2-3, 4-7, ...
+size_t Log2Bucket(uint64_t value) {
+  return value == 0 ? 0 : 64 - __builtin_clzll(value);
+}
+
+uint64_t Log2BucketBound(size_t bucket) {
+  return bucket == 0 ? 0 : (uint64_t{1} << (bucket - 1));
+}
+
+// Tables of threads, one made at the first call of every thread. Probes
+// update the table of their thread under its own mutex, which is contended
+// only while printing, so threads don't serialize on profiling. Tables
+// outlive their threads and are merged when printing. Profilers are
+// singletons, there is one registry per table type.
+template <typename Table> class ThreadTables {
+public:
+  struct Slot {
+    std::mutex mutex;
+    Table table;
+    // Small number of the thread, in order of the first call, from 1
+    uint32_t thread{0};
+    // Set under mutex when the thread exits
+    bool finished{false};
+  };
+
+  // Slot of the calling thread
+  Slot &Get() {
+    thread_local Owner owner{*this};
+    assert(owner.tables == this);
+    return *owner.slot;
+  }
+
+  // Visits slots of all threads, each under its mutex
+  template <typename Visit> void ForEach(Visit visit) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    for (auto &slot : slots_) {
+      std::lock_guard<std::mutex> slot_lock{slot->mutex};
+      visit(*slot);
+    }
+  }
+
+private:
+  // Table may have Finish(), e.g. to end frames still open, it's called when
+  // the thread exits
+  struct Owner {
+    ThreadTables *tables;
+    Slot *slot;
+
+    explicit Owner(ThreadTables &tables) : tables(&tables) {
+      std::lock_guard<std::mutex> lock{tables.mutex_};
+      tables.slots_.push_back(std::make_unique<Slot>());
+      slot = tables.slots_.back().get();
+      slot->thread = tables.slots_.size();
+    }
+
+    ~Owner() {
+      std::lock_guard<std::mutex> lock{slot->mutex};
+      if constexpr (requires(Table &table) { table.Finish(); }) {
+        slot->table.Finish();
+      }
+      slot->finished = true;
+    }
+  };
+
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<Slot>> slots_;
+};
+
 class NPassesLogger {
 public:
   // singleton
@@ -25,30 +126,45 @@ public:
   }
 
   void PrepareIncreasePasses(uint64_t from_node) {
-    from_ = from_node;
-    invalid = false;
+    ThreadTable &thread = threads_.Get().table;
+    thread.from = from_node;
+    thread.invalid = false;
   }
 
   void IncreaseNPasses(uint64_t to_node) {
-    if (invalid) {
+    auto &thread = threads_.Get();
+    if (thread.table.invalid) {
       return;
     }
 
-    passes_[{from_, to_node}]++;
-    from_ = 0;
-    invalid = true;
+    {
+      std::lock_guard<std::mutex> lock{thread.mutex};
+      thread.table.passes[{thread.table.from, to_node}]++;
+    }
+    thread.table.from = 0;
+    thread.table.invalid = true;
   }
 
   void PrintNPassesEdges(const char *out_file_name) {
     assert(out_file_name);
     std::ofstream out{out_file_name};
 
+    std::map<std::pair<uint64_t, uint64_t>, uint64_t> passes;
+    threads_.ForEach([&](auto &thread) {
+      for (const auto &[edge, count] : thread.table.passes) {
+        passes[edge] += count;
+      }
+    });
+    if (passes.empty()) {
+      return;
+    }
+
     uint64_t max_passes =
-        std::max_element(passes_.begin(), passes_.end(), [](auto &a, auto &b) {
+        std::max_element(passes.begin(), passes.end(), [](auto &a, auto &b) {
           return a.second < b.second;
         })->second;
 
-    for (const auto &[edge, count] : passes_) {
+    for (const auto &[edge, count] : passes) {
       double ratio = (double)count / max_passes;
       assert(ratio <= 1);
 
@@ -62,13 +178,27 @@ public:
   }
 
 private:
+  struct EdgeHash {
+    size_t operator()(const std::pair<uint64_t, uint64_t> &edge) const {
+      return std::hash<uint64_t>{}(edge.second) ^
+             (edge.first * 0x9e3779b97f4a7c15ULL);
+    }
+  };
+
+  struct ThreadTable {
+    // Edge start is remembered per thread, so threads don't mix their
+    // edges. Set and taken by the thread itself, no need to lock
+    uint64_t from{0};
+    bool invalid{true};
+
+    std::unordered_map<std::pair<uint64_t, uint64_t>, uint64_t, EdgeHash>
+        passes;
+  };
+
   NPassesLogger() = default;
 
 private:
-  std::map<std::pair<uint64_t, uint64_t>, uint64_t> passes_;
-
-  uint64_t from_;
-  bool invalid{true};
+  ThreadTables<ThreadTable> threads_;
 };
 
 class NodesUsageCounter {
@@ -79,14 +209,25 @@ public:
     return counter;
   }
 
-  void AddUsage(uint64_t node) { counter_[node]++; }
+  void AddUsage(uint64_t node) {
+    auto &thread = threads_.Get();
+    std::lock_guard<std::mutex> lock{thread.mutex};
+    thread.table[node]++;
+  }
 
   void PrintUsages(const char *out_file_name) {
     assert(out_file_name);
     std::ofstream out{out_file_name};
 
-    for (const auto &[node, counter] : counter_) {
-      out << "node" << node << " " << counter << "\n";
+    std::map<uint64_t, uint64_t> counter;
+    threads_.ForEach([&](auto &thread) {
+      for (const auto &[node, count] : thread.table) {
+        counter[node] += count;
+      }
+    });
+
+    for (const auto &[node, count] : counter) {
+      out << "node" << node << " " << count << "\n";
     }
   }
 
@@ -94,7 +235,261 @@ private:
   NodesUsageCounter() = default;
 
 private:
-  std::map<uint64_t, uint64_t> counter_;
+  // Counters of nodes
+  ThreadTables<std::unordered_map<uint64_t, uint64_t>> threads_;
+};
+
+// Sampled accesses of threads to cache lines of heap allocations. A line
+// touched by several threads, one of which writes, is shared. If two
+// threads touch disjoint bytes, it is false sharing, which padding or
+// splitting the object removes, otherwise threads contend for the same
+// data. Lines are classified when their allocation is freed or at
+// exit. A line shared by neighbouring small allocations belongs to the
+// first one sampled. Callers synchronize.
+class SharingTable {
+public:
+  // Threads buffer samples and record them in batches
+  struct Sample {
+    void *mem;
+    uint64_t size;
+    bool store;
+    uint64_t node;
+    void *base;
+    uint64_t site;
+  };
+
+  void Record(const Sample &sample, uint32_t thread) {
+    auto [mem, size, store, node, base, site] = sample;
+    auto address = reinterpret_cast<uintptr_t>(mem);
+    uint64_t last = address + std::max<uint64_t>(size, 1) - 1;
+
+    // Unaligned accesses may touch two lines
+    for (uintptr_t line_address = address & ~(kLineSize - 1);
+         line_address <= last; line_address += kLineSize) {
+      auto [line_it, inserted] = lines_.try_emplace(line_address);
+      Line &line = line_it->second;
+      if (inserted) {
+        line.site = site;
+        line.offset = static_cast<int64_t>(line_address) -
+                      static_cast<int64_t>(reinterpret_cast<uintptr_t>(base));
+      }
+
+      ThreadAccess *access = FindThread(line, thread);
+      if (!access) {
+        continue;
+      }
+
+      uint64_t first_byte = std::max<uint64_t>(address, line_address);
+      uint64_t last_byte =
+          std::min<uint64_t>(last, line_address + kLineSize - 1);
+      uint64_t mask =
+          GetMask(first_byte - line_address, last_byte - first_byte + 1);
+      (store ? access->write_mask : access->read_mask) |= mask;
+      access->samples++;
+      AddNode(*access, node);
+    }
+  }
+
+  void Release(void *base, uint64_t size) {
+    auto address = reinterpret_cast<uintptr_t>(base);
+    auto begin = lines_.lower_bound(address & ~(kLineSize - 1));
+    auto end = lines_.upper_bound(address + std::max<uint64_t>(size, 1) - 1);
+    for (auto line_it = begin; line_it != end; ++line_it) {
+      Classify(line_it->second);
+    }
+    lines_.erase(begin, end);
+  }
+
+  // Lines of allocations live at exit are classified too
+  void Print(std::ofstream &out,
+             const std::map<uint64_t, std::string> &site_names) {
+    for (auto &[address, line] : lines_) {
+      Classify(line);
+    }
+    lines_.clear();
+
+    std::vector<std::pair<const SiteLine *, const SharedLine *>> sorted;
+    for (auto &[site_line, shared] : shared_) {
+      sorted.emplace_back(&site_line, &shared);
+    }
+    // False sharing first, it is the one fixed by layout
+    std::sort(sorted.begin(), sorted.end(), [](auto &lhs, auto &rhs) {
+      return std::make_pair(lhs.second->false_lines != 0,
+                            lhs.second->samples) >
+             std::make_pair(rhs.second->false_lines != 0,
+                            rhs.second->samples);
+    });
+    if (sorted.size() > kMaxReportedLines) {
+      sorted.resize(kMaxReportedLines);
+    }
+
+    for (auto &[site_line, shared] : sorted) {
+      auto [site, offset] = *site_line;
+      out << "site node" << site;
+      if (auto name_it = site_names.find(site); name_it != site_names.end()) {
+        out << " (" << name_it->second << ")";
+      }
+      int64_t line_end = offset + static_cast<int64_t>(kLineSize) - 1;
+      out << " line " << FormatOffset(offset) << ".." << FormatOffset(line_end)
+          << ": false sharing in " << shared->false_lines
+          << " objects, contention in " << shared->true_lines << " objects, "
+          << shared->samples << " samples\n";
+
+      const Line &example = shared->example;
+      for (size_t i = 0; i < example.n_threads; ++i) {
+        const ThreadAccess &access = example.threads[i];
+        out << "  thread " << access.thread;
+        if (access.write_mask) {
+          out << " writes " << FormatBytes(access.write_mask, example.offset);
+        }
+        if (access.read_mask & ~access.write_mask) {
+          out << " reads "
+              << FormatBytes(access.read_mask & ~access.write_mask,
+                             example.offset);
+        }
+        for (size_t j = 0; j < kMaxNodesPerThread && access.nodes[j]; ++j) {
+          out << (j == 0 ? " by node" : ", node") << access.nodes[j];
+        }
+        out << "\n";
+      }
+    }
+  }
+
+private:
+  static constexpr uintptr_t kLineSize = 64;
+  static constexpr size_t kMaxThreadsPerLine = 4;
+  static constexpr size_t kMaxNodesPerThread = 2;
+  static constexpr size_t kMaxReportedLines = 50;
+
+  struct ThreadAccess {
+    uint32_t thread{0};
+    uint64_t read_mask{0};
+    uint64_t write_mask{0};
+    uint64_t samples{0};
+    // first instructions seen, 0 for empty slots
+    std::array<uint64_t, kMaxNodesPerThread> nodes{};
+  };
+
+  struct Line {
+    uint64_t site{0};
+    // of the line start from allocation base, negative for a base that
+    // isn't aligned
+    int64_t offset{0};
+    // Threads beyond the first kMaxThreadsPerLine aren't recorded
+    std::array<ThreadAccess, kMaxThreadsPerLine> threads{};
+    size_t n_threads{0};
+  };
+
+  // Lines of all objects of a site at the same offset
+  using SiteLine = std::pair<uint64_t, int64_t>;
+  struct SharedLine {
+    uint64_t false_lines{0};
+    uint64_t true_lines{0};
+    uint64_t samples{0};
+    // The most sampled line, false sharing if there was any
+    Line example;
+    uint64_t example_samples{0};
+    bool example_false{false};
+  };
+
+  static uint64_t GetMask(uint64_t first, uint64_t size) {
+    uint64_t bits = size >= 64 ? ~uint64_t{0} : (uint64_t{1} << size) - 1;
+    return bits << first;
+  }
+
+  static ThreadAccess *FindThread(Line &line, uint32_t thread) {
+    for (size_t i = 0; i < line.n_threads; ++i) {
+      if (line.threads[i].thread == thread) {
+        return &line.threads[i];
+      }
+    }
+    if (line.n_threads == kMaxThreadsPerLine) {
+      return nullptr;
+    }
+
+    ThreadAccess &access = line.threads[line.n_threads++];
+    access.thread = thread;
+    return &access;
+  }
+
+  static void AddNode(ThreadAccess &access, uint64_t node) {
+    for (uint64_t &slot : access.nodes) {
+      if (slot == node) {
+        return;
+      }
+      if (slot == 0) {
+        slot = node;
+        return;
+      }
+    }
+  }
+
+  // Threads are compared in pairs, at least one of them writing, so e.g.
+  // a main thread initializing the whole object doesn't hide false sharing
+  // between workers
+  void Classify(const Line &line) {
+    bool false_sharing = false;
+    bool contention = false;
+    uint64_t samples = 0;
+    for (size_t i = 0; i < line.n_threads; ++i) {
+      const ThreadAccess &first = line.threads[i];
+      samples += first.samples;
+      for (size_t j = i + 1; j < line.n_threads; ++j) {
+        const ThreadAccess &second = line.threads[j];
+        if (!first.write_mask && !second.write_mask) {
+          continue;
+        }
+
+        uint64_t first_mask = first.read_mask | first.write_mask;
+        uint64_t second_mask = second.read_mask | second.write_mask;
+        (first_mask & second_mask ? contention : false_sharing) = true;
+      }
+    }
+    if (!false_sharing && !contention) {
+      return;
+    }
+
+    auto &shared = shared_[{line.site, line.offset}];
+    shared.false_lines += false_sharing;
+    shared.true_lines += contention;
+    shared.samples += samples;
+    if (std::make_pair(false_sharing, samples) >
+        std::make_pair(shared.example_false, shared.example_samples)) {
+      shared.example = line;
+      shared.example_samples = samples;
+      shared.example_false = false_sharing;
+    }
+  }
+
+  static std::string FormatOffset(int64_t offset) {
+    return (offset < 0 ? "-" : "+") + std::to_string(std::abs(offset));
+  }
+
+  // Runs of set bits as ranges of offsets from allocation base
+  static std::string FormatBytes(uint64_t mask, int64_t line_offset) {
+    std::string ranges;
+    for (int64_t bit = 0; bit < 64; ++bit) {
+      if (!(mask >> bit & 1)) {
+        continue;
+      }
+
+      int64_t last = bit;
+      while (last + 1 < 64 && (mask >> (last + 1) & 1)) {
+        ++last;
+      }
+      if (!ranges.empty()) {
+        ranges += ",";
+      }
+      ranges += FormatOffset(line_offset + bit) + ".." +
+                FormatOffset(line_offset + last);
+      bit = last;
+    }
+    return ranges;
+  }
+
+private:
+  std::map<uintptr_t, Line> lines_;
+  std::map<SiteLine, SharedLine> shared_;
 };
 
 class MemoryTracker {
@@ -105,30 +500,172 @@ public:
     return tracker;
   }
 
-  void AddDynMemCreation(uint64_t node, void *mem) {
-    assert(last_node_.count(mem) == 0);
+  void AddDynMemCreation(uint64_t node, void *mem, uint64_t size) {
+    // failed allocation
+    if (!mem) {
+      return;
+    }
+
+    std::lock_guard<std::shared_mutex> lock{mutex_};
+    AddAllocation(node, mem, size);
+  }
 
-    last_node_[mem] = node;
-    history_[mem].push_back(node);
+  void RegisterSite(uint64_t node, const char *name) {
+    std::lock_guard<std::shared_mutex> lock{mutex_};
+    site_names_[node] = name;
   }
 
   void LogMemIfDyn(uint64_t node, void *mem) {
-    if (last_node_.count(mem) == 0) {
+    std::shared_lock<std::shared_mutex> lock{mutex_};
+    auto live_it = live_.find(mem);
+    if (live_it == live_.end()) {
       return;
     }
 
-    last_node_[mem] = node;
-    history_[mem].push_back(node);
+    auto &thread = threads_.Get();
+    std::lock_guard<std::mutex> thread_lock{thread.mutex};
+    thread.table.history[live_it->second.allocation_index].push_back(node);
+  }
+
+  // Unlike LogMemIfDyn, mem could point inside of allocation. Returns
+  // whether it does, i.e. whether the access is to the heap.
+  bool LogMemAccess(uint64_t node, void *mem, uint64_t size, uint64_t kind) {
+    if (kind & (kMemoryAccessStack | kMemoryAccessGlobal)) {
+      return false;
+    }
+
+    // Decided by the thread alone, a sample costs no more shared state than
+    // any other access
+    bool sample = false;
+    if (uint64_t period = sharing_period_.load(std::memory_order_relaxed)) {
+      thread_local uint64_t n_accesses = 0;
+      sample = ++n_accesses % period == 0;
+    }
+
+    std::shared_lock<std::shared_mutex> lock{mutex_};
+    auto live_it = FindAllocation(mem);
+    if (live_it == live_.end()) {
+      return false;
+    }
+
+    LiveAllocation &allocation = live_it->second;
+    uint64_t offset =
+        static_cast<char *>(mem) - static_cast<char *>(live_it->first);
+
+    {
+      auto &thread = threads_.Get();
+      std::lock_guard<std::mutex> thread_lock{thread.mutex};
+      thread.table.history[allocation.allocation_index].push_back(node);
+
+      auto &field = thread.table.fields[allocation.site]
+                                       [offset / kOffsetBucketSize];
+      (kind & kMemoryAccessStore ? field.stores : field.loads)++;
+      field.bytes += size;
+
+      if (sample) {
+        thread.table.samples.push_back({mem, size,
+                                        (kind & kMemoryAccessStore) != 0, node,
+                                        live_it->first, allocation.site});
+        std::atomic_ref<bool>{allocation.sampled}.store(
+            true, std::memory_order_relaxed);
+        if (thread.table.samples.size() == kMaxBufferedSamples) {
+          std::lock_guard<std::mutex> sharing_lock{sharing_mutex_};
+          RecordSamples(thread);
+        }
+      }
+    }
+
+    uint64_t touched = 0;
+    uint64_t last_offset = offset + std::max<uint64_t>(size, 1) - 1;
+    for (uint64_t bucket = offset / kOffsetBucketSize;
+         bucket <= last_offset / kOffsetBucketSize && bucket < 64; ++bucket) {
+      touched |= uint64_t{1} << bucket;
+    }
+    // Threads share the allocation, bits are set only once, so its line
+    // isn't written on every access
+    std::atomic_ref<uint64_t> touched_buckets{allocation.touched_buckets};
+    if ((touched_buckets.load(std::memory_order_relaxed) & touched) !=
+        touched) {
+      touched_buckets.fetch_or(touched, std::memory_order_relaxed);
+    }
+    return true;
+  }
+
+  // Forgets allocations and their history, site names and settings stay
+  void Reset() {
+    std::lock_guard<std::shared_mutex> lock{mutex_};
+    live_.clear();
+    history_.clear();
+    threads_.ForEach([](auto &thread) { thread.table = {}; });
+    sites_.clear();
+    sharing_ = SharingTable{};
+    n_allocations_ = 0;
+  }
+
+  // Every period-th access of a thread, which may be to the heap, is
+  // sampled into sharing table
+  void EnableSharing(uint64_t period) {
+    sharing_period_.store(period, std::memory_order_relaxed);
+  }
+
+  void PrintSharing(const char *out_file_name) {
+    assert(out_file_name);
+
+    std::ofstream out{out_file_name};
+
+    std::lock_guard<std::shared_mutex> lock{mutex_};
+    MergeThreads();
+    sharing_.Print(out, site_names_);
   }
 
   void RemoveDynMem(uint64_t node, void *mem) {
-    auto last_node_it = last_node_.find(mem);
+    // free(NULL) is a no-op
+    if (!mem) {
+      return;
+    }
+
+    std::lock_guard<std::shared_mutex> lock{mutex_};
+    // memory allocated in a module which isn't instrumented
+    if (live_.count(mem) == 0) {
+      return;
+    }
+
+    RemoveAllocation(node, mem);
+  }
+
+  void ReallocDynMem(uint64_t node, void *old_mem, void *new_mem,
+                     uint64_t size) {
+    std::lock_guard<std::shared_mutex> lock{mutex_};
+    // Memory allocated in a module which isn't instrumented is not tracked,
+    // its reallocation is counted as a fresh allocation
+    bool tracked = old_mem && live_.count(old_mem) != 0;
+    if (!new_mem) {
+      // realloc(mem, 0) may free the block, otherwise the old one is intact
+      if (size == 0 && tracked) {
+        RemoveAllocation(node, old_mem);
+      }
+      return;
+    }
+
+    uint64_t old_size = 0;
+    if (tracked) {
+      old_size = live_.at(old_mem).size;
+      RemoveAllocation(node, old_mem);
+    }
 
-    assert(last_node_it != last_node_.end());
+    AddAllocation(node, new_mem, size);
 
-    last_node_.erase(last_node_.find(mem));
-    history_[mem].push_back(node);
-    history_[mem].push_back(kHistoryNodesDelimeter);
+    auto &site = sites_[node];
+    site.reallocs++;
+    site.moves += tracked && old_mem != new_mem;
+    if (size > old_size) {
+      site.grows++;
+      if (old_size != 0) {
+        site.growth_factor_sum += static_cast<double>(size) / old_size;
+      }
+    } else if (size < old_size) {
+      site.shrinks++;
+    }
   }
 
   void Print(const char *out_file_name) {
@@ -136,65 +673,1948 @@ public:
 
     std::ofstream out{out_file_name};
 
-    for (auto &[mem, history] : history_) {
-      for (ssize_t i = 0; i < history.size() - 1; ++i) {
-        if (history[i + 1] == kHistoryNodesDelimeter) {
-          continue;
-        }
-
-        out << "node" << history[i] << " -> " << "node" << history[i + 1]
+    std::lock_guard<std::shared_mutex> lock{mutex_};
+    MergeThreads();
+    for (const Lifetime &lifetime : history_) {
+      const std::vector<uint64_t> &nodes = lifetime.nodes;
+      for (size_t i = 0; i + 1 < nodes.size(); ++i) {
+        out << "node" << nodes[i] << " -> " << "node" << nodes[i + 1]
             << " [color=\"black\"];\n";
       }
+      if (lifetime.free_node != 0) {
+        out << "node" << nodes.back() << " -> " << "node"
+            << lifetime.free_node << " [color=\"black\"];\n";
+      }
+    }
+
+    for (auto &[node, site] : sites_) {
+      out << "node" << node << " [xlabel=\"" << FormatSite(site) << "\"];\n";
+    }
+  }
+
+  // Per site table of accesses by offset from allocation base. Helps to
+  // find hot and cold fields and fields accessed together.
+  void PrintOffsets(const char *out_file_name) {
+    assert(out_file_name);
+
+    std::ofstream out{out_file_name};
+
+    std::lock_guard<std::shared_mutex> lock{mutex_};
+    MergeThreads();
+    for (auto &[mem, allocation] : live_) {
+      AddCoAccesses(sites_[allocation.site], allocation.touched_buckets);
+    }
+
+    for (auto &[node, site] : sites_) {
+      if (site.fields.empty()) {
+        continue;
+      }
+
+      out << "site node" << node;
+      if (auto name_it = site_names_.find(node); name_it != site_names_.end()) {
+        out << " (" << name_it->second << ")";
+      }
+      out << ": " << site.allocations << " objects, max size "
+          << site.max_size << "B\n";
+
+      PrintFields(out, site);
+      PrintCoAccesses(out, site);
+    }
+  }
+
+  // Lists named sites that fit the pool allocator: small sizes and short
+  // lifetimes. Output could be passed to MEMORY_POOL_SITES as is.
+  void PrintPoolCandidates(const char *out_file_name) {
+    assert(out_file_name);
+
+    std::ofstream out{out_file_name};
+
+    std::lock_guard<std::shared_mutex> lock{mutex_};
+    for (auto &[node, name] : site_names_) {
+      auto site_it = sites_.find(node);
+      if (site_it == sites_.end()) {
+        continue;
+      }
+
+      const AllocationSite &site = site_it->second;
+      if (site.allocations < kPoolMinAllocations ||
+          site.max_size > kPoolMaxAllocationSize ||
+          site.frees < site.allocations * kPoolMinFreedPercent / 100) {
+        continue;
+      }
+
+      uint64_t median_lifetime = MedianBucketBound(site.lifetimes);
+      if (median_lifetime > kPoolMaxLifetime) {
+        continue;
+      }
+
+      out << "node" << node << " # " << name << ", allocs "
+          << site.allocations << ", max size " << site.max_size
+          << "B, median lifetime " << median_lifetime << " allocs\n";
     }
   }
 
 private:
+  using Log2Histogram = std::array<uint64_t, 65>;
+
+  struct LiveAllocation {
+    uint64_t site;
+    uint64_t size;
+    uint64_t allocation_index;
+    uint64_t timestamp;
+
+    // bit per offset bucket of the first 64 ones
+    uint64_t touched_buckets{0};
+    // whether samples of it may be buffered by threads
+    bool sampled{false};
+  };
+
+  struct FieldAccesses {
+    uint64_t loads{0};
+    uint64_t stores{0};
+    uint64_t bytes{0};
+  };
+
+  struct AllocationSite {
+    uint64_t allocations{0};
+    uint64_t frees{0};
+    uint64_t total_bytes{0};
+    uint64_t live_bytes{0};
+    uint64_t peak_live_bytes{0};
+    uint64_t max_size{0};
+    Log2Histogram sizes{};
+
+    // lifetime is measured both in allocations made meanwhile and in ticks
+    Log2Histogram lifetimes{};
+    uint64_t lifetime_ticks{0};
+
+    uint64_t reallocs{0};
+    uint64_t grows{0};
+    uint64_t shrinks{0};
+    uint64_t moves{0};
+    double growth_factor_sum{0};
+
+    // offset bucket -> accesses
+    std::map<uint64_t, FieldAccesses> fields;
+    // pair of offset buckets -> number of objects where both were accessed
+    std::map<std::pair<uint64_t, uint64_t>, uint64_t> co_accesses;
+  };
+
+  // Nodes which allocated and accessed an allocation, then one freed it, 0
+  // if it wasn't freed or was freed where free isn't instrumented. Accesses
+  // of threads follow each other.
+  struct Lifetime {
+    std::vector<uint64_t> nodes;
+    uint64_t free_node{0};
+  };
+
+  // Accesses are counted by threads and merged into shared tables when
+  // printing
+  struct ThreadTable {
+    // allocation index -> accessing nodes
+    std::unordered_map<uint64_t, std::vector<uint64_t>> history;
+    // site -> offset bucket -> accesses
+    std::unordered_map<uint64_t, std::map<uint64_t, FieldAccesses>> fields;
+    std::vector<SharingTable::Sample> samples;
+  };
+
   MemoryTracker() = default;
 
-private:
-  std::map<void *, uint64_t> last_node_;
-  std::map<void *, std::vector<uint64_t>> history_;
+  // Callers must hold mutex_ exclusively
+  void MergeThreads() {
+    threads_.ForEach([this](auto &thread) {
+      for (auto &[allocation_index, nodes] : thread.table.history) {
+        auto &history = history_[allocation_index].nodes;
+        history.insert(history.end(), nodes.begin(), nodes.end());
+      }
+      for (auto &[site, fields] : thread.table.fields) {
+        for (auto &[bucket, accesses] : fields) {
+          auto &field = sites_[site].fields[bucket];
+          field.loads += accesses.loads;
+          field.stores += accesses.stores;
+          field.bytes += accesses.bytes;
+        }
+      }
+      RecordSamples(thread);
+      thread.table = {};
+    });
+  }
 
-  // it is used to delimit usage of memory with the same address
-  // but allocated further in the program by another to call to allocator
-  static constexpr uint64_t kHistoryNodesDelimeter = static_cast<uint64_t>(-1);
-};
+  // Callers must hold mutex_ exclusively or the thread's mutex and
+  // sharing_mutex_
+  void RecordSamples(ThreadTables<ThreadTable>::Slot &thread) {
+    for (const auto &sample : thread.table.samples) {
+      sharing_.Record(sample, thread.thread);
+    }
+    thread.table.samples.clear();
+  }
 
-} // namespace
+  // Callers must hold mutex_ exclusively
+  void AddAllocation(uint64_t node, void *mem, uint64_t size) {
+    // The address was freed where free isn't instrumented
+    if (auto live_it = live_.find(mem); live_it != live_.end()) {
+      EraseAllocation(live_it);
+    }
 
-extern "C" {
+    history_.push_back({{node}});
+    live_[mem] = {node, size, n_allocations_++, ReadTimestamp()};
 
-void PrepareIncreasePasses(uint64_t from_node) {
-  NPassesLogger::Create().PrepareIncreasePasses(from_node);
-}
+    auto &site = sites_[node];
+    site.allocations++;
+    site.total_bytes += size;
+    site.live_bytes += size;
+    site.peak_live_bytes = std::max(site.peak_live_bytes, site.live_bytes);
+    site.max_size = std::max(site.max_size, size);
+    site.sizes[Log2Bucket(size)]++;
+  }
 
-void IncreaseNPasses(uint64_t to_node) {
-  NPassesLogger::Create().IncreaseNPasses(to_node);
-}
+  void RemoveAllocation(uint64_t node, void *mem) {
+    auto live_it = live_.find(mem);
 
-void PrintNPassesEdges(const char *out_file_name) {
-  NPassesLogger::Create().PrintNPassesEdges(out_file_name);
-}
+    assert(live_it != live_.end());
 
-void AddUsage(uint64_t node) { NodesUsageCounter::Create().AddUsage(node); }
+    history_[live_it->second.allocation_index].free_node = node;
+    EraseAllocation(live_it);
+  }
 
-void PrintUsages(const char *out_file_name) {
-  NodesUsageCounter::Create().PrintUsages(out_file_name);
-}
+  void EraseAllocation(std::map<void *, LiveAllocation>::iterator live_it) {
+    ReleaseAllocation(live_it->second);
+    if (sharing_period_ != 0) {
+      // Its lines are classified with all samples threads buffered
+      if (live_it->second.sampled) {
+        threads_.ForEach([this](auto &thread) { RecordSamples(thread); });
+      }
+      sharing_.Release(live_it->first, live_it->second.size);
+    }
+    live_.erase(live_it);
+  }
 
-void AddDynamicallyAllocatedMemory(uint64_t node, void *memory) {
-  MemoryTracker::Create().AddDynMemCreation(node, memory);
-}
+  std::map<void *, LiveAllocation>::iterator FindAllocation(void *mem) {
+    auto live_it = live_.upper_bound(mem);
+    if (live_it == live_.begin()) {
+      return live_.end();
+    }
 
-void LogIfMemoryIsDynamicallyAllocated(uint64_t node, void *memory) {
-  MemoryTracker::Create().LogMemIfDyn(node, memory);
-}
+    --live_it;
+    auto *begin = static_cast<char *>(live_it->first);
+    auto *end = begin + live_it->second.size;
+    if (mem != begin && static_cast<char *>(mem) >= end) {
+      return live_.end();
+    }
 
-void RemoveDynamicallAllocatedMemory(uint64_t node, void *memory) {
-  MemoryTracker::Create().RemoveDynMem(node, memory);
-}
+    return live_it;
+  }
 
-void PrintAllocatedMemoryInfo(const char *out_file_name) {
-  MemoryTracker::Create().Print(out_file_name);
+  static void AddCoAccesses(AllocationSite &site, uint64_t touched_buckets) {
+    for (uint64_t first = touched_buckets; first; first &= first - 1) {
+      for (uint64_t second = first & (first - 1); second;
+           second &= second - 1) {
+        site.co_accesses[{__builtin_ctzll(first), __builtin_ctzll(second)}]++;
+      }
+    }
+  }
+
+  void PrintFields(std::ofstream &out, const AllocationSite &site) {
+    uint64_t max_accesses = 0;
+    uint64_t total_accesses = 0;
+    for (auto &[bucket, field] : site.fields) {
+      max_accesses = std::max(max_accesses, field.loads + field.stores);
+      total_accesses += field.loads + field.stores;
+    }
+
+    // Not accessed buckets are shown only for struct-like objects
+    std::map<uint64_t, FieldAccesses> fields = site.fields;
+    if (site.max_size <= kMaxReportedObjectSize) {
+      for (uint64_t offset = 0; offset < site.max_size;
+           offset += kOffsetBucketSize) {
+        fields[offset / kOffsetBucketSize];
+      }
+    }
+
+    out << "  offset\tloads\tstores\tbytes\tshare\n";
+    for (auto &[bucket, field] : fields) {
+      uint64_t accesses = field.loads + field.stores;
+
+      const char *heat = "warm";
+      if (accesses == 0) {
+        heat = "unused";
+      } else if (accesses * 2 >= max_accesses) {
+        heat = "hot";
+      } else if (accesses * 20 <= max_accesses) {
+        heat = "cold";
+      }
+
+      out << "  +" << bucket * kOffsetBucketSize << "\t" << field.loads << "\t"
+          << field.stores << "\t" << field.bytes << "\t"
+          << 100.0 * accesses / total_accesses << "%\t" << heat << "\n";
+    }
+  }
+
+  void PrintCoAccesses(std::ofstream &out, const AllocationSite &site) {
+    std::vector<std::pair<std::pair<uint64_t, uint64_t>, uint64_t>> pairs{
+        site.co_accesses.begin(), site.co_accesses.end()};
+    size_t n_shown = std::min(pairs.size(), kMaxReportedCoAccesses);
+    std::partial_sort(
+        pairs.begin(), pairs.begin() + n_shown, pairs.end(),
+        [](auto &a, auto &b) { return a.second > b.second; });
+
+    for (size_t i = 0; i < n_shown; ++i) {
+      auto &[buckets, objects] = pairs[i];
+      out << "  together +" << buckets.first * kOffsetBucketSize << " +"
+          << buckets.second * kOffsetBucketSize << ": " << objects
+          << " objects (" << 100.0 * objects / site.allocations << "%)\n";
+    }
+  }
+
+  void ReleaseAllocation(const LiveAllocation &allocation) {
+    auto &site = sites_[allocation.site];
+    AddCoAccesses(site, allocation.touched_buckets);
+    site.frees++;
+    site.live_bytes -= allocation.size;
+    uint64_t lifetime = n_allocations_ - allocation.allocation_index - 1;
+    site.lifetimes[Log2Bucket(lifetime)]++;
+    site.lifetime_ticks += ReadTimestamp() - allocation.timestamp;
+  }
+
+  static uint64_t MedianBucketBound(const Log2Histogram &histogram) {
+    uint64_t total = 0;
+    for (auto count : histogram) {
+      total += count;
+    }
+
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < histogram.size(); ++bucket) {
+      seen += histogram[bucket];
+      if (2 * seen >= total) {
+        return Log2BucketBound(bucket);
+      }
+    }
+
+    return 0;
+  }
+
+  static std::string FormatHistogram(const Log2Histogram &histogram,
+                                     const char *unit) {
+    std::ostringstream ss;
+    for (size_t bucket = 0; bucket < histogram.size(); ++bucket) {
+      if (histogram[bucket] == 0) {
+        continue;
+      }
+
+      ss << " " << Log2BucketBound(bucket) << unit << "+:" << histogram[bucket];
+    }
+
+    return ss.str();
+  }
+
+  // Lines are separated with graphviz "\l" to keep them left-aligned
+  static std::string FormatSite(const AllocationSite &site) {
+    std::ostringstream ss;
+    ss << "allocs " << site.allocations << ", frees " << site.frees
+       << ", bytes " << site.total_bytes << "\\l";
+    ss << "live " << site.live_bytes << "B, peak " << site.peak_live_bytes
+       << "B\\l";
+    ss << "sizes" << FormatHistogram(site.sizes, "B") << "\\l";
+
+    if (site.frees != 0) {
+      ss << "lifetime" << FormatHistogram(site.lifetimes, " allocs")
+         << ", avg " << site.lifetime_ticks / site.frees << " ticks\\l";
+    }
+
+    if (site.reallocs != 0) {
+      ss << "realloc " << site.reallocs << ": grow " << site.grows;
+      if (site.grows != 0) {
+        ss << " (x" << site.growth_factor_sum / site.grows << ")";
+      }
+      ss << ", shrink " << site.shrinks << ", moved " << site.moves << "\\l";
+    }
+
+    return ss.str();
+  }
+
+private:
+  // Accesses take it shared, allocations and printing exclusively
+  std::shared_mutex mutex_;
+  std::map<void *, LiveAllocation> live_;
+  // by allocation index
+  std::vector<Lifetime> history_;
+  std::map<uint64_t, AllocationSite> sites_;
+  std::map<uint64_t, std::string> site_names_;
+  ThreadTables<ThreadTable> threads_;
+
+  uint64_t n_allocations_{0};
+
+  std::atomic<uint64_t> sharing_period_{0};
+  // Taken by threads recording full buffers, which hold mutex_ shared
+  std::mutex sharing_mutex_;
+  SharingTable sharing_;
+
+  static constexpr uint64_t kOffsetBucketSize = 8;
+  static constexpr uint64_t kMaxReportedObjectSize = 512;
+  static constexpr size_t kMaxReportedCoAccesses = 10;
+  static constexpr size_t kMaxBufferedSamples = 1024;
+
+  static constexpr uint64_t kPoolMinAllocations = 16;
+  static constexpr uint64_t kPoolMinFreedPercent = 90;
+  static constexpr uint64_t kPoolMaxLifetime = 1024;
+};
+
+// Bytes loaded and stored by every access node, split by origin of memory.
+// Accesses roll up into their loops and functions, registered by the pass
+// with parents, and scopes count their entries (iterations of loops, calls of
+// functions), so traffic is also given per iteration and per call.
+class BandwidthProfiler {
+public:
+  // singleton
+  static BandwidthProfiler &Create() {
+    static BandwidthProfiler profiler;
+    return profiler;
+  }
+
+  void RegisterScope(uint64_t scope, uint64_t parent, const char *name) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    auto &entry = scopes_[scope];
+    entry.parent = parent;
+    entry.name = name;
+  }
+
+  void RegisterAccesses(const uint64_t *accesses, uint64_t size) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    for (uint64_t i = 0; i < size; ++i) {
+      access_scopes_[accesses[2 * i]] = accesses[2 * i + 1];
+    }
+  }
+
+  void EnterScope(uint64_t scope) {
+    auto &thread = threads_.Get();
+    std::lock_guard<std::mutex> lock{thread.mutex};
+    thread.table.entries[scope]++;
+  }
+
+  void AddAccess(uint64_t node, uint64_t size, uint64_t kind, bool heap) {
+    Origin origin = heap                          ? kOriginHeap
+                    : kind & kMemoryAccessStack  ? kOriginStack
+                    : kind & kMemoryAccessGlobal ? kOriginGlobal
+                                                 : kOriginOther;
+    bool store = kind & kMemoryAccessStore;
+
+    auto &thread = threads_.Get();
+    std::lock_guard<std::mutex> lock{thread.mutex};
+    thread.table.traffic[node].bytes[store][origin] += size;
+  }
+
+  // Graph attributes for access, loop header and function nodes go to
+  // out_file_name, loops and functions moving most bytes to report
+  void Print(const char *out_file_name, const char *report_file_name) {
+    assert(out_file_name && report_file_name);
+
+    std::ofstream out{out_file_name};
+    std::ofstream report{report_file_name};
+
+    std::lock_guard<std::mutex> lock{mutex_};
+    std::unordered_map<uint64_t, Traffic> node_traffic;
+    for (auto &[scope, entry] : scopes_) {
+      entry.entries = 0;
+    }
+    threads_.ForEach([&](auto &thread) {
+      for (const auto &[node, traffic] : thread.table.traffic) {
+        node_traffic[node].Add(traffic);
+      }
+      for (const auto &[scope, entries] : thread.table.entries) {
+        auto scope_it = scopes_.find(scope);
+        if (scope_it != scopes_.end()) {
+          scope_it->second.entries += entries;
+        }
+      }
+    });
+
+    std::map<uint64_t, Traffic> scope_traffic;
+    for (auto &[node, traffic] : node_traffic) {
+      auto access_it = access_scopes_.find(node);
+      uint64_t scope =
+          access_it != access_scopes_.end() ? access_it->second : 0;
+      out << "node" << node << " [xlabel=\"" << FormatTraffic(traffic, scope)
+          << "\"];\n";
+
+      // Traffic of a loop includes nested loops, of a function all its loops
+      while (scope != 0 && scopes_.count(scope)) {
+        scope_traffic[scope].Add(traffic);
+        scope = scopes_[scope].parent;
+      }
+    }
+
+    for (auto &[scope, traffic] : scope_traffic) {
+      out << "node" << scope << " [xlabel=\"" << FormatTraffic(traffic, scope)
+          << "\"];\n";
+    }
+
+    PrintScopes(report, "Loops", "B/iter", scope_traffic, true);
+    PrintScopes(report, "Functions", "B/call", scope_traffic, false);
+  }
+
+private:
+  enum Origin : size_t {
+    kOriginHeap,
+    kOriginStack,
+    kOriginGlobal,
+    kOriginOther,
+    kNumOrigins,
+  };
+
+  struct Traffic {
+    // [load, store][origin]
+    std::array<std::array<uint64_t, kNumOrigins>, 2> bytes{};
+
+    void Add(const Traffic &other) {
+      for (size_t store = 0; store < 2; ++store) {
+        for (size_t origin = 0; origin < kNumOrigins; ++origin) {
+          bytes[store][origin] += other.bytes[store][origin];
+        }
+      }
+    }
+
+    uint64_t GetBytes(bool store) const {
+      uint64_t sum = 0;
+      for (uint64_t origin_bytes : bytes[store]) {
+        sum += origin_bytes;
+      }
+      return sum;
+    }
+
+    uint64_t GetTotal() const { return GetBytes(false) + GetBytes(true); }
+
+    uint64_t GetOriginBytes(size_t origin) const {
+      return bytes[0][origin] + bytes[1][origin];
+    }
+  };
+
+  struct Scope {
+    uint64_t parent{0};
+    std::string name;
+    uint64_t entries{0};
+  };
+
+  struct ThreadTable {
+    std::unordered_map<uint64_t, Traffic> traffic;
+    std::unordered_map<uint64_t, uint64_t> entries;
+  };
+
+  BandwidthProfiler() = default;
+
+  // Fractions only for small values, big ones in whole bytes
+  static std::string FormatNumber(double value) {
+    std::stringstream ss;
+    if (value < 1000) {
+      ss << std::setprecision(3) << value;
+    } else {
+      ss << std::fixed << std::setprecision(0) << value;
+    }
+    return ss.str();
+  }
+
+  // Bytes per entry of the scope, or in total for accesses outside of
+  // registered scopes, e.g. of filtered out functions
+  std::string FormatTraffic(const Traffic &traffic, uint64_t scope) {
+    auto scope_it = scopes_.find(scope);
+    double entries = 1;
+    const char *unit = "B";
+    if (scope_it != scopes_.end() && scope_it->second.entries != 0) {
+      entries = scope_it->second.entries;
+      unit = scope_it->second.parent != 0 ? "B/iter" : "B/call";
+    }
+
+    return "ld " + FormatNumber(traffic.GetBytes(false) / entries) + ", st " +
+           FormatNumber(traffic.GetBytes(true) / entries) + " " + unit;
+  }
+
+  // Callers must hold mutex_
+  void PrintScopes(std::ofstream &out, const char *title, const char *unit,
+                   const std::map<uint64_t, Traffic> &scope_traffic,
+                   bool loops) {
+    std::vector<std::pair<uint64_t, const Traffic *>> sorted;
+    for (auto &[scope, traffic] : scope_traffic) {
+      if ((scopes_[scope].parent != 0) == loops) {
+        sorted.emplace_back(scope, &traffic);
+      }
+    }
+    std::sort(sorted.begin(), sorted.end(), [](auto &lhs, auto &rhs) {
+      return lhs.second->GetTotal() > rhs.second->GetTotal();
+    });
+    if (sorted.size() > kMaxReportedScopes) {
+      sorted.resize(kMaxReportedScopes);
+    }
+
+    out << title << ":\n"
+        << std::setw(14) << "bytes" << std::setw(12) << unit << std::setw(12)
+        << "entries" << "  store%  heap% stack% global% other%  name\n";
+    for (auto &[scope, traffic] : sorted) {
+      const Scope &entry = scopes_[scope];
+      double total = std::max<uint64_t>(traffic->GetTotal(), 1);
+      auto share = [&](uint64_t bytes) {
+        return FormatNumber(100.0 * bytes / total);
+      };
+
+      out << std::setw(14) << traffic->GetTotal() << std::setw(12)
+          << FormatNumber(traffic->GetTotal() /
+                          std::max<double>(entry.entries, 1))
+          << std::setw(12) << entry.entries << std::setw(8)
+          << share(traffic->GetBytes(true)) << std::setw(7)
+          << share(traffic->GetOriginBytes(kOriginHeap)) << std::setw(7)
+          << share(traffic->GetOriginBytes(kOriginStack)) << std::setw(8)
+          << share(traffic->GetOriginBytes(kOriginGlobal)) << std::setw(7)
+          << share(traffic->GetOriginBytes(kOriginOther)) << "  "
+          << entry.name << "\n";
+    }
+    out << "\n";
+  }
+
+private:
+  std::mutex mutex_;
+  ThreadTables<ThreadTable> threads_;
+  std::unordered_map<uint64_t, uint64_t> access_scopes_;
+  // Entries are merged from threads while printing
+  std::unordered_map<uint64_t, Scope> scopes_;
+
+  static constexpr size_t kMaxReportedScopes = 20;
+};
+
+class StrideProfiler {
+public:
+  // singleton
+  static StrideProfiler &Create() {
+    static StrideProfiler profiler;
+    return profiler;
+  }
+
+  void LogStride(uint64_t node, void *mem, uint64_t size) {
+    auto address = reinterpret_cast<uint64_t>(mem);
+
+    auto &thread = threads_.Get();
+    std::lock_guard<std::mutex> lock{thread.mutex};
+    auto &site = thread.table[node];
+
+    site.lines[Hash(address / kCacheLineSize) % kLinesBitmapSize] = true;
+    site.size = size;
+
+    if (site.accesses++ == 0) {
+      site.last_address = address;
+      return;
+    }
+
+    // Stride is classified only once it repeats, a changing one is random
+    auto stride = static_cast<int64_t>(address - site.last_address);
+    if (site.accesses > 2 && stride == site.last_stride) {
+      uint64_t abs_stride = stride < 0 ? -stride : stride;
+      if (abs_stride == 0) {
+        site.patterns[kConstant]++;
+      } else if (abs_stride <= size) {
+        site.patterns[kUnitStride]++;
+      } else {
+        site.patterns[kLargeStride]++;
+      }
+    } else if (site.accesses > 2) {
+      site.patterns[kRandom]++;
+    }
+
+    site.last_address = address;
+    site.last_stride = stride;
+  }
+
+  void Print(const char *out_file_name) {
+    assert(out_file_name);
+
+    std::ofstream out{out_file_name};
+
+    std::map<uint64_t, Site> sites;
+    // Stride is shown of the thread with the most accesses of a site
+    std::unordered_map<uint64_t, uint64_t> stride_accesses;
+    threads_.ForEach([&](auto &thread) {
+      for (const auto &[node, thread_site] : thread.table) {
+        auto &site = sites[node];
+        site.accesses += thread_site.accesses;
+        site.size = thread_site.size;
+        for (size_t i = 0; i < kNPatterns; ++i) {
+          site.patterns[i] += thread_site.patterns[i];
+        }
+        site.lines |= thread_site.lines;
+
+        auto &accesses = stride_accesses[node];
+        if (thread_site.accesses > accesses) {
+          accesses = thread_site.accesses;
+          site.last_stride = thread_site.last_stride;
+        }
+      }
+    });
+
+    for (auto &[node, site] : sites) {
+      // Patterns are counted from the third access of a thread on
+      uint64_t n_patterns = 0;
+      for (auto count : site.patterns) {
+        n_patterns += count;
+      }
+      if (n_patterns == 0) {
+        out << "node" << node << " [style=filled, fillcolor=\""
+            << kUnknownColor << "\", xlabel=\"unknown, " << site.accesses
+            << " accesses\"];\n";
+        continue;
+      }
+
+      auto pattern = static_cast<Pattern>(
+          std::max_element(site.patterns.begin(), site.patterns.end()) -
+          site.patterns.begin());
+
+      out << "node" << node << " [style=filled, fillcolor=\""
+          << kPatternColors[pattern] << "\", xlabel=\""
+          << kPatternNames[pattern];
+      if (pattern == kUnitStride || pattern == kLargeStride) {
+        out << " " << site.last_stride << "B";
+      }
+      out << ", ~" << EstimateLines(site) << " lines\"];\n";
+    }
+  }
+
+private:
+  enum Pattern {
+    kConstant,
+    kUnitStride,
+    kLargeStride,
+    kRandom,
+    kNPatterns,
+  };
+
+  static constexpr const char *kPatternNames[kNPatterns] = {
+      "constant", "unit stride", "large stride", "random"};
+  static constexpr const char *kPatternColors[kNPatterns] = {
+      "#5B9BD5", "#70AD47", "#FFC000", "#FF4040"};
+  static constexpr const char *kUnknownColor = "#BFBFBF";
+
+  static constexpr uint64_t kCacheLineSize = 64;
+  static constexpr size_t kLinesBitmapSize = 4096;
+
+  // Threads walk memory on their own, so strides are followed per thread and
+  // sites are merged when printing
+  struct Site {
+    uint64_t accesses{0};
+    uint64_t size{0};
+    uint64_t last_address{0};
+    int64_t last_stride{0};
+    std::array<uint64_t, kNPatterns> patterns{};
+
+    // linear counting sketch of touched cache lines
+    std::bitset<kLinesBitmapSize> lines;
+  };
+
+  StrideProfiler() = default;
+
+  static uint64_t Hash(uint64_t value) {
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    return value;
+  }
+
+  static uint64_t EstimateLines(const Site &site) {
+    size_t zeros = kLinesBitmapSize - site.lines.count();
+    if (zeros == 0) {
+      zeros = 1;
+    }
+
+    return std::llround(-static_cast<double>(kLinesBitmapSize) *
+                        std::log(static_cast<double>(zeros) / kLinesBitmapSize));
+  }
+
+private:
+  ThreadTables<std::unordered_map<uint64_t, Site>> threads_;
+};
+
+class CallingContextProfiler {
+public:
+  // singleton
+  static CallingContextProfiler &Create() {
+    static CallingContextProfiler profiler;
+    return profiler;
+  }
+
+  void RegisterFunction(uint64_t function, const char *name) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    names_[function] = name;
+  }
+
+  void EnterFunction(uint64_t function) {
+    auto &thread = trees_.Get();
+    std::lock_guard<std::mutex> lock{thread.mutex};
+    Tree &tree = thread.table;
+
+    uint32_t parent = tree.stack.empty() ? kRoot : tree.stack.back().node;
+    uint32_t node = GetChild(tree, parent, function);
+    tree.nodes[node].calls++;
+    tree.stack.push_back({node, function, 0});
+  }
+
+  // Block and the edge from the previous block of the frame are counted in
+  // the context of the frame. Calls don't change the previous block, so the
+  // edge after a call starts at the calling block.
+  void CountBlock(uint64_t block) {
+    auto &thread = trees_.Get();
+    std::lock_guard<std::mutex> lock{thread.mutex};
+    Tree &tree = thread.table;
+
+    Frame *frame = tree.stack.empty() ? nullptr : &tree.stack.back();
+    uint32_t context = frame ? frame->node : kRoot;
+    tree.blocks[{context, block}]++;
+    if (frame) {
+      if (frame->last_block != 0) {
+        tree.edges[{context, frame->last_block, block}]++;
+      }
+      frame->last_block = block;
+    }
+  }
+
+  // Frames left by exceptions or longjmp are popped together with the
+  // function that catches them
+  void ExitFunction(uint64_t function) {
+    auto &thread = trees_.Get();
+    std::lock_guard<std::mutex> lock{thread.mutex};
+    Tree &tree = thread.table;
+
+    auto frame = std::find_if(
+        tree.stack.rbegin(), tree.stack.rend(),
+        [&](const Frame &frame) { return frame.function == function; });
+    if (frame != tree.stack.rend()) {
+      tree.stack.erase(std::prev(frame.base()), tree.stack.end());
+    }
+  }
+
+  // Collapsed stacks, "main;foo;bar <calls>" per context, as flame graph
+  // tools read them. Trees of all threads are merged.
+  void Print(const char *out_file_name) {
+    assert(out_file_name);
+    std::ofstream out{out_file_name};
+
+    std::map<std::string, uint64_t> stacks;
+
+    std::lock_guard<std::mutex> lock{mutex_};
+    trees_.ForEach([&](auto &thread) {
+      const Tree &tree = thread.table;
+      std::vector<std::string> paths = GetPaths(tree);
+      for (size_t i = kRoot + 1; i < tree.nodes.size(); ++i) {
+        stacks[paths[i]] += tree.nodes[i].calls;
+      }
+    });
+
+    for (const auto &[stack, calls] : stacks) {
+      out << stack << " " << calls << "\n";
+    }
+  }
+
+  // Block and edge counts per context, "main;foo node<block> <count>" and
+  // "main;foo node<from> -> node<to> <count>" lines
+  void PrintCounts(const char *out_file_name) {
+    assert(out_file_name);
+    std::ofstream out{out_file_name};
+
+    std::map<std::pair<std::string, uint64_t>, uint64_t> blocks;
+    std::map<std::tuple<std::string, uint64_t, uint64_t>, uint64_t> edges;
+
+    std::lock_guard<std::mutex> lock{mutex_};
+    trees_.ForEach([&](auto &thread) {
+      const Tree &tree = thread.table;
+      std::vector<std::string> paths = GetPaths(tree);
+      for (const auto &[key, count] : tree.blocks) {
+        blocks[{paths[key.first], key.second}] += count;
+      }
+      for (const auto &[key, count] : tree.edges) {
+        edges[{paths[std::get<0>(key)], std::get<1>(key), std::get<2>(key)}] +=
+            count;
+      }
+    });
+
+    for (const auto &[key, count] : blocks) {
+      out << key.first << " node" << key.second << " " << count << "\n";
+    }
+    for (const auto &[key, count] : edges) {
+      out << std::get<0>(key) << " node" << std::get<1>(key) << " -> node"
+          << std::get<2>(key) << " " << count << "\n";
+    }
+  }
+
+private:
+  struct Node {
+    uint64_t function;
+    uint32_t parent;
+    uint32_t depth;
+    uint64_t calls;
+  };
+
+  struct Frame {
+    uint32_t node;
+    uint64_t function;
+    uint64_t last_block;
+  };
+
+  struct ChildHash {
+    size_t operator()(const std::pair<uint32_t, uint64_t> &key) const {
+      return std::hash<uint64_t>{}(key.second) ^
+             (key.first * 0x9e3779b97f4a7c15ULL);
+    }
+  };
+
+  using EdgeKey = std::tuple<uint32_t, uint64_t, uint64_t>;
+
+  struct EdgeHash {
+    size_t operator()(const EdgeKey &key) const {
+      return ChildHash{}({std::get<0>(key), std::get<2>(key)}) ^
+             (std::get<1>(key) * 0xff51afd7ed558ccdULL);
+    }
+  };
+
+  // Every thread has its own tree, shadow stack and counts keyed by context
+  // node. Blocks run outside of instrumented functions are counted in the
+  // root context.
+  struct Tree {
+    std::vector<Node> nodes{{0, kRoot, 0, 0}};
+    std::unordered_map<std::pair<uint32_t, uint64_t>, uint32_t, ChildHash>
+        children;
+    std::vector<Frame> stack;
+    std::unordered_map<std::pair<uint32_t, uint64_t>, uint64_t, ChildHash>
+        blocks;
+    std::unordered_map<EdgeKey, uint64_t, EdgeHash> edges;
+  };
+
+  CallingContextProfiler() = default;
+
+  // Context is created once, later entries only look it up
+  uint32_t GetChild(Tree &tree, uint32_t parent, uint64_t function) {
+    auto it = tree.children.find({parent, function});
+    if (it != tree.children.end()) {
+      return it->second;
+    }
+
+    uint32_t child = MakeChild(tree, parent, function);
+    tree.children.emplace(std::make_pair(parent, function), child);
+    return child;
+  }
+
+  // Recursive call is folded into context of the function already on the
+  // path. Contexts deeper than kMaxDepth are merged into one truncated node.
+  uint32_t MakeChild(Tree &tree, uint32_t parent, uint64_t function) {
+    if (tree.nodes[parent].function == kTruncated) {
+      return parent;
+    }
+
+    for (uint32_t node = parent; node != kRoot;
+         node = tree.nodes[node].parent) {
+      if (tree.nodes[node].function == function) {
+        return node;
+      }
+    }
+
+    if (function != kTruncated && tree.nodes[parent].depth >= kMaxDepth) {
+      return GetChild(tree, parent, kTruncated);
+    }
+
+    tree.nodes.push_back({function, parent, tree.nodes[parent].depth + 1, 0});
+    return tree.nodes.size() - 1;
+  }
+
+  // Collapsed stack of every context. Parents are created before children.
+  // Callers must hold mutex_ and mutex of the tree's slot.
+  std::vector<std::string> GetPaths(const Tree &tree) {
+    std::vector<std::string> paths(tree.nodes.size());
+    paths[kRoot] = "[root]";
+    for (size_t i = kRoot + 1; i < tree.nodes.size(); ++i) {
+      const Node &node = tree.nodes[i];
+      paths[i] = node.parent == kRoot
+                     ? GetName(node.function)
+                     : paths[node.parent] + ";" + GetName(node.function);
+    }
+    return paths;
+  }
+
+  // Callers must hold mutex_
+  std::string GetName(uint64_t function) {
+    if (function == kTruncated) {
+      return "[truncated]";
+    }
+
+    auto it = names_.find(function);
+    return it != names_.end() ? it->second : "node" + std::to_string(function);
+  }
+
+private:
+  static constexpr uint32_t kRoot = 0;
+  static constexpr uint32_t kMaxDepth = 64;
+  static constexpr uint64_t kTruncated = static_cast<uint64_t>(-1);
+
+  std::mutex mutex_;
+  ThreadTables<Tree> trees_;
+  std::map<uint64_t, std::string> names_;
+};
+
+// Cycles spent in functions and, if blocks are instrumented, in blocks.
+// Inclusive time of a block covers calls made from it. Cost of the runtime
+// calls themselves is measured at start and subtracted.
+class TimingProfiler {
+public:
+  // singleton
+  static TimingProfiler &Create() {
+    static TimingProfiler profiler;
+    return profiler;
+  }
+
+  // Probes only touch the table of their thread, which isn't read by others
+  // until the thread exits, so they take no locks
+  void EnterFunction(uint64_t function) {
+    Enter(GetState(), function, ReadTimestamp());
+  }
+
+  void ExitFunction(uint64_t function) {
+    uint64_t now = ReadTimestamp();
+    Exit(GetState(), function, now);
+  }
+
+  void EnterBlock(uint64_t block) {
+    uint64_t now = ReadTimestamp();
+    MarkBlock(GetState(), block, now);
+  }
+
+  // Node attributes colored by share of exclusive cycles. Shares of blocks
+  // and functions are both of total time of functions. Functions still
+  // running, like main, are counted up to now. Other threads still running
+  // aren't counted, only tables of finished threads are read.
+  void Print(const char *out_file_name) {
+    assert(out_file_name);
+    std::ofstream out{out_file_name};
+
+    State state = GetState();
+    FinishFrames(state, ReadTimestamp());
+
+    std::map<uint64_t, Times> times;
+    for (const auto &[node, node_times] : state.times) {
+      Merge(times[node], node_times);
+    }
+    threads_.ForEach([&](auto &thread) {
+      if (!thread.finished) {
+        return;
+      }
+
+      for (const auto &[node, node_times] : thread.table.times) {
+        Merge(times[node], node_times);
+      }
+    });
+
+    // Blocks are colored relative to the hottest block
+    uint64_t max_exclusive[2] = {1, 1};
+    uint64_t total_exclusive = 0;
+    for (const auto &[node, node_times] : times) {
+      uint64_t &max = max_exclusive[node_times.block];
+      max = std::max(max, node_times.exclusive);
+      if (!node_times.block) {
+        total_exclusive += node_times.exclusive;
+      }
+    }
+    total_exclusive = std::max<uint64_t>(total_exclusive, 1);
+
+    for (const auto &[node, node_times] : times) {
+      out << "node" << node << " [style=filled, fillcolor=\""
+          << InterpolateColor(static_cast<double>(node_times.exclusive) /
+                              max_exclusive[node_times.block])
+          << "\", xlabel=\"self " << std::fixed << std::setprecision(1)
+          << 100.0 * node_times.exclusive / total_exclusive << "%, total "
+          << 100.0 * node_times.inclusive / total_exclusive << "%, "
+          << node_times.calls << " runs\"];\n";
+    }
+  }
+
+private:
+  struct Times {
+    uint64_t calls{0};
+    uint64_t inclusive{0};
+    uint64_t exclusive{0};
+    bool block{false};
+  };
+
+  // Cycles of nested calls are corrected, runtime overhead is excluded
+  struct Frame {
+    uint64_t function;
+    uint64_t start;
+    uint64_t children{0};
+    uint64_t overhead{0};
+
+    uint64_t block{0};
+    uint64_t block_start{0};
+    uint64_t block_children{0};
+    uint64_t block_overhead{0};
+  };
+
+  struct State {
+    std::vector<Frame> stack;
+    std::unordered_map<uint64_t, Times> times;
+
+    // Frames of a finishing thread end when it exits
+    void Finish() {
+      TimingProfiler::Create().FinishFrames(*this, ReadTimestamp());
+    }
+  };
+
+  TimingProfiler() { Calibrate(); }
+
+  State &GetState() { return threads_.Get().table; }
+
+  static void Merge(Times &total, const Times &times) {
+    total.calls += times.calls;
+    total.inclusive += times.inclusive;
+    total.exclusive += times.exclusive;
+    total.block = times.block;
+  }
+
+  // Frames of functions still running end now
+  void FinishFrames(State &state, uint64_t now) {
+    if (!state.stack.empty()) {
+      Exit(state, state.stack.front().function, now);
+    }
+  }
+
+  static uint64_t Subtract(uint64_t value, uint64_t subtrahend) {
+    return value > subtrahend ? value - subtrahend : 0;
+  }
+
+  void Enter(State &state, uint64_t function, uint64_t now) {
+    state.stack.push_back({function, now});
+  }
+
+  // Frames skipped by exceptions or longjmp end together with the function
+  // that catches them
+  void Exit(State &state, uint64_t function, uint64_t now) {
+    auto frame = std::find_if(
+        state.stack.rbegin(), state.stack.rend(),
+        [&](const Frame &frame) { return frame.function == function; });
+    if (frame == state.stack.rend()) {
+      return;
+    }
+
+    size_t depth = std::prev(frame.base()) - state.stack.begin();
+    while (state.stack.size() > depth) {
+      Frame top = state.stack.back();
+      state.stack.pop_back();
+
+      if (top.block) {
+        ChargeBlock(state, top, now);
+      }
+
+      uint64_t inclusive =
+          Subtract(now - top.start, top.overhead + frame_inner_cost_);
+      Times &times = state.times[top.function];
+      times.calls++;
+      times.inclusive += inclusive;
+      times.exclusive += Subtract(inclusive, top.children);
+
+      if (!state.stack.empty()) {
+        Frame &parent = state.stack.back();
+        uint64_t overhead = top.overhead + frame_outer_cost_;
+        parent.children += inclusive;
+        parent.overhead += overhead;
+        parent.block_children += inclusive;
+        parent.block_overhead += overhead;
+      }
+    }
+  }
+
+  void MarkBlock(State &state, uint64_t block, uint64_t now) {
+    if (state.stack.empty()) {
+      return;
+    }
+
+    Frame &frame = state.stack.back();
+    if (frame.block) {
+      ChargeBlock(state, frame, now);
+    }
+
+    frame.overhead += block_cost_;
+    frame.block = block;
+    frame.block_start = now;
+    frame.block_children = 0;
+    frame.block_overhead = 0;
+  }
+
+  void ChargeBlock(State &state, const Frame &frame, uint64_t now) {
+    uint64_t inclusive = Subtract(now - frame.block_start,
+                                  frame.block_overhead + block_cost_);
+    Times &times = state.times[frame.block];
+    times.block = true;
+    times.calls++;
+    times.inclusive += inclusive;
+    times.exclusive += Subtract(inclusive, frame.block_children);
+  }
+
+  // Minimal costs over many runs, as seen inside of an empty function and
+  // from its caller
+  void Calibrate() {
+    constexpr uint64_t kMax = static_cast<uint64_t>(-1);
+    uint64_t read_cost = kMax;
+    uint64_t inner_cost = kMax;
+    uint64_t outer_cost = kMax;
+    uint64_t block_cost = kMax;
+
+    State state;
+    for (int i = 0; i < kCalibrationRuns; ++i) {
+      uint64_t start = ReadTimestamp();
+      read_cost = std::min(read_cost, ReadTimestamp() - start);
+
+      uint64_t inclusive = state.times[kCalibrationNode].inclusive;
+      start = ReadTimestamp();
+      Enter(state, kCalibrationNode, ReadTimestamp());
+      {
+        uint64_t now = ReadTimestamp();
+        Exit(state, kCalibrationNode, now);
+      }
+      outer_cost = std::min(outer_cost, ReadTimestamp() - start);
+      inner_cost = std::min(
+          inner_cost, state.times[kCalibrationNode].inclusive - inclusive);
+
+      Enter(state, kCalibrationNode, ReadTimestamp());
+      start = ReadTimestamp();
+      {
+        uint64_t now = ReadTimestamp();
+        MarkBlock(state, kCalibrationNode + 1, now);
+      }
+      block_cost = std::min(block_cost, ReadTimestamp() - start);
+      Exit(state, kCalibrationNode, ReadTimestamp());
+    }
+
+    frame_inner_cost_ = inner_cost;
+    frame_outer_cost_ = Subtract(outer_cost, read_cost);
+    block_cost_ = Subtract(block_cost, read_cost);
+  }
+
+private:
+  static constexpr int kCalibrationRuns = 1000;
+  static constexpr uint64_t kCalibrationNode = 1;
+
+  uint64_t frame_inner_cost_{0};
+  uint64_t frame_outer_cost_{0};
+  uint64_t block_cost_{0};
+
+  ThreadTables<State> threads_;
+};
+
+// Most frequent values of operands per site, e.g. divisors or memcpy
+// lengths. Every thread keeps a small table per site, replacing the rarest
+// value when it is full (space saving), so counts of dominant values are
+// exact or slightly overestimated.
+class ValueProfiler {
+public:
+  // singleton
+  static ValueProfiler &Create() {
+    static ValueProfiler profiler;
+    return profiler;
+  }
+
+  void ProfileValue(uint64_t site, uint64_t value) {
+    auto &thread = threads_.Get();
+    std::lock_guard<std::mutex> lock{thread.mutex};
+    thread.table[site].Add(value);
+  }
+
+  // Node attributes with shares of top values as label. Raw counts are kept
+  // in value_profile attribute, which the pass reads back to emit fast
+  // paths.
+  void Print(const char *out_file_name) {
+    assert(out_file_name);
+    std::ofstream out{out_file_name};
+
+    std::map<uint64_t, Merged> sites;
+    threads_.ForEach([&](auto &thread) {
+      for (const auto &[site, table] : thread.table) {
+        Merged &merged = sites[site];
+        merged.total += table.total;
+        for (size_t i = 0; i < table.size; ++i) {
+          merged.counts[table.counters[i].value] += table.counters[i].count;
+        }
+      }
+    });
+
+    for (const auto &[site, merged] : sites) {
+      std::vector<Counter> top;
+      for (const auto &[value, count] : merged.counts) {
+        top.push_back({value, count});
+      }
+      std::sort(top.begin(), top.end(), [](const auto &a, const auto &b) {
+        return a.count > b.count;
+      });
+      top.resize(std::min(top.size(), kTopValues));
+
+      std::stringstream label;
+      std::stringstream raw;
+      label << std::fixed << std::setprecision(1);
+      for (const auto &counter : top) {
+        auto value = static_cast<int64_t>(counter.value);
+        label << (&counter == &top.front() ? "" : ", ") << value << ": "
+              << 100.0 * counter.count / merged.total << "%";
+        raw << (&counter == &top.front() ? "" : ",") << value << "="
+            << counter.count;
+      }
+
+      out << "node" << site << " [xlabel=\"" << label.str() << " of "
+          << merged.total << "\", value_profile=\"" << merged.total << ":"
+          << raw.str() << "\"];\n";
+    }
+  }
+
+private:
+  struct Counter {
+    uint64_t value;
+    uint64_t count;
+  };
+
+  static constexpr size_t kTopValues = 4;
+
+  struct Table {
+    uint64_t total{0};
+    size_t size{0};
+    std::array<Counter, kTopValues> counters;
+
+    void Add(uint64_t value) {
+      total++;
+      for (size_t i = 0; i < size; ++i) {
+        if (counters[i].value == value) {
+          counters[i].count++;
+          return;
+        }
+      }
+
+      if (size < kTopValues) {
+        counters[size++] = {value, 1};
+        return;
+      }
+
+      Counter &rarest = *std::min_element(
+          counters.begin(), counters.end(),
+          [](const auto &a, const auto &b) { return a.count < b.count; });
+      rarest = {value, rarest.count + 1};
+    }
+  };
+
+  struct Merged {
+    uint64_t total{0};
+    std::unordered_map<uint64_t, uint64_t> counts;
+  };
+
+  ValueProfiler() = default;
+
+private:
+  // Tables of sites
+  ThreadTables<std::unordered_map<uint64_t, Table>> threads_;
+};
+
+// Trip counts of loops, one per loop entry, spread into power of two
+// buckets. Percentiles are bounds of buckets they fall into.
+class TripCountProfiler {
+public:
+  // singleton
+  static TripCountProfiler &Create() {
+    static TripCountProfiler profiler;
+    return profiler;
+  }
+
+  void RecordTripCount(uint64_t loop, uint64_t trips) {
+    auto &thread = threads_.Get();
+    std::lock_guard<std::mutex> lock{thread.mutex};
+    thread.table[loop].Add(trips);
+  }
+
+  // Attributes of loop header nodes
+  void Print(const char *out_file_name) {
+    assert(out_file_name);
+    std::ofstream out{out_file_name};
+
+    std::map<uint64_t, Histogram> loops;
+    threads_.ForEach([&](auto &thread) {
+      for (const auto &[loop, histogram] : thread.table) {
+        loops[loop].Merge(histogram);
+      }
+    });
+
+    for (const auto &[loop, histogram] : loops) {
+      out << "node" << loop << " [xlabel=\"trips min " << histogram.min
+          << ", median " << histogram.Percentile(0.5) << ", p99 "
+          << histogram.Percentile(0.99) << ", max " << histogram.max << ", "
+          << histogram.entries << " entries\"];\n";
+    }
+  }
+
+private:
+  struct Histogram {
+    uint64_t entries{0};
+    uint64_t min{static_cast<uint64_t>(-1)};
+    uint64_t max{0};
+    std::array<uint64_t, 65> buckets{};
+
+    void Add(uint64_t trips) {
+      entries++;
+      min = std::min(min, trips);
+      max = std::max(max, trips);
+      buckets[Log2Bucket(trips)]++;
+    }
+
+    void Merge(const Histogram &other) {
+      entries += other.entries;
+      min = std::min(min, other.min);
+      max = std::max(max, other.max);
+      for (size_t i = 0; i < buckets.size(); ++i) {
+        buckets[i] += other.buckets[i];
+      }
+    }
+
+    // Upper bound of the bucket, clamped to seen values
+    uint64_t Percentile(double share) const {
+      uint64_t rank = static_cast<uint64_t>(std::ceil(share * entries));
+      uint64_t seen = 0;
+      for (size_t i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+          uint64_t bound = i + 1 < buckets.size()
+                               ? Log2BucketBound(i + 1) - 1
+                               : static_cast<uint64_t>(-1);
+          return std::clamp(bound, min, max);
+        }
+      }
+
+      return max;
+    }
+  };
+
+  TripCountProfiler() = default;
+
+private:
+  // Histograms of loops
+  ThreadTables<std::unordered_map<uint64_t, Histogram>> threads_;
+};
+
+// Instrumented code only stores 1 to a byte of its module, without calls or
+// read-modify-write. Modules register their flags from constructors, flags
+// are read at exit.
+class CoverageRegistry {
+public:
+  // singleton
+  static CoverageRegistry &Create() {
+    static CoverageRegistry registry;
+    return registry;
+  }
+
+  void Register(const uint8_t *flags, const uint64_t *ids, uint64_t size,
+                bool edges) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    modules_.push_back({flags, ids, size, edges});
+  }
+
+  // Every registered block or edge with its flag
+  void Print(const char *out_file_name) {
+    assert(out_file_name);
+    std::ofstream out{out_file_name};
+
+    std::lock_guard<std::mutex> lock{mutex_};
+    for (const auto &module : modules_) {
+      for (uint64_t i = 0; i < module.size; ++i) {
+        int covered = module.flags[i] != 0;
+        if (module.edges) {
+          out << "node" << module.ids[2 * i] << " -> node"
+              << module.ids[2 * i + 1] << " [covered=" << covered << "];\n";
+        } else {
+          out << "node" << module.ids[i] << " [covered=" << covered
+              << "];\n";
+        }
+      }
+    }
+  }
+
+private:
+  // Edges have two ids per flag, source and target
+  struct Module {
+    const uint8_t *flags;
+    const uint64_t *ids;
+    uint64_t size;
+    bool edges;
+  };
+
+  CoverageRegistry() = default;
+
+private:
+  std::mutex mutex_;
+  std::vector<Module> modules_;
+};
+
+// Lock calls go through wrappers that try the lock first: an acquisition
+// that succeeds right away took the fast path, otherwise the thread waits in
+// the blocking call and the wait is timed. Hold time is from acquisition to
+// unlock by the same thread and is charged to the acquiring site. Waits on
+// conditions pause the hold. Every thread keeps its own statistics, so
+// profiling adds no contention itself.
+class LockProfiler {
+public:
+  // singleton
+  static LockProfiler &Create() {
+    static LockProfiler profiler;
+    return profiler;
+  }
+
+  // Site of the next lock call of the thread
+  void SetSite(uint64_t site) { threads_.Get().table.site = site; }
+
+  // Blocking lock may time out, then it counts as a failed try
+  template <typename Lock, typename BlockingLock>
+  int AcquireLock(void *lock, int (*try_lock)(Lock *),
+                  BlockingLock blocking_lock) {
+    auto &thread = threads_.Get();
+    uint64_t site = std::exchange(thread.table.site, 0);
+
+    uint64_t start = ReadTimestamp();
+    int result = try_lock(static_cast<Lock *>(lock));
+    bool contended = result == EBUSY;
+    if (contended) {
+      result = blocking_lock(static_cast<Lock *>(lock));
+    }
+    uint64_t acquired = ReadTimestamp();
+
+    if (result == 0) {
+      std::lock_guard<std::mutex> guard{thread.mutex};
+      Site &stats = thread.table.sites[site];
+      stats.acquisitions++;
+      if (contended) {
+        stats.contended++;
+        stats.wait_cycles += acquired - start;
+        stats.max_wait_cycles =
+            std::max(stats.max_wait_cycles, acquired - start);
+      }
+      thread.table.held[lock].push_back({site, acquired});
+    } else if (contended) {
+      std::lock_guard<std::mutex> guard{thread.mutex};
+      Site &stats = thread.table.sites[site];
+      stats.failed_tries++;
+      stats.wait_cycles += acquired - start;
+    }
+    return result;
+  }
+
+  template <typename Lock>
+  int TryLock(void *lock, int (*try_lock)(Lock *)) {
+    auto &thread = threads_.Get();
+    uint64_t site = std::exchange(thread.table.site, 0);
+
+    int result = try_lock(static_cast<Lock *>(lock));
+    uint64_t acquired = ReadTimestamp();
+
+    std::lock_guard<std::mutex> guard{thread.mutex};
+    Site &stats = thread.table.sites[site];
+    if (result == 0) {
+      stats.acquisitions++;
+      thread.table.held[lock].push_back({site, acquired});
+    } else if (result == EBUSY) {
+      stats.failed_tries++;
+    }
+    return result;
+  }
+
+  template <typename Lock>
+  int ReleaseLock(void *lock, int (*unlock)(Lock *)) {
+    uint64_t released = ReadTimestamp();
+    auto &thread = threads_.Get();
+    thread.table.site = 0;
+
+    EndHold(thread, lock, released);
+    return unlock(static_cast<Lock *>(lock));
+  }
+
+  // The wait unlocks the mutex and locks it again before returning, also
+  // when it times out. The hold is resumed then with its site, it's still
+  // the same acquisition.
+  template <typename Wait> int WaitCondition(void *mutex, Wait wait) {
+    uint64_t released = ReadTimestamp();
+    auto &thread = threads_.Get();
+    thread.table.site = 0;
+
+    std::optional<uint64_t> site = EndHold(thread, mutex, released);
+    int result = wait();
+    if (site) {
+      uint64_t reacquired = ReadTimestamp();
+      std::lock_guard<std::mutex> guard{thread.mutex};
+      thread.table.held[mutex].push_back({*site, reacquired});
+    }
+    return result;
+  }
+
+  // Attributes of lock call nodes, colored by wait relative to the site
+  // waiting most
+  void Print(const char *out_file_name) {
+    assert(out_file_name);
+    std::ofstream out{out_file_name};
+
+    std::map<uint64_t, Site> sites;
+    threads_.ForEach([&](auto &thread) {
+      for (const auto &[site, stats] : thread.table.sites) {
+        sites[site].Merge(stats);
+      }
+    });
+
+    uint64_t max_wait = 1;
+    for (const auto &[site, stats] : sites) {
+      max_wait = std::max(max_wait, stats.wait_cycles);
+    }
+
+    for (const auto &[site, stats] : sites) {
+      if (site == 0 || (stats.acquisitions == 0 && stats.failed_tries == 0)) {
+        continue;
+      }
+
+      uint64_t acquisitions = std::max<uint64_t>(stats.acquisitions, 1);
+      out << "node" << site << " [fillcolor=\""
+          << InterpolateColor(static_cast<double>(stats.wait_cycles) /
+                              max_wait)
+          << "\", xlabel=\"locks " << stats.acquisitions << ", contended "
+          << std::fixed << std::setprecision(1)
+          << 100.0 * stats.contended / acquisitions << "%";
+      if (stats.failed_tries != 0) {
+        out << ", failed tries " << stats.failed_tries;
+      }
+      out << ", wait avg " << stats.wait_cycles / acquisitions << " max "
+          << stats.max_wait_cycles << ", hold avg "
+          << stats.hold_cycles / acquisitions << " cycles\"];\n";
+    }
+  }
+
+private:
+  struct Site {
+    uint64_t acquisitions{0};
+    uint64_t contended{0};
+    uint64_t failed_tries{0};
+    uint64_t wait_cycles{0};
+    uint64_t max_wait_cycles{0};
+    uint64_t hold_cycles{0};
+
+    void Merge(const Site &other) {
+      acquisitions += other.acquisitions;
+      contended += other.contended;
+      failed_tries += other.failed_tries;
+      wait_cycles += other.wait_cycles;
+      max_wait_cycles = std::max(max_wait_cycles, other.max_wait_cycles);
+      hold_cycles += other.hold_cycles;
+    }
+  };
+
+  struct Held {
+    uint64_t site;
+    uint64_t acquired;
+  };
+
+  struct ThreadTable {
+    // Set and taken by the thread itself, no need to lock
+    uint64_t site{0};
+
+    std::unordered_map<uint64_t, Site> sites;
+    std::unordered_map<void *, std::vector<Held>> held;
+  };
+
+  using Thread = ThreadTables<ThreadTable>::Slot;
+
+  LockProfiler() = default;
+
+  // Charges the hold to its site, which is returned. Read locks and
+  // recursive mutexes may be held several times.
+  std::optional<uint64_t> EndHold(Thread &thread, void *lock,
+                                  uint64_t released) {
+    std::lock_guard<std::mutex> guard{thread.mutex};
+    auto held_it = thread.table.held.find(lock);
+    if (held_it == thread.table.held.end()) {
+      return std::nullopt;
+    }
+
+    Held held = held_it->second.back();
+    held_it->second.pop_back();
+    if (held_it->second.empty()) {
+      thread.table.held.erase(held_it);
+    }
+    thread.table.sites[held.site].hold_cycles += released - held.acquired;
+    return held.site;
+  }
+
+private:
+  ThreadTables<ThreadTable> threads_;
+};
+
+} // namespace
+
+extern "C" {
+
+void PrepareIncreasePasses(uint64_t from_node) {
+  NPassesLogger::Create().PrepareIncreasePasses(from_node);
+}
+
+void IncreaseNPasses(uint64_t to_node) {
+  NPassesLogger::Create().IncreaseNPasses(to_node);
+}
+
+void PrintNPassesEdges(const char *out_file_name) {
+  NPassesLogger::Create().PrintNPassesEdges(out_file_name);
+}
+
+void AddUsage(uint64_t node) { NodesUsageCounter::Create().AddUsage(node); }
+
+void PrintUsages(const char *out_file_name) {
+  NodesUsageCounter::Create().PrintUsages(out_file_name);
+}
+
+void AddDynamicallyAllocatedMemory(uint64_t node, void *memory,
+                                   uint64_t size) {
+  MemoryTracker::Create().AddDynMemCreation(node, memory, size);
+}
+
+void LogIfMemoryIsDynamicallyAllocated(uint64_t node, void *memory) {
+  MemoryTracker::Create().LogMemIfDyn(node, memory);
+}
+
+void LogDynamicMemoryAccess(uint64_t node, void *memory, uint64_t size,
+                            uint64_t kind) {
+  bool heap = MemoryTracker::Create().LogMemAccess(node, memory, size, kind);
+  BandwidthProfiler::Create().AddAccess(node, size, kind, heap);
+}
+
+void RemoveDynamicallAllocatedMemory(uint64_t node, void *memory) {
+  MemoryTracker::Create().RemoveDynMem(node, memory);
+}
+
+void ReallocDynamicallyAllocatedMemory(uint64_t node, void *old_memory,
+                                       void *new_memory, uint64_t size) {
+  MemoryTracker::Create().ReallocDynMem(node, old_memory, new_memory, size);
+}
+
+void RegisterAllocationSite(uint64_t node, const char *name) {
+  MemoryTracker::Create().RegisterSite(node, name);
+}
+
+void PrintAllocatedMemoryInfo(const char *out_file_name,
+                              const char *pool_candidates_file_name) {
+  MemoryTracker::Create().Print(out_file_name);
+  MemoryTracker::Create().PrintPoolCandidates(pool_candidates_file_name);
+}
+
+void PrintMemoryOffsetsInfo(const char *out_file_name) {
+  MemoryTracker::Create().PrintOffsets(out_file_name);
+}
+
+void ResetAllocatedMemoryInfo() { MemoryTracker::Create().Reset(); }
+
+void EnableFalseSharing(uint64_t period) {
+  MemoryTracker::Create().EnableSharing(period);
+}
+
+void PrintFalseSharing(const char *out_file_name) {
+  MemoryTracker::Create().PrintSharing(out_file_name);
+}
+
+void RegisterMemoryScope(uint64_t scope, uint64_t parent, const char *name) {
+  BandwidthProfiler::Create().RegisterScope(scope, parent, name);
+}
+
+void RegisterMemoryAccesses(const uint64_t *accesses, uint64_t size) {
+  BandwidthProfiler::Create().RegisterAccesses(accesses, size);
+}
+
+void EnterMemoryScope(uint64_t scope) {
+  BandwidthProfiler::Create().EnterScope(scope);
+}
+
+void PrintMemoryBandwidth(const char *out_file_name,
+                          const char *report_file_name) {
+  BandwidthProfiler::Create().Print(out_file_name, report_file_name);
+}
+
+void LogMemoryStride(uint64_t node, void *memory, uint64_t size) {
+  StrideProfiler::Create().LogStride(node, memory, size);
+}
+
+void PrintMemoryStrides(const char *out_file_name) {
+  StrideProfiler::Create().Print(out_file_name);
+}
+
+void RegisterFunction(uint64_t function, const char *name) {
+  CallingContextProfiler::Create().RegisterFunction(function, name);
+}
+
+void EnterFunction(uint64_t function) {
+  CallingContextProfiler::Create().EnterFunction(function);
+}
+
+void ExitFunction(uint64_t function) {
+  CallingContextProfiler::Create().ExitFunction(function);
+}
+
+void CountContextBlock(uint64_t block) {
+  CallingContextProfiler::Create().CountBlock(block);
+}
+
+void PrintCallingContexts(const char *out_file_name,
+                          const char *counts_file_name) {
+  CallingContextProfiler::Create().Print(out_file_name);
+  if (counts_file_name) {
+    CallingContextProfiler::Create().PrintCounts(counts_file_name);
+  }
+}
+
+void TimeFunctionEnter(uint64_t function) {
+  TimingProfiler::Create().EnterFunction(function);
+}
+
+void TimeFunctionExit(uint64_t function) {
+  TimingProfiler::Create().ExitFunction(function);
+}
+
+void TimeBlock(uint64_t block) { TimingProfiler::Create().EnterBlock(block); }
+
+void PrintTimes(const char *out_file_name) {
+  TimingProfiler::Create().Print(out_file_name);
+}
+
+void ProfileValue(uint64_t site, uint64_t value) {
+  ValueProfiler::Create().ProfileValue(site, value);
+}
+
+void PrintValueProfile(const char *out_file_name) {
+  ValueProfiler::Create().Print(out_file_name);
+}
+
+void RecordTripCount(uint64_t loop, uint64_t trips) {
+  TripCountProfiler::Create().RecordTripCount(loop, trips);
+}
+
+void PrintTripCounts(const char *out_file_name) {
+  TripCountProfiler::Create().Print(out_file_name);
+}
+
+void RegisterCoverage(const uint8_t *flags, const uint64_t *ids,
+                      uint64_t size, uint64_t edges) {
+  CoverageRegistry::Create().Register(flags, ids, size, edges != 0);
+}
+
+void PrintCoverage(const char *out_file_name) {
+  CoverageRegistry::Create().Print(out_file_name);
+}
+
+void SetLockSite(uint64_t site) { LockProfiler::Create().SetSite(site); }
+
+int ProfiledMutexLock(void *mutex) {
+  return LockProfiler::Create().AcquireLock<pthread_mutex_t>(
+      mutex, pthread_mutex_trylock, pthread_mutex_lock);
+}
+
+int ProfiledMutexTrylock(void *mutex) {
+  return LockProfiler::Create().TryLock<pthread_mutex_t>(
+      mutex, pthread_mutex_trylock);
+}
+
+int ProfiledMutexTimedlock(void *mutex, const void *abstime) {
+  auto *timeout = static_cast<const timespec *>(abstime);
+  return LockProfiler::Create().AcquireLock<pthread_mutex_t>(
+      mutex, pthread_mutex_trylock, [timeout](pthread_mutex_t *lock) {
+        return pthread_mutex_timedlock(lock, timeout);
+      });
+}
+
+int ProfiledMutexUnlock(void *mutex) {
+  return LockProfiler::Create().ReleaseLock<pthread_mutex_t>(
+      mutex, pthread_mutex_unlock);
+}
+
+int ProfiledRwlockRdlock(void *rwlock) {
+  return LockProfiler::Create().AcquireLock<pthread_rwlock_t>(
+      rwlock, pthread_rwlock_tryrdlock, pthread_rwlock_rdlock);
+}
+
+int ProfiledRwlockWrlock(void *rwlock) {
+  return LockProfiler::Create().AcquireLock<pthread_rwlock_t>(
+      rwlock, pthread_rwlock_trywrlock, pthread_rwlock_wrlock);
+}
+
+int ProfiledRwlockTryrdlock(void *rwlock) {
+  return LockProfiler::Create().TryLock<pthread_rwlock_t>(
+      rwlock, pthread_rwlock_tryrdlock);
+}
+
+int ProfiledRwlockTrywrlock(void *rwlock) {
+  return LockProfiler::Create().TryLock<pthread_rwlock_t>(
+      rwlock, pthread_rwlock_trywrlock);
+}
+
+int ProfiledRwlockTimedrdlock(void *rwlock, const void *abstime) {
+  auto *timeout = static_cast<const timespec *>(abstime);
+  return LockProfiler::Create().AcquireLock<pthread_rwlock_t>(
+      rwlock, pthread_rwlock_tryrdlock, [timeout](pthread_rwlock_t *lock) {
+        return pthread_rwlock_timedrdlock(lock, timeout);
+      });
+}
+
+int ProfiledRwlockTimedwrlock(void *rwlock, const void *abstime) {
+  auto *timeout = static_cast<const timespec *>(abstime);
+  return LockProfiler::Create().AcquireLock<pthread_rwlock_t>(
+      rwlock, pthread_rwlock_trywrlock, [timeout](pthread_rwlock_t *lock) {
+        return pthread_rwlock_timedwrlock(lock, timeout);
+      });
+}
+
+int ProfiledRwlockUnlock(void *rwlock) {
+  return LockProfiler::Create().ReleaseLock<pthread_rwlock_t>(
+      rwlock, pthread_rwlock_unlock);
+}
+
+int ProfiledSpinLock(void *lock) {
+  return LockProfiler::Create().AcquireLock<pthread_spinlock_t>(
+      lock, pthread_spin_trylock, pthread_spin_lock);
+}
+
+int ProfiledSpinTrylock(void *lock) {
+  return LockProfiler::Create().TryLock<pthread_spinlock_t>(
+      lock, pthread_spin_trylock);
+}
+
+int ProfiledSpinUnlock(void *lock) {
+  return LockProfiler::Create().ReleaseLock<pthread_spinlock_t>(
+      lock, pthread_spin_unlock);
+}
+
+int ProfiledCondWait(void *cond, void *mutex) {
+  return LockProfiler::Create().WaitCondition(mutex, [&] {
+    return pthread_cond_wait(static_cast<pthread_cond_t *>(cond),
+                             static_cast<pthread_mutex_t *>(mutex));
+  });
+}
+
+int ProfiledCondTimedwait(void *cond, void *mutex, const void *abstime) {
+  return LockProfiler::Create().WaitCondition(mutex, [&] {
+    return pthread_cond_timedwait(static_cast<pthread_cond_t *>(cond),
+                                  static_cast<pthread_mutex_t *>(mutex),
+                                  static_cast<const timespec *>(abstime));
+  });
+}
+
+// std::mutex keeps pthread_mutex_t at its start in both libstdc++ and
+// libc++. Errors, which std::mutex::lock would throw, are ignored.
+void ProfiledStdMutexLock(void *mutex) { ProfiledMutexLock(mutex); }
+
+bool ProfiledStdMutexTryLock(void *mutex) {
+  return ProfiledMutexTrylock(mutex) == 0;
+}
+
+void ProfiledStdMutexUnlock(void *mutex) { ProfiledMutexUnlock(mutex); }
+
+// Holds are charged to std::mutex, which is locked by the unique_lock
+void ProfiledStdConditionWait(void *condition, void *lock) {
+  auto *unique_lock = static_cast<std::unique_lock<std::mutex> *>(lock);
+  LockProfiler::Create().WaitCondition(unique_lock->mutex(), [&] {
+    static_cast<std::condition_variable *>(condition)->wait(*unique_lock);
+    return 0;
+  });
+}
+
+void PrintLockContention(const char *out_file_name) {
+  LockProfiler::Create().Print(out_file_name);
+}
 }
-}
\ No newline at end of file
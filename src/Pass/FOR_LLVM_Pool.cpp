@@ -0,0 +1,293 @@
+#include "Pass/FOR_LLVM_Pool.hpp"
+
+#include <sys/mman.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <utility>
+
+#ifdef __GLIBC__
+// free and realloc are interposed below, these are the C allocator ones
+extern "C" void __libc_free(void *memory);
+extern "C" void *__libc_realloc(void *memory, size_t size);
+#endif
+
+namespace {
+
+// All pooled blocks live in one reserved region, so ownership check is just
+// a range check. Region is split into spans, each span serves one size class.
+constexpr size_t kRegionSize = size_t{1} << 34;
+constexpr size_t kSpanShift = 16;
+constexpr size_t kSpanSize = size_t{1} << kSpanShift;
+constexpr size_t kNSpans = kRegionSize / kSpanSize;
+
+constexpr size_t kSizeClassStep = 16;
+constexpr size_t kNSizeClasses = kPoolMaxAllocationSize / kSizeClassStep;
+
+size_t SizeClass(size_t size) {
+  return size == 0 ? 0 : (size - 1) / kSizeClassStep;
+}
+
+size_t ClassSize(size_t size_class) {
+  return (size_class + 1) * kSizeClassStep;
+}
+
+struct FreeBlock {
+  FreeBlock *next;
+};
+
+// Base of the region once it is reserved, so checking memory of the C
+// allocator doesn't reserve it
+std::atomic<const char *> region_base{nullptr};
+
+void CFree(void *memory) {
+#ifdef __GLIBC__
+  __libc_free(memory);
+#else
+  std::free(memory);
+#endif
+}
+
+void *CRealloc(void *memory, size_t size) {
+#ifdef __GLIBC__
+  return __libc_realloc(memory, size);
+#else
+  return std::realloc(memory, size);
+#endif
+}
+
+class Region {
+public:
+  // singleton
+  static Region &Create() {
+    static Region region;
+    return region;
+  }
+
+  static bool Owns(const void *memory) {
+    const char *base = region_base.load(std::memory_order_acquire);
+    auto *byte = static_cast<const char *>(memory);
+    return base && byte >= base && byte < base + kRegionSize;
+  }
+
+  size_t GetSizeClass(const void *memory) const {
+    size_t span = (static_cast<const char *>(memory) - base_) >> kSpanShift;
+    return span_classes_[span];
+  }
+
+  // Returns new span carved into blocks of the size class
+  FreeBlock *AllocateSpan(size_t size_class) {
+    if (!base_) {
+      return nullptr;
+    }
+
+    size_t span = next_span_.fetch_add(1, std::memory_order_relaxed);
+    if (span >= kNSpans) {
+      return nullptr;
+    }
+
+    char *begin = base_ + span * kSpanSize;
+    if (mprotect(begin, kSpanSize, PROT_READ | PROT_WRITE) != 0) {
+      return nullptr;
+    }
+    span_classes_[span] = static_cast<uint8_t>(size_class);
+
+    size_t block_size = ClassSize(size_class);
+    size_t n_blocks = kSpanSize / block_size;
+
+    FreeBlock *head = nullptr;
+    for (size_t i = n_blocks; i > 0; --i) {
+      auto *block = reinterpret_cast<FreeBlock *>(begin + (i - 1) * block_size);
+      block->next = head;
+      head = block;
+    }
+
+    return head;
+  }
+
+private:
+  Region() {
+    // Address space is only reserved here, spans are committed on demand
+    void *base = mmap(nullptr, kRegionSize, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    base_ = base == MAP_FAILED ? nullptr : static_cast<char *>(base);
+    region_base.store(base_, std::memory_order_release);
+  }
+
+private:
+  char *base_{nullptr};
+  std::atomic<size_t> next_span_{0};
+  uint8_t span_classes_[kNSpans]{};
+};
+
+// Lists of exited threads, taken whole by threads which run out of blocks
+class SharedLists {
+public:
+  // singleton
+  static SharedLists &Create() {
+    static SharedLists lists;
+    return lists;
+  }
+
+  void Push(size_t size_class, FreeBlock *head) {
+    if (!head) {
+      return;
+    }
+
+    FreeBlock *tail = head;
+    while (tail->next) {
+      tail = tail->next;
+    }
+
+    std::lock_guard<std::mutex> lock{mutexes_[size_class]};
+    tail->next = heads_[size_class].load(std::memory_order_relaxed);
+    heads_[size_class].store(head, std::memory_order_relaxed);
+  }
+
+  FreeBlock *Take(size_t size_class) {
+    // Most of the time there is nothing to take, no need to lock
+    if (!heads_[size_class].load(std::memory_order_relaxed)) {
+      return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock{mutexes_[size_class]};
+    return heads_[size_class].exchange(nullptr, std::memory_order_relaxed);
+  }
+
+private:
+  SharedLists() = default;
+
+private:
+  std::mutex mutexes_[kNSizeClasses];
+  std::atomic<FreeBlock *> heads_[kNSizeClasses]{};
+};
+
+// Blocks freed by a thread go to its own lists, no matter who allocated them.
+// Lists of an exiting thread are returned to SharedLists.
+class ThreadCache {
+public:
+  // Null once the cache is destroyed, destructors of other thread-local
+  // objects may still allocate and free
+  static ThreadCache *Get() {
+    thread_local ThreadCache cache;
+    return destroyed_ ? nullptr : &cache;
+  }
+
+  ~ThreadCache() {
+    for (size_t size_class = 0; size_class < kNSizeClasses; ++size_class) {
+      SharedLists::Create().Push(size_class, free_lists_[size_class]);
+    }
+    destroyed_ = true;
+  }
+
+  void *Allocate(size_t size_class) {
+    FreeBlock *&head = free_lists_[size_class];
+    if (!head) {
+      head = SharedLists::Create().Take(size_class);
+    }
+    if (!head) {
+      head = Region::Create().AllocateSpan(size_class);
+      if (!head) {
+        return nullptr;
+      }
+    }
+
+    FreeBlock *block = head;
+    head = block->next;
+    return block;
+  }
+
+  void Free(void *memory, size_t size_class) {
+    auto *block = static_cast<FreeBlock *>(memory);
+    block->next = free_lists_[size_class];
+    free_lists_[size_class] = block;
+  }
+
+private:
+  ThreadCache() = default;
+
+private:
+  FreeBlock *free_lists_[kNSizeClasses]{};
+
+  static thread_local bool destroyed_;
+};
+
+thread_local bool ThreadCache::destroyed_ = false;
+
+} // namespace
+
+extern "C" {
+
+void *PoolAlloc(size_t size) {
+  if (size > kPoolMaxAllocationSize) {
+    return std::malloc(size);
+  }
+
+  ThreadCache *cache = ThreadCache::Get();
+  void *memory = cache ? cache->Allocate(SizeClass(size)) : nullptr;
+  return memory ? memory : std::malloc(size);
+}
+
+void *PoolCalloc(size_t count, size_t size) {
+  if (size != 0 && count > kPoolMaxAllocationSize / size) {
+    return std::calloc(count, size);
+  }
+
+  void *memory = PoolAlloc(count * size);
+  if (memory) {
+    std::memset(memory, 0, count * size);
+  }
+  return memory;
+}
+
+void *PoolRealloc(void *memory, size_t size) {
+  if (!Region::Owns(memory)) {
+    return CRealloc(memory, size);
+  }
+
+  if (size == 0) {
+    PoolFree(memory);
+    return nullptr;
+  }
+
+  size_t old_size = ClassSize(Region::Create().GetSizeClass(memory));
+  if (size <= old_size) {
+    return memory;
+  }
+
+  void *new_memory = std::malloc(size);
+  if (!new_memory) {
+    return nullptr;
+  }
+
+  std::memcpy(new_memory, memory, old_size);
+  PoolFree(memory);
+  return new_memory;
+}
+
+void PoolFree(void *memory) {
+  if (!Region::Owns(memory)) {
+    CFree(memory);
+    return;
+  }
+
+  size_t size_class = Region::Create().GetSizeClass(memory);
+  if (ThreadCache *cache = ThreadCache::Get()) {
+    cache->Free(memory, size_class);
+  } else {
+    auto *block = static_cast<FreeBlock *>(memory);
+    block->next = nullptr;
+    SharedLists::Create().Push(size_class, block);
+  }
+}
+
+#ifdef __GLIBC__
+// Pooled memory could also be freed where calls weren't rewritten: in
+// modules which aren't instrumented, in skipped functions or in libraries
+void free(void *memory) { PoolFree(memory); }
+
+void *realloc(void *memory, size_t size) { return PoolRealloc(memory, size); }
+#endif
+}
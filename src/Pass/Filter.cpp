@@ -0,0 +1,122 @@
+#include "Pass/Filter.hpp"
+
+#include <llvm/ADT/Twine.h>
+#include <llvm/Demangle/Demangle.h>
+#include <llvm/IR/DebugInfoMetadata.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/ErrorHandling.h>
+
+#include <algorithm>
+
+using namespace llvm;
+
+namespace pass {
+
+namespace {
+
+const std::pair<StringRef, int> kKindPrefixes[] = {
+    {"fun:", 0},
+    {"module:", 1},
+    {"src:", 2},
+};
+
+std::string GetSourceFile(const Function &F) {
+  if (DISubprogram *subprogram = F.getSubprogram()) {
+    return subprogram->getFilename().str();
+  }
+
+  return F.getParent()->getSourceFileName();
+}
+
+} // namespace
+
+FunctionFilter::FunctionFilter(const std::vector<std::string> &rules) {
+  for (const auto &line : rules) {
+    StringRef text = line;
+    bool allow = !text.consume_front("-");
+    text.consume_front("+");
+
+    auto prefix =
+        find_if(kKindPrefixes, [&](const auto &kind) {
+          return text.starts_with(kind.first);
+        });
+    if (prefix == std::end(kKindPrefixes)) {
+      report_fatal_error("Unknown kind of filter rule: " + Twine(line));
+    }
+    text = text.drop_front(prefix->first.size());
+
+    auto rule = std::make_unique<Rule>();
+    rule->kind = static_cast<Kind>(prefix->second);
+    rule->allow = allow;
+    rule->pattern = text.str();
+
+    StringRef pattern = rule->pattern;
+    if (pattern.size() > 1 && pattern.starts_with("/") &&
+        pattern.ends_with("/")) {
+      rule->regex.emplace(pattern.drop_front().drop_back());
+      std::string error;
+      if (!rule->regex->isValid(error)) {
+        report_fatal_error("Bad regex in filter rule " + Twine(line) + ": " +
+                           error);
+      }
+    } else {
+      auto glob = GlobPattern::create(pattern);
+      if (!glob) {
+        report_fatal_error("Bad glob in filter rule " + Twine(line) + ": " +
+                           toString(glob.takeError()));
+      }
+      rule->glob.emplace(std::move(*glob));
+    }
+
+    has_allow_[rule->kind] |= allow;
+    rules_.push_back(std::move(rule));
+  }
+}
+
+bool FunctionFilter::Rule::Matches(StringRef value) const {
+  return glob ? glob->match(value) : regex->match(value);
+}
+
+bool FunctionFilter::Allows(const Function &F) const {
+  if (rules_.empty()) {
+    return true;
+  }
+
+  std::string demangled = demangle(F.getName().str());
+  std::string source = GetSourceFile(F);
+
+  bool allowed[kKinds];
+  for (int kind = 0; kind < kKinds; ++kind) {
+    allowed[kind] = !has_allow_[kind];
+  }
+
+  for (const auto &rule : rules_) {
+    bool matches = false;
+    switch (rule->kind) {
+    case kFunction:
+      matches = rule->Matches(F.getName()) || rule->Matches(demangled);
+      break;
+    case kModule:
+      matches = rule->Matches(F.getParent()->getName());
+      break;
+    case kSource:
+      matches = rule->Matches(source);
+      break;
+    default:
+      break;
+    }
+
+    if (!matches) {
+      continue;
+    }
+    if (!rule->allow) {
+      return false;
+    }
+    allowed[rule->kind] = true;
+  }
+
+  return std::all_of(std::begin(allowed), std::end(allowed),
+                     [](bool allowed) { return allowed; });
+}
+
+} // namespace pass
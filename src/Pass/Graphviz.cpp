@@ -1,5 +1,8 @@
 #include "Pass/Graphviz.hpp"
+#include "Pass/Util.hpp"
 
+#include <algorithm>
+#include <cstdio>
 #include <regex>
 #include <utility>
 
@@ -7,16 +10,14 @@ namespace dot {
 
 // GraphvizSubgraphBuilder
 
-GraphvizSubgraphBuilder::GraphvizSubgraphBuilder(std::ofstream &out)
-    : out_(out) {}
+GraphvizSubgraphBuilder::GraphvizSubgraphBuilder(std::ofstream &out,
+                                                 StringTable *strings)
+    : out_(out), strings_(strings) {}
 
 void GraphvizSubgraphBuilder::Start(uint64_t subgraph_id,
                                     std::string_view label) {
   out_ << "subgraph cluster_" << subgraph_id << " {" << "\n";
-  std::string copy{label.begin(), label.end()};
-  copy = std::regex_replace(copy, std::regex(R"(")"), R"(\\")");
-
-  out_ << "label=\"" << copy << "\";" << "\n";
+  out_ << GraphvizBuilder::FormatLabel(label, strings_) << ";" << "\n";
 }
 
 GraphvizSubgraphBuilder::~GraphvizSubgraphBuilder() { out_ << "}" << "\n"; }
@@ -41,17 +42,20 @@ GraphvizBuilder::~GraphvizBuilder() {
 }
 
 GraphvizBuilder::GraphvizBuilder(GraphvizBuilder &&other)
-    : out_(std::move(other.out_)), nextNodeId_(other.nextNodeId_) {}
+    : out_(std::move(other.out_)), nextNodeId_(other.nextNodeId_),
+      with_end_(other.with_end_), strings_(other.strings_) {}
 
 GraphvizBuilder &GraphvizBuilder::operator=(GraphvizBuilder &&other) {
   out_ = std::move(other.out_);
   nextNodeId_ = other.nextNodeId_;
+  with_end_ = other.with_end_;
+  strings_ = other.strings_;
   return *this;
 }
 
 GraphvizSubgraphBuilder GraphvizBuilder::StartSubgraph(uint64_t subgraph_id,
                                                        std::string_view label) {
-  GraphvizSubgraphBuilder builder{out_};
+  GraphvizSubgraphBuilder builder{out_, strings_};
 
   builder.Start(subgraph_id, label);
 
@@ -59,20 +63,55 @@ GraphvizSubgraphBuilder GraphvizBuilder::StartSubgraph(uint64_t subgraph_id,
 }
 
 void GraphvizBuilder::AddNode(uint64_t node_id, std::string_view name,
-                              Color color) {
-  std::string copy{name.begin(), name.end()};
-  copy = std::regex_replace(copy, std::regex(R"(")"), R"(\")");
+                              Color color, std::string_view attributes) {
+  WriteNode(node_id, name, ColorToString(color), attributes);
+}
+
+void GraphvizBuilder::AddHeatNode(uint64_t node_id, std::string_view name,
+                                  double heat, std::string_view attributes) {
+  WriteNode(node_id, name, HeatToString(heat), attributes);
+}
 
-  out_ << "node" << node_id << " [label=\"" << copy
-       << "\", style=filled, fillcolor=\"" << ColorToString(color) << "\"];"
-       << std::endl;
+void GraphvizBuilder::WriteNode(uint64_t node_id, std::string_view name,
+                                std::string_view color,
+                                std::string_view attributes) {
+  out_ << "node" << node_id << " [" << FormatLabel(name, strings_)
+       << ", style=filled, fillcolor=\"" << color << "\"";
+  if (!attributes.empty()) {
+    out_ << ", " << attributes;
+  }
+  out_ << "];" << "\n";
 }
 
 void GraphvizBuilder::AddEdge(uint64_t from_node, uint64_t to_node,
-                              Color color) {
+                              Color color, std::string_view attributes) {
   out_ << "node" << from_node << " -> node" << to_node << " [color=\""
-       << ColorToString(color) << "\"];"
-       << "\n";
+       << ColorToString(color) << "\"";
+  if (!attributes.empty()) {
+    out_ << ", " << attributes;
+  }
+  out_ << "];" << "\n";
+}
+
+void GraphvizBuilder::UseStringTable(StringTable *strings) {
+  strings_ = strings;
+  if (strings_) {
+    out_ << "// strings: " << strings_->GetFilename() << "\n";
+  }
+}
+
+std::string GraphvizBuilder::FormatLabel(std::string_view name,
+                                         StringTable *strings) {
+  static const std::regex quote_regex(R"(")");
+
+  std::string copy{name.begin(), name.end()};
+  copy = std::regex_replace(copy, quote_regex, R"(\")");
+
+  if (strings) {
+    return "strref=" + std::to_string(strings->Intern(copy));
+  }
+
+  return "label=\"" + copy + "\"";
 }
 
 const char *GraphvizBuilder::ColorToString(Color color) {
@@ -92,4 +131,65 @@ const char *GraphvizBuilder::ColorToString(Color color) {
   }
 }
 
+std::string GraphvizBuilder::HeatToString(double heat) {
+  heat = std::clamp(heat, 0.0, 1.0);
+  int red = static_cast<int>(255 * heat);
+  int green = static_cast<int>(255 * (1.0 - heat));
+  char buffer[8];
+  std::snprintf(buffer, sizeof(buffer), "#%02X%02X00", red, green);
+  return std::string(buffer);
+}
+
+// GraphvizPartition
+
+GraphvizPartition::GraphvizPartition(const std::string &name, bool split,
+                                     StringTable *strings)
+    : name_(name), split_(split), strings_(strings) {
+  index_.emplace(Open(split_ ? name_ + ".index.dot" : name_ + ".dot"));
+}
+
+GraphvizBuilder &GraphvizPartition::StartFunction(uint64_t function_id,
+                                                  std::string_view name,
+                                                  bool has_body) {
+  if (!split_ || !has_body) {
+    return *index_;
+  }
+
+  index_->AddNode(function_id, name);
+
+  function_.emplace(
+      Open(name_ + "." + std::to_string(function_id) + ".dot"));
+  callees_.clear();
+  return *function_;
+}
+
+void GraphvizPartition::AddCall(uint64_t from_node, uint64_t caller_id,
+                                uint64_t callee_id,
+                                std::string_view callee_name,
+                                GraphvizBuilder::Color color) {
+  if (!split_) {
+    index_->AddEdge(from_node, callee_id, color);
+    return;
+  }
+
+  // Files are rendered one by one, so the call site keeps its edge. Node of
+  // the caller is already in its own file.
+  if (callee_id != caller_id && callees_.insert(callee_id).second) {
+    function_->AddNode(callee_id, callee_name);
+  }
+  function_->AddEdge(from_node, callee_id, color);
+
+  // Several call sites make one edge
+  if (calls_.emplace(caller_id, callee_id).second) {
+    index_->AddEdge(caller_id, callee_id, color);
+  }
+}
+
+GraphvizBuilder GraphvizPartition::Open(const std::string &filename) {
+  GraphvizBuilder builder{util::OpenFile(nullptr, filename.c_str()), false,
+                          false};
+  builder.UseStringTable(strings_);
+  return builder;
+}
+
 } // namespace dot
@@ -1,12 +1,40 @@
+#include <llvm/ADT/MapVector.h>
+#include <llvm/Analysis/BlockFrequencyInfo.h>
+#include <llvm/Analysis/BranchProbabilityInfo.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/IR/DebugInfoMetadata.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/Passes/PassBuilder.h>
 #include <llvm/Passes/PassPlugin.h>
-
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/ModRef.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/TimeProfiler.h>
+#include <llvm/Support/xxhash.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ModuleUtils.h>
+
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <regex>
 
+#include "Pass/FOR_LLVM_Log.hpp"
+#include "Pass/Filter.hpp"
 #include "Pass/Graphviz.hpp"
+#include "Pass/Pass.hpp"
 #include "Pass/Util.hpp"
 
 using namespace llvm;
@@ -15,28 +43,32 @@ namespace {
 
 // ------------------------------------------------------------------------------------------------
 
-std::ofstream GetDefUseGraphOutstream(StringRef module_name) {
-  auto filename =
-      "def_use_" +
-      std::regex_replace(module_name.str(), std::regex(R"(/)"), "_") + ".dot";
-
-  return util::OpenFile(nullptr, filename.c_str());
+// Graph files are named <kind>_<module>.dot, or split into files of
+// functions with the same prefix
+std::string GetGraphName(StringRef kind, StringRef module_name) {
+  return kind.str() + "_" +
+         std::regex_replace(module_name.str(), std::regex(R"(/)"), "_");
 }
 
-std::ofstream GetControlFlowGraphOutstream(StringRef module_name) {
-  auto filename =
-      "control_flow_" +
-      std::regex_replace(module_name.str(), std::regex(R"(/)"), "_") + ".dot";
-
-  return util::OpenFile(nullptr, filename.c_str());
+// Graph is split into files per function with GRAPH_SPLIT=function env
+// variable
+bool IsGraphSplit() {
+  const char *split = std::getenv("GRAPH_SPLIT");
+  return split && StringRef{split} == "function";
 }
 
-std::ofstream GetMemoryFlowGraphOutstream(StringRef module_name) {
+// Labels table shared by graphs of a module, enabled with GRAPH_STRING_TABLE
+// env variable
+std::unique_ptr<dot::StringTable> OpenStringTable(StringRef module_name) {
+  if (!std::getenv("GRAPH_STRING_TABLE")) {
+    return nullptr;
+  }
+
   auto filename =
-      "memory_flow_" +
-      std::regex_replace(module_name.str(), std::regex(R"(/)"), "_") + ".dot";
+      "strings_" +
+      std::regex_replace(module_name.str(), std::regex(R"(/)"), "_") + ".txt";
 
-  return util::OpenFile(nullptr, filename.c_str());
+  return std::make_unique<dot::StringTable>(filename);
 }
 
 std::string GetInstrumentNPassesOutputFilename() {
@@ -54,9 +86,94 @@ std::string GetInstrumentMemoryOutputFile() {
   return filename ? filename : "memory_usage";
 }
 
-uint64_t GetId(Value *value) { return reinterpret_cast<uint64_t>(value); }
+std::string GetInstrumentMemoryOffsetsOutputFile() {
+  const char *filename = std::getenv("MEMORY_OFFSETS");
+  return filename ? filename : "memory_offsets";
+}
+
+std::string GetInstrumentMemoryBandwidthOutputFile() {
+  const char *filename = std::getenv("MEMORY_BANDWIDTH");
+  return filename ? filename : "memory_bandwidth";
+}
+
+std::string GetInstrumentMemoryBandwidthReportFile() {
+  const char *filename = std::getenv("MEMORY_BANDWIDTH_REPORT");
+  return filename ? filename : "memory_bandwidth_report";
+}
+
+std::string GetInstrumentFalseSharingOutputFile() {
+  const char *filename = std::getenv("FALSE_SHARING");
+  return filename ? filename : "false_sharing";
+}
+
+// Every FALSE_SHARING_PERIOD-th access of a thread, which may be to the heap,
+// is sampled for false sharing detection, it is off without the variable
+uint64_t GetFalseSharingPeriod() {
+  const char *period = std::getenv("FALSE_SHARING_PERIOD");
+  return period ? std::stoull(period) : 0;
+}
+
+std::string GetInstrumentMemoryStridesOutputFile() {
+  const char *filename = std::getenv("MEMORY_STRIDES");
+  return filename ? filename : "memory_strides";
+}
+
+std::string GetInstrumentCallingContextsOutputFile() {
+  const char *filename = std::getenv("CALLING_CONTEXT_STACKS");
+  return filename ? filename : "calling_context_stacks";
+}
+
+std::string GetInstrumentCallingContextCountsOutputFile() {
+  const char *filename = std::getenv("CALLING_CONTEXT_COUNTS");
+  return filename ? filename : "calling_context_counts";
+}
+
+std::string GetInstrumentTimesOutputFile() {
+  const char *filename = std::getenv("TIMING");
+  return filename ? filename : "timing";
+}
+
+std::string GetInstrumentValueProfileOutputFile() {
+  const char *filename = std::getenv("VALUE_PROFILE");
+  return filename ? filename : "value_profile";
+}
+
+std::string GetInstrumentTripCountsOutputFile() {
+  const char *filename = std::getenv("LOOP_TRIP_COUNTS");
+  return filename ? filename : "loop_trip_counts";
+}
+
+std::string GetInstrumentPoolCandidatesOutputFile() {
+  const char *filename = std::getenv("MEMORY_POOL_CANDIDATES");
+  return filename ? filename : "memory_pool_candidates";
+}
+
+std::string GetInstrumentLockContentionOutputFile() {
+  const char *filename = std::getenv("LOCK_CONTENTION");
+  return filename ? filename : "lock_contention";
+}
+
+std::string GetInstrumentCoverageOutputFile() {
+  const char *filename = std::getenv("COVERAGE");
+  return filename ? filename : "coverage";
+}
+
+
+// Time trace scopes, they show up in -ftime-trace output. Every pass scope
+// contains BuildGraph and Instrument phases, RenderLabel is reported as a
+// total over all labels.
+const char kRenderLabelScope[] = "RenderLabel";
+const char kBuildGraphScope[] = "BuildGraph";
+const char kInstrumentScope[] = "Instrument";
+
+// Detail of the pass scope, used to get cost per instruction
+std::string GetTraceDetail(Module &M) {
+  return std::to_string(M.getInstructionCount()) + " instructions";
+}
 
 std::string ExtractBBName(BasicBlock &BB) {
+  TimeTraceScope scope{kRenderLabelScope};
+
   std::string name;
   raw_string_ostream ss{name};
   BB.printAsOperand(ss);
@@ -65,6 +182,8 @@ std::string ExtractBBName(BasicBlock &BB) {
 }
 
 std::string ExtractIName(Instruction &I) {
+  TimeTraceScope scope{kRenderLabelScope};
+
   std::string name;
   raw_string_ostream ss{name};
   I.print(ss, true);
@@ -72,35 +191,536 @@ std::string ExtractIName(Instruction &I) {
   return name;
 }
 
+// Reciprocal throughput of an instruction estimated by the target cost
+// model, roughly its cycles. Concat scripts weigh execution counts by it.
+std::string GetCostAttribute(Instruction &I, const TargetTransformInfo &TTI) {
+  InstructionCost cost =
+      TTI.getInstructionCost(&I, TargetTransformInfo::TCK_RecipThroughput);
+  return "cost=" + std::to_string(cost.isValid() ? *cost.getValue() : 1);
+}
+
+// Short number for graph attributes and labels
+std::string FormatDouble(double value) {
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "%.4g", value);
+  return buffer;
+}
+
+// libstdc++ wraps pthread in static __gthread_* helpers, their mangled names
+// aren't reserved ones. Runtime built without optimizations locks through
+// them too, as std::mutex members are linked from the first module, so
+// probes in them would call runtime recursively.
 bool IsInternal(Function &F) {
   return F.isIntrinsic() || F.getName().starts_with("__") ||
-         F.getName().starts_with("_ZSt") || F.getName().starts_with("_ZNSt");
+         F.getName().starts_with("_ZSt") || F.getName().starts_with("_ZNSt") ||
+         F.getName().contains("__gthread_");
 }
 
+// Runtime functions from FOR_LLVM_*.hpp
+const StringRef kLoggingFunctions[] = {
+    "PrepareIncreasePasses",
+    "IncreaseNPasses",
+    "PrintNPassesEdges",
+    "AddUsage",
+    "PrintUsages",
+    "AddDynamicallyAllocatedMemory",
+    "LogIfMemoryIsDynamicallyAllocated",
+    "LogDynamicMemoryAccess",
+    "RemoveDynamicallAllocatedMemory",
+    "ReallocDynamicallyAllocatedMemory",
+    "RegisterAllocationSite",
+    "PrintAllocatedMemoryInfo",
+    "PrintMemoryOffsetsInfo",
+    "ResetAllocatedMemoryInfo",
+    "EnableFalseSharing",
+    "PrintFalseSharing",
+    "RegisterMemoryScope",
+    "RegisterMemoryAccesses",
+    "EnterMemoryScope",
+    "PrintMemoryBandwidth",
+    "PoolAlloc",
+    "PoolCalloc",
+    "PoolRealloc",
+    "PoolFree",
+    "LogMemoryStride",
+    "PrintMemoryStrides",
+    "RegisterFunction",
+    "EnterFunction",
+    "ExitFunction",
+    "CountContextBlock",
+    "PrintCallingContexts",
+    "TimeFunctionEnter",
+    "TimeFunctionExit",
+    "TimeBlock",
+    "PrintTimes",
+    "ProfileValue",
+    "PrintValueProfile",
+    "RecordTripCount",
+    "PrintTripCounts",
+    "RegisterCoverage",
+    "PrintCoverage",
+    "SetLockSite",
+    "ProfiledMutexLock",
+    "ProfiledMutexTrylock",
+    "ProfiledMutexTimedlock",
+    "ProfiledMutexUnlock",
+    "ProfiledRwlockRdlock",
+    "ProfiledRwlockWrlock",
+    "ProfiledRwlockTryrdlock",
+    "ProfiledRwlockTrywrlock",
+    "ProfiledRwlockTimedrdlock",
+    "ProfiledRwlockTimedwrlock",
+    "ProfiledRwlockUnlock",
+    "ProfiledSpinLock",
+    "ProfiledSpinTrylock",
+    "ProfiledSpinUnlock",
+    "ProfiledCondWait",
+    "ProfiledCondTimedwait",
+    "ProfiledStdMutexLock",
+    "ProfiledStdMutexTryLock",
+    "ProfiledStdMutexUnlock",
+    "ProfiledStdConditionWait",
+    "PrintLockContention",
+};
+
+// Names for PASS_LIST
+const StringRef kPassNames[] = {
+    "control_flow",
+    "def_use",
+    "memory",
+    "memory_stride",
+    "calling_context",
+    "timing",
+    "loops",
+    "coverage",
+    "locks",
+};
+
 bool IsLogging(Function &F) {
-  return F.getName() == "PrintNPassesEdges" ||
-         F.getName() == "IncreaseNPasses" ||
-         F.getName() == "PrepareIncreasePasses" || F.getName() == "AddUsage";
+  return is_contained(kLoggingFunctions, F.getName());
 }
 
 bool IsLogging(Module &M) { return M.getName().contains("FOR_LLVM"); }
 
+// ThinLTO imports bodies of functions defined in other modules and turns
+// copies of inline functions not kept by linker into imported ones, they are
+// graphed and instrumented by their own module
+bool IsImported(Function &F) { return F.hasAvailableExternallyLinkage(); }
+
+bool HasBody(Function &F) { return !F.isDeclaration() && !IsImported(F); }
+
+// Results are printed before every return of main, optimized main may have
+// several. Main without returns, e.g. ending with exit(), prints before its
+// last instruction.
+void CreateCallAtMainExits(Function &F, IRBuilder<> &builder,
+                           FunctionCallee callee, ArrayRef<Value *> args) {
+  SmallVector<Instruction *, 2> exits;
+  for (auto &BB : F) {
+    if (isa<ReturnInst>(BB.getTerminator())) {
+      exits.push_back(BB.getTerminator());
+    }
+  }
+  if (exits.empty()) {
+    exits.push_back(&F.back().back());
+  }
+
+  for (Instruction *exit : exits) {
+    builder.SetInsertPoint(exit);
+    builder.CreateCall(callee, args);
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+// Node ids
+
+// Ids depend only on names and positions in IR, so they are the same in every
+// module and every build: a call to a function defined in another TU points
+// to the same node as its definition there. Function ids are hashes of names,
+// blocks, arguments and instructions are numbered inside of a function.
+// Instructions added by instrumentation are tagged and skipped, so passes
+// running one after another agree on ids.
+class NodeIds {
+public:
+  NodeIds() = default;
+
+  explicit NodeIds(Module &M) {
+    VariableUnits variable_units;
+    for (DICompileUnit *unit : M.debug_compile_units()) {
+      for (DIGlobalVariableExpression *expression :
+           unit->getGlobalVariables()) {
+        variable_units[expression->getVariable()] = unit;
+      }
+    }
+
+    for (auto &GV : M.global_values()) {
+      ids_[&GV] = GetGlobalId(GV, variable_units);
+    }
+
+    for (auto &F : M) {
+      uint64_t function_id = ids_[&F];
+
+      for (auto &arg : F.args()) {
+        ids_[&arg] = Combine(function_id, kArgumentTag, arg.getArgNo());
+      }
+
+      uint64_t n_blocks = 0;
+      uint64_t n_instructions = 0;
+      for (auto &BB : F) {
+        if (auto split = GetSplit(BB)) {
+          splits_[&BB] = BB.getTerminator()->getMetadata(kSplitMetadata);
+          auto [original_id, index] = *split;
+          ids_[&BB] = Combine(original_id, kSplitTag, index);
+          uint64_t &n_splits = n_splits_[original_id];
+          n_splits = std::max(n_splits, index + 1);
+        } else {
+          ids_[&BB] = Combine(function_id, kBlockTag, n_blocks++);
+        }
+
+        for (auto &I : BB) {
+          if (!I.hasMetadata(kInstrumentationMetadata)) {
+            ids_[&I] = Combine(function_id, kInstructionTag, n_instructions++);
+          }
+        }
+      }
+    }
+  }
+
+  // Values without stable id (constants, instrumentation) are identified by
+  // address
+  uint64_t Get(const Value *value) const {
+    auto it = ids_.find(value);
+    return it != ids_.end() ? it->second : reinterpret_cast<uint64_t>(value);
+  }
+
+  // Instructions inserted after ids were built are instrumentation
+  void MarkInstrumentation(Module &M) const {
+    MDNode *tag = MDNode::get(M.getContext(), {});
+    for (auto &F : M) {
+      for (auto &I : instructions(F)) {
+        if (!ids_.count(&I)) {
+          I.setMetadata(kInstrumentationMetadata, tag);
+        }
+      }
+    }
+  }
+
+  // Blocks made by splitting original ones, e.g. for fast paths, aren't
+  // numbered, so ids of the rest stay the same. Their ids are derived from
+  // the block they were split from and the number of its splits, which are
+  // kept in metadata, so later passes and builds get the same ids.
+  void MarkSplit(BasicBlock &BB, BasicBlock &original) {
+    // Splitting moves the terminator, and the mark with it, to the new block
+    if (auto it = splits_.find(&original); it != splits_.end()) {
+      original.getTerminator()->setMetadata(kSplitMetadata, it->second);
+    }
+
+    uint64_t original_id = Get(&original);
+    uint64_t index = n_splits_[original_id]++;
+    ids_[&BB] = Combine(original_id, kSplitTag, index);
+
+    Type *int64_type = Type::getInt64Ty(BB.getContext());
+    Metadata *operands[] = {
+        ConstantAsMetadata::get(ConstantInt::get(int64_type, original_id)),
+        ConstantAsMetadata::get(ConstantInt::get(int64_type, index))};
+    MDNode *split = MDNode::get(BB.getContext(), operands);
+    BB.getTerminator()->setMetadata(kSplitMetadata, split);
+    splits_[&BB] = split;
+  }
+
+private:
+  // Id of the original block and index of the split
+  static std::optional<std::pair<uint64_t, uint64_t>>
+  GetSplit(BasicBlock &BB) {
+    Instruction *terminator = BB.getTerminator();
+    MDNode *split =
+        terminator ? terminator->getMetadata(kSplitMetadata) : nullptr;
+    if (!split) {
+      return std::nullopt;
+    }
+
+    return std::make_pair(
+        mdconst::extract<ConstantInt>(split->getOperand(0))->getZExtValue(),
+        mdconst::extract<ConstantInt>(split->getOperand(1))->getZExtValue());
+  }
+
+  using VariableUnits =
+      DenseMap<const DIGlobalVariable *, const DICompileUnit *>;
+
+  // Local symbols of different TUs may share names, so their TU is hashed
+  // too. ThinLTO promotes locals to globals named <name>.llvm.<hash>.
+  static uint64_t GetGlobalId(const GlobalValue &GV,
+                              const VariableUnits &variable_units) {
+    StringRef name = GV.getName();
+    size_t promoted = name.find(".llvm.");
+    if (!GV.hasLocalLinkage() && promoted == StringRef::npos) {
+      return xxHash64(name);
+    }
+
+    return xxHash64(GetLocalKey(GV, name.substr(0, promoted), variable_units));
+  }
+
+  // TU and name a local had before linking. Full LTO merges modules into one
+  // named after the output and renames clashing locals to <name>.<n>, so
+  // both are taken from debug info when it's there.
+  static std::string GetLocalKey(const GlobalValue &GV, StringRef name,
+                                 const VariableUnits &variable_units) {
+    const DICompileUnit *unit = nullptr;
+    StringRef debug_names[2];
+    if (auto *F = dyn_cast<Function>(&GV)) {
+      if (DISubprogram *subprogram = F->getSubprogram()) {
+        unit = subprogram->getUnit();
+        debug_names[0] = subprogram->getLinkageName();
+        debug_names[1] = subprogram->getName();
+      }
+    } else if (auto *variable = dyn_cast<GlobalVariable>(&GV)) {
+      SmallVector<DIGlobalVariableExpression *, 1> expressions;
+      variable->getDebugInfo(expressions);
+      if (!expressions.empty()) {
+        DIGlobalVariable *debug_variable = expressions.front()->getVariable();
+        unit = variable_units.lookup(debug_variable);
+        debug_names[0] = debug_variable->getLinkageName();
+        debug_names[1] = debug_variable->getName();
+      }
+    }
+
+    if (!unit) {
+      return GV.getParent()->getSourceFileName() + ":" + name.str();
+    }
+
+    auto [original, suffix] = name.rsplit('.');
+    if (!suffix.empty() && all_of(suffix, isDigit) &&
+        is_contained(debug_names, original)) {
+      name = original;
+    }
+    return unit->getFilename().str() + ":" + name.str();
+  }
+
+  static uint64_t Combine(uint64_t parent_id, uint64_t tag, uint64_t index) {
+    uint64_t data[] = {parent_id, tag << 56 | index};
+    return xxHash64(ArrayRef<uint8_t>{reinterpret_cast<uint8_t *>(data),
+                                      sizeof(data)});
+  }
+
+private:
+  DenseMap<const Value *, uint64_t> ids_;
+  // Marks of split blocks and number of splits of a block
+  DenseMap<const BasicBlock *, MDNode *> splits_;
+  DenseMap<uint64_t, uint64_t> n_splits_;
+
+  static constexpr uint64_t kArgumentTag = 1;
+  static constexpr uint64_t kBlockTag = 2;
+  static constexpr uint64_t kInstructionTag = 3;
+  static constexpr uint64_t kSplitTag = 4;
+  static constexpr const char *kInstrumentationMetadata =
+      "pass.instrumentation";
+  static constexpr const char *kSplitMetadata = "pass.split";
+};
+
+// ------------------------------------------------------------------------------------------------
+// Definitions shared by TUs
+
+// Inline functions and templates are defined by every TU using them, and
+// linker keeps one copy. Copies have the same ids, so instrumenting all of
+// them is harmless, but every graph would get its own copy of the nodes.
+// With ODR_FUNCTIONS_DIR set, the first module compiled claims such a
+// function there, a file per function id holding the module name, and only
+// that module graphs its body. Claims outlive the build, so the directory is
+// set per build. At LTO the whole program or prevailing copies are seen
+// (ThinLTO turns the others into imported available_externally ones), so
+// there are no claims.
+bool IsShared(Function &F) {
+  if (!F.hasLinkOnceLinkage() && !F.hasWeakLinkage()) {
+    return false;
+  }
+
+  static const bool claimed = [] {
+    const char *point = std::getenv("PASS_EXTENSION_POINT");
+    bool link_time = point && (StringRef{point} == "full_lto" ||
+                               StringRef{point} == "thin_lto");
+    return !link_time && std::getenv("ODR_FUNCTIONS_DIR");
+  }();
+  return claimed;
+}
+
+// Module owning the function, claimed by this one if nobody did before
+std::string ClaimFunction(uint64_t function_id, StringRef module_name) {
+  SmallString<128> path{std::getenv("ODR_FUNCTIONS_DIR")};
+  if (auto error = sys::fs::create_directories(path)) {
+    report_fatal_error("Can't create " + path + ": " + error.message());
+  }
+  sys::path::append(path, Twine{function_id});
+
+  // Creating is atomic, so modules compiled in parallel agree on the owner
+  {
+    std::error_code error;
+    raw_fd_ostream out{path, error, sys::fs::CD_CreateNew};
+    if (!error) {
+      out << module_name;
+      return module_name.str();
+    }
+  }
+
+  auto owner = MemoryBuffer::getFile(path);
+  return owner ? (*owner)->getBuffer().str() : "";
+}
+
+// Graph of the function is built here: it's defined and not graphed by
+// another module
+bool IsGraphed(Function &F, const NodeIds &ids) {
+  if (!HasBody(F)) {
+    return false;
+  }
+  if (!IsShared(F)) {
+    return true;
+  }
+
+  // Owners of the process are cached, GraphExtractor asks from many threads
+  static std::mutex mutex;
+  static std::map<uint64_t, std::string> owners;
+
+  StringRef module_name = F.getParent()->getName();
+  uint64_t function_id = ids.Get(&F);
+  std::lock_guard<std::mutex> lock{mutex};
+  auto it = owners.find(function_id);
+  if (it == owners.end()) {
+    it = owners.emplace(function_id, ClaimFunction(function_id, module_name))
+             .first;
+  }
+  return it->second == module_name;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Selective instrumentation
+
+// Rules of PASS_FILTER file, everything is instrumented without it
+const pass::FunctionFilter &GetFunctionFilter() {
+  static const pass::FunctionFilter filter = [] {
+    const char *filename = std::getenv("PASS_FILTER");
+    return filename ? pass::FunctionFilter{util::ReadLines(filename)}
+                    : pass::FunctionFilter{};
+  }();
+
+  return filter;
+}
+
+// Ids of functions called at least PASS_SKIP_THRESHOLD times in the
+// PASS_SKIP_PROFILE of a previous run: n_passes_edges of control flow pass,
+// where calls are edges to function nodes, or output of timing pass
+const std::set<uint64_t> &GetHotFunctions() {
+  static const std::set<uint64_t> hot = [] {
+    std::set<uint64_t> hot;
+    const char *filename = std::getenv("PASS_SKIP_PROFILE");
+    if (!filename) {
+      return hot;
+    }
+
+    std::ifstream in{filename};
+    if (!in) {
+      report_fatal_error("Can't open PASS_SKIP_PROFILE " + Twine(filename));
+    }
+
+    const char *threshold_env = std::getenv("PASS_SKIP_THRESHOLD");
+    uint64_t threshold = threshold_env ? std::stoull(threshold_env) : 10000;
+
+    std::regex edge_regex{R"re(node\d+ -> node(\d+) \[label="(\d+)".*)re"};
+    std::regex runs_regex{R"re(node(\d+) \[.* (\d+) runs".*)re"};
+    std::map<uint64_t, uint64_t> counts;
+    std::string line;
+    while (std::getline(in, line)) {
+      std::smatch match;
+      if (std::regex_match(line, match, edge_regex) ||
+          std::regex_match(line, match, runs_regex)) {
+        counts[std::stoull(match[1].str())] += std::stoull(match[2].str());
+      }
+    }
+
+    for (const auto &[node, count] : counts) {
+      if (count >= threshold) {
+        hot.insert(node);
+      }
+    }
+
+    return hot;
+  }();
+
+  return hot;
+}
+
+// Leaves call nothing but intrinsics, so skipping them doesn't hide other
+// functions from calling context and timing
+bool IsLeaf(Function &F) {
+  for (auto &I : instructions(F)) {
+    auto *call = dyn_cast<CallBase>(&I);
+    if (!call) {
+      continue;
+    }
+
+    Function *callee = call->getCalledFunction();
+    if (!callee || !(callee->isIntrinsic() || IsLogging(*callee))) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Functions rejected by PASS_FILTER, or hot leaves already characterized by
+// a previous profile, aren't instrumented. Their graphs are still built, and
+// main still prints results.
+bool IsFilteredOut(Function &F, const NodeIds &ids) {
+  if (!GetFunctionFilter().Allows(F)) {
+    return true;
+  }
+
+  const auto &hot = GetHotFunctions();
+  return hot.count(ids.Get(&F)) && IsLeaf(F);
+}
+
 // ------------------------------------------------------------------------------------------------
 // Control flow graph
 
 struct ControlFlowBuilderPass : public PassInfoMixin<ControlFlowBuilderPass> {
 public:
-  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+  // Without instrumentation only static graph is written
+  explicit ControlFlowBuilderPass(bool instrument = true)
+      : instrument_(instrument) {}
+
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
     if (IsLogging(M)) {
       return PreservedAnalyses::none();
     }
 
-    dot::GraphvizBuilder graphviz(GetControlFlowGraphOutstream(M.getName()),
-                                  false, false);
+    TimeTraceScope pass_scope{"ControlFlowBuilderPass",
+                              [&] { return GetTraceDetail(M); }};
+    ids_ = NodeIds{M};
+
+    {
+      TimeTraceScope scope{kBuildGraphScope};
+      auto strings = OpenStringTable(M.getName());
+      dot::GraphvizPartition graphs{GetGraphName("control_flow", M.getName()),
+                                    IsGraphSplit(), strings.get()};
+      auto &FAM =
+          MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+
+      for (auto &F : M) {
+        if (IsInternal(F) || IsLogging(F)) {
+          continue;
+        }
+
+        auto &graphviz =
+            graphs.StartFunction(ids_.Get(&F), F.getName(), IsGraphed(F, ids_));
+        CreateNodes(F, graphviz, FAM);
+        CreateEdges(F, graphs, graphviz, FAM);
+      }
+    }
+
+    if (!instrument_) {
+      return PreservedAnalyses::all();
+    }
 
-    CreateNodes(M, graphviz);
-    CreateEdges(M, graphviz);
+    TimeTraceScope scope{kInstrumentScope};
     InstrumentWithLogger(M);
+    ids_.MarkInstrumentation(M);
 
     return PreservedAnalyses::all();
   }
@@ -108,22 +728,38 @@ public:
 private:
   // Creating nodes
 
-  void CreateNodes(Module &M, dot::GraphvizBuilder &graphviz) {
-    for (auto &F : M) {
-      if (IsInternal(F) || IsLogging(F)) {
-        continue;
-      }
+  void CreateNodes(Function &F, dot::GraphvizBuilder &graphviz,
+                   FunctionAnalysisManager &FAM) {
+    auto func_subgraph = graphviz.StartSubgraph(ids_.Get(&F), F.getName());
+    graphviz.AddNode(ids_.Get(&F), F.getName());
+    if (!IsGraphed(F, ids_)) {
+      return;
+    }
 
-      auto func_subgraph = graphviz.StartSubgraph(GetId(&F), F.getName());
-      graphviz.AddNode(GetId(&F), F.getName());
-      for (auto &BB : F) {
-        auto bb_name = ExtractBBName(BB);
-        auto bb_subgraph = graphviz.StartSubgraph(GetId(&BB), bb_name);
-        graphviz.AddNode(GetId(&BB), bb_name);
+    auto &TTI = FAM.getResult<TargetIRAnalysis>(F);
+    auto &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
 
-        for (auto &I : BB) {
-          graphviz.AddNode(GetId(&I), ExtractIName(I));
-        }
+    // Static heat: frequency estimated by the compiler, relative to the
+    // entry block and colored relative to the hottest block
+    uint64_t entry_freq = BFI.getBlockFreq(&F.getEntryBlock()).getFrequency();
+    uint64_t max_freq = 1;
+    for (auto &BB : F) {
+      max_freq = std::max(max_freq, BFI.getBlockFreq(&BB).getFrequency());
+    }
+
+    for (auto &BB : F) {
+      uint64_t freq = BFI.getBlockFreq(&BB).getFrequency();
+      double heat = static_cast<double>(freq) / max_freq;
+      auto bb_name = ExtractBBName(BB);
+      auto bb_subgraph = graphviz.StartSubgraph(ids_.Get(&BB), bb_name);
+      graphviz.AddHeatNode(
+          ids_.Get(&BB), bb_name, heat,
+          "freq=" + FormatDouble(static_cast<double>(freq) /
+                                 std::max<uint64_t>(entry_freq, 1)));
+
+      for (auto &I : BB) {
+        graphviz.AddHeatNode(ids_.Get(&I), ExtractIName(I), heat,
+                             GetCostAttribute(I, TTI));
       }
     }
   }
@@ -131,14 +767,17 @@ private:
   // Creating edges
 
   void ProceedInstructionFlow(Instruction &I, BasicBlock &BB,
-                              dot::GraphvizBuilder &graphviz) {
+                              dot::GraphvizPartition &graphs,
+                              dot::GraphvizBuilder &graphviz,
+                              const BranchProbabilityInfo &BPI) {
     if (auto *call = dyn_cast<CallBase>(&I)) {
       Value *callee = call->getCalledOperand();
       assert(callee);
 
       auto *function_callee = dyn_cast<Function>(callee);
       if (!IsInternal(*function_callee) && !IsLogging(*function_callee)) {
-        graphviz.AddEdge(GetId(&I), GetId(callee), kCallFlowColor);
+        graphs.AddCall(ids_.Get(&I), ids_.Get(I.getFunction()),
+                       ids_.Get(callee), callee->getName(), kCallFlowColor);
       }
     }
 
@@ -149,29 +788,44 @@ private:
         if (!successor) {
           continue;
         }
-        graphviz.AddEdge(GetId(&I), GetId(successor), kTerminatorFlowColor);
+
+        // Estimated probability is compared with measured one by ConcatCF
+        std::string attributes;
+        if (I.getNumSuccessors() > 1) {
+          BranchProbability probability =
+              BPI.getEdgeProbability(&BB, successor);
+          double share = static_cast<double>(probability.getNumerator()) /
+                         probability.getDenominator();
+          attributes = "prob=" + FormatDouble(share) + ", label=\"" +
+                       FormatDouble(100 * share) + "%\"";
+        }
+        graphviz.AddEdge(ids_.Get(&I), ids_.Get(successor),
+                         kTerminatorFlowColor, attributes);
       }
     } else if (I.getNextNode()) {
-      graphviz.AddEdge(GetId(&I), GetId(I.getNextNode()), kNormalFlowColor);
+      graphviz.AddEdge(ids_.Get(&I), ids_.Get(I.getNextNode()),
+                       kNormalFlowColor);
     } else if (BB.getNextNode()) {
-      graphviz.AddEdge(GetId(&I), GetId(BB.getNextNode()), kNormalFlowColor);
+      graphviz.AddEdge(ids_.Get(&I), ids_.Get(BB.getNextNode()),
+                       kNormalFlowColor);
     }
   }
 
-  void CreateEdges(Module &M, dot::GraphvizBuilder &graphviz) {
-    for (auto &F : M) {
-      if (F.isDeclaration() || IsInternal(F) || IsLogging(F)) {
-        continue;
-      }
+  void CreateEdges(Function &F, dot::GraphvizPartition &graphs,
+                   dot::GraphvizBuilder &graphviz,
+                   FunctionAnalysisManager &FAM) {
+    if (!IsGraphed(F, ids_)) {
+      return;
+    }
 
-      graphviz.AddEdge(GetId(&F), GetId(&F.front()), kNormalFlowColor);
+    auto &BPI = FAM.getResult<BranchProbabilityAnalysis>(F);
+    graphviz.AddEdge(ids_.Get(&F), ids_.Get(&F.front()), kNormalFlowColor);
 
-      for (auto &BB : F) {
-        graphviz.AddEdge(GetId(&BB), GetId(&BB.front()), kNormalFlowColor);
+    for (auto &BB : F) {
+      graphviz.AddEdge(ids_.Get(&BB), ids_.Get(&BB.front()), kNormalFlowColor);
 
-        for (auto &I : BB) {
-          ProceedInstructionFlow(I, BB, graphviz);
-        }
+      for (auto &I : BB) {
+        ProceedInstructionFlow(I, BB, graphs, graphviz, BPI);
       }
     }
   }
@@ -215,7 +869,7 @@ private:
     Value *funcName =
         builder.CreateGlobalString(GetInstrumentNPassesOutputFilename());
     Value *args[] = {funcName};
-    builder.CreateCall(printNPassesEdges, args);
+    CreateCallAtMainExits(F, builder, printNPassesEdges, args);
   }
 
   void InstrumentBasicBlock(BasicBlock &BB, uint64_t to_node_id,
@@ -252,7 +906,7 @@ private:
 
     if (call) {
       Value *to_node_id_value =
-          ConstantInt::get(int64_type, GetId(call->getCalledFunction()));
+          ConstantInt::get(int64_type, ids_.Get(call->getCalledFunction()));
       Value *to_args[] = {to_node_id_value};
 
       builder.CreateCall(PrepareFunctionPrepareIncreasePasses(M, Ctx),
@@ -277,7 +931,7 @@ private:
     IRBuilder<> builder(Ctx);
 
     for (auto &F : M) {
-      if (F.isDeclaration() || IsInternal(F)) {
+      if (F.isDeclaration() || IsImported(F) || IsInternal(F)) {
         continue;
       }
 
@@ -285,20 +939,23 @@ private:
         InstrumentMain(F, builder, Ctx, M);
       }
 
-      if (IsLogging(F)) {
+      if (IsLogging(F) || IsFilteredOut(F, ids_)) {
         continue;
       }
 
       for (auto &BB : F) {
-        InstrumentBasicBlock(BB, GetId(&BB), builder, M, Ctx);
+        InstrumentBasicBlock(BB, ids_.Get(&BB), builder, M, Ctx);
         for (auto &I : BB) {
-          InstrumentInstruction(I, GetId(&I), builder, M, Ctx);
+          InstrumentInstruction(I, ids_.Get(&I), builder, M, Ctx);
         }
       }
     }
   }
 
 private:
+  bool instrument_;
+  NodeIds ids_;
+
   static constexpr auto kNormalFlowColor = dot::GraphvizBuilder::Color::Black;
   static constexpr auto kCallFlowColor = dot::GraphvizBuilder::Color::Blue;
   static constexpr auto kTerminatorFlowColor =
@@ -311,45 +968,122 @@ private:
 
 struct DefUseBuilderPass : public PassInfoMixin<DefUseBuilderPass> {
 public:
-  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+  // Without instrumentation only static graph is written
+  explicit DefUseBuilderPass(bool instrument = true)
+      : instrument_(instrument) {}
+
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
     if (IsLogging(M)) {
       return PreservedAnalyses::none();
     }
 
-    dot::GraphvizBuilder graphviz(GetDefUseGraphOutstream(M.getName()), false,
-                                  false);
+    TimeTraceScope pass_scope{"DefUseBuilderPass",
+                              [&] { return GetTraceDetail(M); }};
+    ids_ = NodeIds{M};
+
+    // Files of functions can't share constant nodes
+    const char *intern = std::getenv("DEF_USE_INTERN_CONSTANTS");
+    intern_globally_ =
+        intern && StringRef{intern} == "module" && !IsGraphSplit();
+    constant_nodes_.clear();
+    existent_nodes_.clear();
+    file_nodes_.clear();
+
+    {
+      TimeTraceScope scope{kBuildGraphScope};
+      auto strings = OpenStringTable(M.getName());
+      dot::GraphvizPartition graphs{GetGraphName("def_use", M.getName()),
+                                    IsGraphSplit(), strings.get()};
+
+      BuildStaticGraph(M, graphs, MAM);
+    }
 
-    BuildStaticGraph(M, graphviz);
-    InstrumentWithLogger(M);
+    if (!instrument_) {
+      return PreservedAnalyses::all();
+    }
 
-    return PreservedAnalyses::all();
+    TimeTraceScope scope{kInstrumentScope};
+    ReadValueKinds();
+    ReadValueFeedback();
+
+    InstrumentWithLogger(M, MAM);
+    bool changed_cfg = EmitFastPaths(M);
+    ids_.MarkInstrumentation(M);
+
+    return changed_cfg ? PreservedAnalyses::none() : PreservedAnalyses::all();
   }
 
 private:
+  // Operands profiled with DEF_USE_VALUE_PROFILE
+  enum ValueKind : unsigned {
+    kValueDivisor = 1 << 0,
+    kValueShift = 1 << 1,
+    kValueSwitch = 1 << 2,
+    kValueLength = 1 << 3,
+    kValueLoopBound = 1 << 4,
+    kValueAll = (1 << 5) - 1,
+  };
+
+  // Most frequent value of a site in the feedback profile
+  struct DominantValue {
+    int64_t value;
+    uint64_t count;
+    uint64_t total;
+  };
+
   // Build static graph
   bool Exists(uint64_t id) { return existent_nodes_.count(id); }
 
-  bool NodeExists(Value &value) { return Exists(GetId(&value)); }
+  bool NodeExists(Value &value) { return Exists(ids_.Get(&value)); }
 
   void AddNodeIfNoneExistent(Value &value, std::string_view name,
                              dot::GraphvizBuilder &graphviz) {
-    uint64_t id = GetId(&value);
-    if (Exists(id)) {
+    uint64_t id = ids_.Get(&value);
+    existent_nodes_.insert(id);
+    if (!file_nodes_.insert(id).second) {
       return;
     }
 
-    existent_nodes_.insert(id);
-
-    graphviz.AddNode(id, name);
+    auto *I = dyn_cast<Instruction>(&value);
+    graphviz.AddNode(id, name, dot::GraphvizBuilder::Color::Gray,
+                     I && tti_ ? GetCostAttribute(*I, *tti_) : "");
   }
 
   uint64_t AddNewUniqueNode(std::string_view name,
                             dot::GraphvizBuilder &graphviz) {
-    static uint64_t node_id = 0;
+    // Shared by modules processed in parallel by GraphExtractor
+    static std::atomic<uint64_t> next_node_id{0};
+    uint64_t node_id = next_node_id++;
     assert(existent_nodes_.count(node_id) == 0);
 
     graphviz.AddNode(node_id, name);
-    return node_id++;
+    return node_id;
+  }
+
+  // Constants are interned per function, or per module with
+  // DEF_USE_INTERN_CONSTANTS=module, so their number doesn't grow with uses
+  uint64_t GetConstantNode(Constant &constant, Function &F,
+                           dot::GraphvizBuilder &graphviz) {
+    Function *scope = intern_globally_ ? nullptr : &F;
+    auto [it, inserted] = constant_nodes_.try_emplace({scope, &constant}, 0);
+    if (inserted) {
+      std::string name;
+      raw_string_ostream ss{name};
+      PrintOperand(constant, ss);
+      it->second = AddNewUniqueNode(ss.str(), graphviz);
+    }
+
+    return it->second;
+  }
+
+  // Instructions are labeled with their text, other values as operands
+  static void PrintOperand(Value &use, raw_ostream &ss) {
+    TimeTraceScope scope{kRenderLabelScope};
+    if (isa<Instruction>(use)) {
+      use.print(ss);
+    } else {
+      use.printAsOperand(ss);
+    }
   }
 
   void ProceedInstructionFlow(Instruction &I, dot::GraphvizBuilder &graphviz) {
@@ -366,38 +1100,48 @@ private:
 
     if (!I.operands().empty()) {
       name.clear();
-      I.print(ss);
+      PrintOperand(I, ss);
       AddNodeIfNoneExistent(I, name, graphviz);
     }
 
     for (auto &U : I.operands()) {
-      name.clear();
-
       Value *use = U.get();
 
-      if (dyn_cast<Constant>(use)) {
-        use->printAsOperand(ss);
-        uint64_t node_id = AddNewUniqueNode(name, graphviz);
-        graphviz.AddEdge(node_id, GetId(&I), kDefUseColor);
+      if (auto *constant = dyn_cast<Constant>(use)) {
+        uint64_t node_id =
+            GetConstantNode(*constant, *I.getFunction(), graphviz);
+        graphviz.AddEdge(node_id, ids_.Get(&I), kDefUseColor);
         continue;
       }
 
-      if (dyn_cast<Instruction>(use)) {
-        use->print(ss);
-      } else {
-        use->printAsOperand(ss);
-      }
+      name.clear();
+      PrintOperand(*use, ss);
       AddNodeIfNoneExistent(*use, name, graphviz);
-      graphviz.AddEdge(GetId(use), GetId(&I), kDefUseColor);
+      graphviz.AddEdge(ids_.Get(use), ids_.Get(&I), kDefUseColor);
     }
   }
 
-  void BuildStaticGraph(Module &M, dot::GraphvizBuilder &graphviz) {
+  void BuildStaticGraph(Module &M, dot::GraphvizPartition &graphs,
+                        ModuleAnalysisManager &MAM) {
+    auto &FAM =
+        MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
     for (auto &F : M) {
-      auto func_subgraph = graphviz.StartSubgraph(GetId(&F), F.getName());
+      if (!F.isDeclaration() && !IsGraphed(F, ids_)) {
+        continue;
+      }
+
+      tti_ = &FAM.getResult<TargetIRAnalysis>(F);
+
+      auto &graphviz =
+          graphs.StartFunction(ids_.Get(&F), F.getName(), HasBody(F));
+      if (graphs.IsSplit()) {
+        file_nodes_.clear();
+      }
+      auto func_subgraph =
+          graphviz.StartSubgraph(ids_.Get(&F), F.getName());
       for (auto &BB : F) {
         auto bb_subgraph =
-            graphviz.StartSubgraph(GetId(&BB), ExtractBBName(BB));
+            graphviz.StartSubgraph(ids_.Get(&BB), ExtractBBName(BB));
         for (auto &I : BB) {
           ProceedInstructionFlow(I, graphviz);
         }
@@ -423,7 +1167,15 @@ private:
     Value *funcName =
         builder.CreateGlobalString(GetInstrumentNUsageOutputFilename());
     Value *args[] = {funcName};
-    builder.CreateCall(printNUsages, args);
+    CreateCallAtMainExits(F, builder, printNUsages, args);
+
+    if (value_kinds_) {
+      FunctionCallee printValues =
+          M.getOrInsertFunction("PrintValueProfile", printNUsagesType);
+      Value *valuesName =
+          builder.CreateGlobalString(GetInstrumentValueProfileOutputFile());
+      CreateCallAtMainExits(F, builder, printValues, {valuesName});
+    }
   }
 
   void InstrumentInstruction(Instruction &I, Module &M, LLVMContext &Ctx,
@@ -433,9 +1185,14 @@ private:
     }
     Instruction *insert_point = &I;
 
-    if (isa<PHINode>(I) || isa<LandingPadInst>(I)) {
-      insert_point = I.getNextNode();
-      assert(insert_point);
+    // Optimized code has blocks with several phis. Calls go after EH pads,
+    // blocks of catchswitch have no place for them.
+    if (isa<PHINode>(I) || I.isEHPad()) {
+      BasicBlock *BB = I.getParent();
+      if (BB->getFirstInsertionPt() == BB->end()) {
+        return;
+      }
+      insert_point = &*BB->getFirstInsertionPt();
     }
 
     Type *ret_type = Type::getVoidTy(Ctx);
@@ -447,18 +1204,20 @@ private:
         M.getOrInsertFunction("AddUsage", funcAddUsageType);
 
     builder.SetInsertPoint(insert_point);
-    Value *node_id = ConstantInt::get(int64_type, GetId(&I));
+    Value *node_id = ConstantInt::get(int64_type, ids_.Get(&I));
     Value *args[] = {node_id};
 
     builder.CreateCall(funcAddUsage, args);
   }
 
-  void InstrumentWithLogger(Module &M) {
+  void InstrumentWithLogger(Module &M, ModuleAnalysisManager &MAM) {
     LLVMContext &Ctx = M.getContext();
     IRBuilder<> builder{Ctx};
+    auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M)
+                    .getManager();
 
     for (auto &F : M) {
-      if (IsLogging(F) || IsInternal(F)) {
+      if (IsLogging(F) || IsInternal(F) || IsImported(F)) {
         continue;
       }
 
@@ -466,50 +1225,381 @@ private:
         InstrumentMain(F, M, Ctx, builder);
       }
 
+      if (IsFilteredOut(F, ids_)) {
+        continue;
+      }
+
+      LoopInfo *LI = nullptr;
+      if (value_kinds_ & kValueLoopBound && !F.isDeclaration()) {
+        LI = &FAM.getResult<LoopAnalysis>(F);
+      }
+
       for (auto &&BB : F) {
         for (auto &I : BB) {
           InstrumentInstruction(I, M, Ctx, builder);
+          InstrumentValue(I, LI, M, Ctx, builder);
         }
       }
     }
   }
 
-private:
-  std::set<uint64_t> existent_nodes_;
+  // Value profiling
 
-  static constexpr auto kDefUseColor = dot::GraphvizBuilder::Color::Black;
-};
+  // Comma separated kinds, "all" or "1" selects every one
+  void ReadValueKinds() {
+    const char *kinds = std::getenv("DEF_USE_VALUE_PROFILE");
+    value_kinds_ = 0;
+    if (!kinds) {
+      return;
+    }
 
-// ------------------------------------------------------------------------------------------------
+    const std::pair<StringRef, unsigned> kKindNames[] = {
+        {"div", kValueDivisor},   {"shift", kValueShift},
+        {"switch", kValueSwitch}, {"mem", kValueLength},
+        {"loop", kValueLoopBound}, {"all", kValueAll},
+        {"1", kValueAll},
+    };
+
+    SmallVector<StringRef> names;
+    StringRef{kinds}.split(names, ',', -1, false);
+    for (StringRef name : names) {
+      name = name.trim();
+      auto kind = find_if(kKindNames,
+                          [&](const auto &kind) { return kind.first == name; });
+      if (kind == std::end(kKindNames)) {
+        report_fatal_error("Unknown kind in DEF_USE_VALUE_PROFILE: " + name);
+      }
+      value_kinds_ |= kind->second;
+    }
+  }
 
-// Memory alloc pass
+  static bool IsDivision(Instruction &I) {
+    switch (I.getOpcode()) {
+    case Instruction::UDiv:
+    case Instruction::SDiv:
+    case Instruction::URem:
+    case Instruction::SRem:
+      return true;
+    default:
+      return false;
+    }
+  }
 
-struct MemoryAllocPass : public PassInfoMixin<MemoryAllocPass> {
-public:
-  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
-    if (IsLogging(M)) {
-      return PreservedAnalyses::none();
+  // Values are extended to 64 bits as the instruction treats them
+  static bool IsSigned(Instruction &I) {
+    if (auto *cmp = dyn_cast<ICmpInst>(&I)) {
+      return cmp->isSigned();
     }
 
-    dot::GraphvizBuilder graphviz{GetMemoryFlowGraphOutstream(M.getName()),
-                                  false, false};
+    return isa<SwitchInst>(I) || I.getOpcode() == Instruction::SDiv ||
+           I.getOpcode() == Instruction::SRem;
+  }
 
-    CreateNodes(M, graphviz);
+  // Operand of I whose values are profiled, if any
+  Value *GetProfiledOperand(Instruction &I, LoopInfo *LI, unsigned kinds) {
+    Value *operand = nullptr;
+    if (IsDivision(I) && kinds & kValueDivisor) {
+      operand = I.getOperand(1);
+    } else if (I.isShift() && kinds & kValueShift) {
+      operand = I.getOperand(1);
+    } else if (auto *switch_inst = dyn_cast<SwitchInst>(&I);
+               switch_inst && kinds & kValueSwitch) {
+      operand = switch_inst->getCondition();
+    } else if (auto *mem = dyn_cast<MemIntrinsic>(&I);
+               mem && kinds & kValueLength) {
+      operand = mem->getLength();
+    } else if (isa<ICmpInst>(I) && LI && kinds & kValueLoopBound) {
+      operand = GetLoopBound(cast<ICmpInst>(I), *LI);
+    }
+
+    if (!operand || isa<Constant>(operand) ||
+        !operand->getType()->isIntegerTy() ||
+        operand->getType()->getIntegerBitWidth() > 64) {
+      return nullptr;
+    }
+
+    return operand;
+  }
+
+  // Invariant operand of a comparison that decides whether to leave a loop
+  static Value *GetLoopBound(ICmpInst &cmp, LoopInfo &LI) {
+    BasicBlock *BB = cmp.getParent();
+    Loop *L = LI.getLoopFor(BB);
+    auto *branch = dyn_cast<BranchInst>(BB->getTerminator());
+    if (!L || !L->isLoopExiting(BB) || !branch ||
+        !branch->isConditional() || branch->getCondition() != &cmp) {
+      return nullptr;
+    }
+
+    for (Value *operand : cmp.operands()) {
+      if (L->isLoopInvariant(operand)) {
+        return operand;
+      }
+    }
+
+    return nullptr;
+  }
+
+  void InstrumentValue(Instruction &I, LoopInfo *LI, Module &M,
+                       LLVMContext &Ctx, IRBuilder<> &builder) {
+    if (!value_kinds_ || !NodeExists(I)) {
+      return;
+    }
+
+    Value *operand = GetProfiledOperand(I, LI, value_kinds_);
+    if (!operand) {
+      return;
+    }
+
+    Type *int64_type = Type::getInt64Ty(Ctx);
+    FunctionCallee profileValue = M.getOrInsertFunction(
+        "ProfileValue", Type::getVoidTy(Ctx), int64_type, int64_type);
+
+    builder.SetInsertPoint(&I);
+    Value *value = builder.CreateIntCast(operand, int64_type, IsSigned(I));
+    builder.CreateCall(profileValue,
+                       {ConstantInt::get(int64_type, ids_.Get(&I)), value});
+  }
+
+  // Feedback
+
+  // Sites whose most frequent value in DEF_USE_VALUE_FEEDBACK profile is
+  // dominant enough to get a fast path
+  void ReadValueFeedback() {
+    dominant_values_.clear();
+    const char *filename = std::getenv("DEF_USE_VALUE_FEEDBACK");
+    if (!filename) {
+      return;
+    }
+
+    std::regex site_regex{
+        R"(node(\d+)\s.*value_profile="(\d+):(-?\d+)=(\d+).*)"};
+    for (auto &line : util::ReadLines(filename)) {
+      std::smatch match;
+      if (!std::regex_match(line, match, site_regex)) {
+        continue;
+      }
+
+      DominantValue dominant{std::stoll(match[3].str()),
+                             std::stoull(match[4].str()),
+                             std::stoull(match[2].str())};
+      if (dominant.total >= kMinFeedbackSamples &&
+          dominant.count >= kFastPathShare * dominant.total) {
+        dominant_values_[std::stoull(match[1].str())] = dominant;
+      }
+    }
+  }
+
+  // Profiled ids are the same as ids of this build, so fast paths are
+  // emitted before ids of added code are dropped
+  bool EmitFastPaths(Module &M) {
+    if (dominant_values_.empty()) {
+      return false;
+    }
+
+    std::vector<std::pair<Instruction *, DominantValue>> sites;
+    for (auto &F : M) {
+      if (IsLogging(F) || IsInternal(F) || IsImported(F)) {
+        continue;
+      }
+
+      for (auto &I : instructions(F)) {
+        auto it = dominant_values_.find(ids_.Get(&I));
+        if (it != dominant_values_.end()) {
+          sites.emplace_back(&I, it->second);
+        }
+      }
+    }
+
+    bool changed = false;
+    for (auto &[I, dominant] : sites) {
+      changed |= EmitFastPath(*I, dominant);
+    }
+
+    return changed;
+  }
+
+  // Division by the dominant divisor and memcpy/memset of the dominant
+  // length are guarded copies with a constant operand, which backend
+  // strength-reduces or expands inline. Dominant switch case is checked
+  // before the switch. Other sites are only profiled.
+  bool EmitFastPath(Instruction &I, const DominantValue &dominant) {
+    LLVMContext &Ctx = I.getContext();
+    Value *operand = GetProfiledOperand(I, nullptr, kValueAll);
+    if (!operand) {
+      return false;
+    }
+
+    bool is_memory = isa<MemIntrinsic>(I);
+    if (!isa<SwitchInst>(I) && !IsDivision(I) && !is_memory) {
+      return false;
+    }
+    if (dominant.value == 0 && !isa<SwitchInst>(I)) {
+      return false;
+    }
+    if (is_memory &&
+        (dominant.value < 0 || dominant.value > kMaxInlineLength)) {
+      return false;
+    }
+
+    auto *constant = ConstantInt::get(cast<IntegerType>(operand->getType()),
+                                      dominant.value, IsSigned(I));
+    // Weights are 32 bit
+    double share = static_cast<double>(dominant.count) / dominant.total;
+    MDNode *weights = MDBuilder{Ctx}.createBranchWeights(
+        share * kWeightScale, (1 - share) * kWeightScale);
+
+    IRBuilder<> builder{&I};
+    Value *is_dominant = builder.CreateICmpEQ(operand, constant);
+
+    if (auto *switch_inst = dyn_cast<SwitchInst>(&I)) {
+      PeelSwitchCase(*switch_inst, constant, is_dominant, weights);
+      return true;
+    }
 
+    BasicBlock *head = I.getParent();
+    Instruction *then_term = nullptr;
+    Instruction *else_term = nullptr;
+    SplitBlockAndInsertIfThenElse(is_dominant, &I, &then_term, &else_term,
+                                  weights);
+    BasicBlock *tail = I.getParent();
+
+    Instruction *fast = I.clone();
+    fast->setOperand(is_memory ? 2 : 1, constant);
+    builder.SetInsertPoint(then_term);
+    builder.Insert(fast);
+
+    // Original instruction stays as the slow path, so it keeps its id
+    if (!I.getType()->isVoidTy()) {
+      builder.SetInsertPoint(&tail->front());
+      PHINode *phi = builder.CreatePHI(I.getType(), 2);
+      I.replaceAllUsesWith(phi);
+      phi->addIncoming(fast, then_term->getParent());
+      phi->addIncoming(&I, else_term->getParent());
+    }
+    I.moveBefore(else_term);
+
+    ids_.MarkSplit(*then_term->getParent(), *head);
+    ids_.MarkSplit(*else_term->getParent(), *head);
+    ids_.MarkSplit(*tail, *head);
+    return true;
+  }
+
+  void PeelSwitchCase(SwitchInst &switch_inst, ConstantInt *value,
+                      Value *is_dominant, MDNode *weights) {
+    BasicBlock *head = switch_inst.getParent();
+    BasicBlock *dest = switch_inst.findCaseValue(value)->getCaseSuccessor();
+    BasicBlock *rest = head->splitBasicBlock(&switch_inst);
+
+    // Values of phis are the same as if coming through the switch
+    for (PHINode &phi : dest->phis()) {
+      phi.addIncoming(phi.getIncomingValueForBlock(rest), head);
+    }
+
+    Instruction *branch = head->getTerminator();
+    IRBuilder<> builder{branch};
+    builder.CreateCondBr(is_dominant, dest, rest, weights);
+    branch->eraseFromParent();
+
+    ids_.MarkSplit(*rest, *head);
+  }
+
+private:
+  bool instrument_;
+  NodeIds ids_;
+  // Nodes of the whole graph, and nodes defined in the file being written:
+  // values used by several functions, e.g. metadata, are defined in every
+  // function file of split graph
+  std::set<uint64_t> existent_nodes_;
+  std::set<uint64_t> file_nodes_;
+  // Cost model of the function which graph is built
+  const TargetTransformInfo *tti_{nullptr};
+
+  bool intern_globally_{false};
+  std::map<std::pair<Function *, Constant *>, uint64_t> constant_nodes_;
+
+  unsigned value_kinds_{0};
+  std::map<uint64_t, DominantValue> dominant_values_;
+
+  static constexpr uint64_t kMinFeedbackSamples = 16;
+  static constexpr double kFastPathShare = 0.8;
+  // Longer copies are calls anyway
+  static constexpr int64_t kMaxInlineLength = 256;
+  static constexpr uint32_t kWeightScale = 1 << 20;
+
+  static constexpr auto kDefUseColor = dot::GraphvizBuilder::Color::Black;
+};
+
+// ------------------------------------------------------------------------------------------------
+
+// Memory alloc pass
+
+struct MemoryAllocPass : public PassInfoMixin<MemoryAllocPass> {
+public:
+  // Without instrumentation only static graph is written
+  explicit MemoryAllocPass(bool instrument = true) : instrument_(instrument) {}
+
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+    if (IsLogging(M)) {
+      return PreservedAnalyses::none();
+    }
+
+    TimeTraceScope pass_scope{"MemoryAllocPass",
+                              [&] { return GetTraceDetail(M); }};
+    ids_ = NodeIds{M};
+    // Scopes of a previous module are registered by its own constructor
+    scopes_.clear();
+    scope_accesses_.clear();
+
+    {
+      TimeTraceScope scope{kBuildGraphScope};
+      auto strings = OpenStringTable(M.getName());
+      dot::GraphvizPartition graphs{GetGraphName("memory_flow", M.getName()),
+                                    IsGraphSplit(), strings.get()};
+
+      CreateNodes(M, graphs);
+    }
+
+    if (!instrument_) {
+      return PreservedAnalyses::all();
+    }
+
+    TimeTraceScope scope{kInstrumentScope};
     LLVMContext &Ctx = M.getContext();
     IRBuilder<> builder{Ctx};
+    auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M)
+                    .getManager();
+
+    ReadPoolSites();
+    NameAllocationSites(M);
+    RegisterAllocationSites(M, Ctx, builder);
 
     for (auto &F : M) {
+      if (IsImported(F)) {
+        continue;
+      }
+
       if (F.getName() == "main") {
         InstrumentMain(F, M, Ctx, builder);
       }
 
+      // Allocations are tracked everywhere, so memory is known wherever it
+      // is accessed
+      bool log_accesses = !IsFilteredOut(F, ids_);
       for (auto &BB : F) {
         for (auto &I : BB) {
-          InstrumentInstruction(I, M, Ctx, builder);
+          InstrumentInstruction(I, log_accesses, M, Ctx, builder);
         }
       }
+
+      // Calls don't change loops, so they are found after accesses are
+      // instrumented
+      if (log_accesses && HasBody(F) && !IsInternal(F)) {
+        InstrumentScopes(F, FAM.getResult<LoopAnalysis>(F), M, Ctx, builder);
+      }
     }
+    RegisterScopes(M, Ctx, builder);
+    ids_.MarkInstrumentation(M);
 
     return PreservedAnalyses::all();
   }
@@ -517,26 +1607,108 @@ public:
 private:
   // Create nodes
 
-  void CreateNodes(Module &M, dot::GraphvizBuilder &graphviz) {
+  void CreateNodes(Module &M, dot::GraphvizPartition &graphs) {
     for (auto &F : M) {
       if (IsInternal(F) || IsLogging(F)) {
         continue;
       }
 
-      auto func_subgraph = graphviz.StartSubgraph(GetId(&F), F.getName());
-      graphviz.AddNode(GetId(&F), F.getName());
+      auto &graphviz =
+          graphs.StartFunction(ids_.Get(&F), F.getName(), IsGraphed(F, ids_));
+      auto func_subgraph =
+          graphviz.StartSubgraph(ids_.Get(&F), F.getName());
+      graphviz.AddNode(ids_.Get(&F), F.getName());
+      if (!IsGraphed(F, ids_)) {
+        continue;
+      }
+
       for (auto &BB : F) {
         auto bb_name = ExtractBBName(BB);
-        auto bb_subgraph = graphviz.StartSubgraph(GetId(&BB), bb_name);
-        graphviz.AddNode(GetId(&BB), bb_name);
+        auto bb_subgraph = graphviz.StartSubgraph(ids_.Get(&BB), bb_name);
+        graphviz.AddNode(ids_.Get(&BB), bb_name);
 
         for (auto &I : BB) {
-          graphviz.AddNode(GetId(&I), ExtractIName(I));
+          graphviz.AddNode(ids_.Get(&I), ExtractIName(I));
+        }
+      }
+    }
+  }
+
+  // Allocation sites
+
+  static StringRef GetCalleeName(Instruction &I) {
+    auto *call = dyn_cast<CallBase>(&I);
+    if (!call || !call->getCalledFunction()) {
+      return "";
+    }
+
+    return call->getCalledFunction()->getName();
+  }
+
+  // Allowlist of sites to substitute with the pool allocator, as node<id> of
+  // their calls. When it is given, all free/realloc calls are rewritten too,
+  // memory freed elsewhere is handled by free/realloc of the pool runtime.
+  void ReadPoolSites() {
+    const char *filename = std::getenv("MEMORY_POOL_SITES");
+    pooling_enabled_ = filename != nullptr;
+    if (!pooling_enabled_) {
+      return;
+    }
+
+    for (auto &site : util::ReadLines(filename)) {
+      pool_sites_.insert(site);
+    }
+  }
+
+  // Sites are named "<function>:<index of malloc/calloc call in function>"
+  // for reports. Names of static functions of different TUs may be the same,
+  // so pool sites are selected by ids.
+  void NameAllocationSites(Module &M) {
+    for (auto &F : M) {
+      if (IsInternal(F) || IsLogging(F) || IsImported(F)) {
+        continue;
+      }
+
+      uint64_t site_index = 0;
+      for (auto &I : instructions(F)) {
+        StringRef callee = GetCalleeName(I);
+        if (callee == "malloc" || callee == "calloc") {
+          site_names_[&I] = (F.getName() + ":" + Twine(site_index++)).str();
         }
       }
     }
   }
 
+  // Passes site names to runtime from a module constructor, so runtime could
+  // name pool candidates
+  void RegisterAllocationSites(Module &M, LLVMContext &Ctx,
+                               IRBuilder<> &builder) {
+    if (site_names_.empty()) {
+      return;
+    }
+
+    FunctionCallee registerSiteFunc = M.getOrInsertFunction(
+        "RegisterAllocationSite", Type::getVoidTy(Ctx), Type::getInt64Ty(Ctx),
+        PointerType::get(Ctx, 0));
+
+    Function *ctor = Function::Create(
+        FunctionType::get(Type::getVoidTy(Ctx), false),
+        GlobalValue::InternalLinkage, "__pass_register_allocation_sites", M);
+    builder.SetInsertPoint(BasicBlock::Create(Ctx, "", ctor));
+
+    for (auto &[I, name] : site_names_) {
+      builder.CreateCall(registerSiteFunc, {GetInstructionValueId(*I, Ctx),
+                                            builder.CreateGlobalString(name)});
+    }
+
+    builder.CreateRetVoid();
+    appendToGlobalCtors(M, ctor, 0);
+  }
+
+  bool IsPoolSite(Instruction &I) {
+    return pool_sites_.count("node" + std::to_string(ids_.Get(&I)));
+  }
+
   // Instrument memory
   void InstrumentMain(Function &F, Module &M, LLVMContext &Ctx,
                       IRBuilder<> &builder) {
@@ -546,19 +1718,147 @@ private:
     assert(F.getName() == "main");
 
     FunctionType *printNPassesEdgesType =
-        FunctionType::get(ret_type, {ptr_type}, false);
+        FunctionType::get(ret_type, {ptr_type, ptr_type}, false);
     FunctionCallee printNPassesEdges = M.getOrInsertFunction(
         "PrintAllocatedMemoryInfo", printNPassesEdgesType);
 
     builder.SetInsertPoint(&F.back().back());
     Value *funcName =
         builder.CreateGlobalString(GetInstrumentMemoryOutputFile());
-    Value *args[] = {funcName};
-    builder.CreateCall(printNPassesEdges, args);
+    Value *candidatesName =
+        builder.CreateGlobalString(GetInstrumentPoolCandidatesOutputFile());
+    Value *args[] = {funcName, candidatesName};
+    CreateCallAtMainExits(F, builder, printNPassesEdges, args);
+
+    FunctionCallee printOffsets =
+        M.getOrInsertFunction("PrintMemoryOffsetsInfo",
+                              FunctionType::get(ret_type, {ptr_type}, false));
+    Value *offsetsName =
+        builder.CreateGlobalString(GetInstrumentMemoryOffsetsOutputFile());
+    CreateCallAtMainExits(F, builder, printOffsets, {offsetsName});
+
+    FunctionCallee printBandwidth = M.getOrInsertFunction(
+        "PrintMemoryBandwidth",
+        FunctionType::get(ret_type, {ptr_type, ptr_type}, false));
+    Value *bandwidthNames[] = {
+        builder.CreateGlobalString(GetInstrumentMemoryBandwidthOutputFile()),
+        builder.CreateGlobalString(GetInstrumentMemoryBandwidthReportFile())};
+    CreateCallAtMainExits(F, builder, printBandwidth, bandwidthNames);
+
+    // Sampling starts with main, before the program has threads
+    if (uint64_t period = GetFalseSharingPeriod()) {
+      FunctionCallee enableSharing =
+          M.getOrInsertFunction("EnableFalseSharing", ret_type,
+                                Type::getInt64Ty(Ctx));
+      FunctionCallee printSharing =
+          M.getOrInsertFunction("PrintFalseSharing",
+                                FunctionType::get(ret_type, {ptr_type}, false));
+
+      Value *sharingName =
+          builder.CreateGlobalString(GetInstrumentFalseSharingOutputFile());
+      CreateCallAtMainExits(F, builder, printSharing, {sharingName});
+
+      builder.SetInsertPoint(&*F.getEntryBlock().getFirstInsertionPt());
+      builder.CreateCall(enableSharing, {builder.getInt64(period)});
+    }
+  }
+
+  // Bandwidth scopes
+
+  // Accesses roll up into their innermost loop, loops into outer ones and
+  // functions. Every scope counts its entries: calls of a function in its
+  // entry block, iterations of a loop in its latches, like trip counts, as
+  // a header is also entered by the check which leaves the loop.
+  void InstrumentScopes(Function &F, LoopInfo &LI, Module &M,
+                        LLVMContext &Ctx, IRBuilder<> &builder) {
+    Type *int64_type = Type::getInt64Ty(Ctx);
+    FunctionCallee enterFunc = M.getOrInsertFunction(
+        "EnterMemoryScope", Type::getVoidTy(Ctx), int64_type);
+
+    auto enter_scope = [&](BasicBlock &BB, uint64_t scope) {
+      auto insert_point = BB.getFirstInsertionPt();
+      if (insert_point == BB.end() || insert_point->isEHPad()) {
+        return;
+      }
+
+      builder.SetInsertPoint(&*insert_point);
+      builder.CreateCall(enterFunc, {ConstantInt::get(int64_type, scope)});
+    };
+
+    uint64_t function_id = ids_.Get(&F);
+    scopes_.push_back({function_id, 0, F.getName().str()});
+    enter_scope(F.getEntryBlock(), function_id);
+    for (Loop *L : LI.getLoopsInPreorder()) {
+      BasicBlock *header = L->getHeader();
+      Loop *parent = L->getParentLoop();
+      scopes_.push_back({ids_.Get(header),
+                         parent ? ids_.Get(parent->getHeader()) : function_id,
+                         F.getName().str() + ": " + ExtractBBName(*header)});
+
+      SmallVector<BasicBlock *, 4> latches;
+      L->getLoopLatches(latches);
+      for (BasicBlock *latch : latches) {
+        enter_scope(*latch, ids_.Get(header));
+      }
+    }
+
+    for (auto &BB : F) {
+      Loop *L = LI.getLoopFor(&BB);
+      uint64_t scope = L ? ids_.Get(L->getHeader()) : function_id;
+      for (auto &I : BB) {
+        if (getLoadStorePointerOperand(&I)) {
+          scope_accesses_.push_back(ids_.Get(&I));
+          scope_accesses_.push_back(scope);
+        }
+      }
+    }
+  }
+
+  // Scopes are passed to runtime from a module constructor, accesses as
+  // a table of (access, scope) pairs
+  void RegisterScopes(Module &M, LLVMContext &Ctx, IRBuilder<> &builder) {
+    if (scopes_.empty()) {
+      return;
+    }
+
+    Type *int64_type = Type::getInt64Ty(Ctx);
+    Type *ptr_type = PointerType::get(Ctx, 0);
+    FunctionCallee registerScopeFunc =
+        M.getOrInsertFunction("RegisterMemoryScope", Type::getVoidTy(Ctx),
+                              int64_type, int64_type, ptr_type);
+    FunctionCallee registerAccessesFunc =
+        M.getOrInsertFunction("RegisterMemoryAccesses", Type::getVoidTy(Ctx),
+                              ptr_type, int64_type);
+
+    Function *ctor = Function::Create(
+        FunctionType::get(Type::getVoidTy(Ctx), false),
+        GlobalValue::InternalLinkage, "__pass_register_memory_scopes", M);
+    builder.SetInsertPoint(BasicBlock::Create(Ctx, "", ctor));
+
+    for (const MemoryScope &scope : scopes_) {
+      builder.CreateCall(registerScopeFunc,
+                         {ConstantInt::get(int64_type, scope.id),
+                          ConstantInt::get(int64_type, scope.parent),
+                          builder.CreateGlobalString(scope.name)});
+    }
+
+    if (!scope_accesses_.empty()) {
+      auto *accesses = new GlobalVariable(
+          M, ArrayType::get(int64_type, scope_accesses_.size()), true,
+          GlobalValue::PrivateLinkage,
+          ConstantDataArray::get(Ctx, scope_accesses_),
+          "__pass_memory_scope_accesses");
+      builder.CreateCall(
+          registerAccessesFunc,
+          {accesses, ConstantInt::get(int64_type, scope_accesses_.size() / 2)});
+    }
+
+    builder.CreateRetVoid();
+    appendToGlobalCtors(M, ctor, 0);
   }
 
   Value *GetInstructionValueId(Instruction &I, LLVMContext &Ctx) {
-    Value *name_id = ConstantInt::get(Type::getInt64Ty(Ctx), GetId(&I));
+    Value *name_id = ConstantInt::get(Type::getInt64Ty(Ctx), ids_.Get(&I));
 
     return name_id;
   }
@@ -586,12 +1886,31 @@ private:
 
     Value *allocated_ptr = call;
 
+    Type *int64_type = Type::getInt64Ty(Ctx);
+    Value *size =
+        builder.CreateZExtOrTrunc(call->getArgOperand(0), int64_type);
+    if (funcName == "calloc") {
+      // calloc fails on overflow, size of a failed allocation isn't used
+      Value *product = builder.CreateBinaryIntrinsic(
+          Intrinsic::umul_with_overflow, size,
+          builder.CreateZExtOrTrunc(call->getArgOperand(1), int64_type));
+      size = builder.CreateSelect(builder.CreateExtractValue(product, 1),
+                                  ConstantInt::get(int64_type, 0),
+                                  builder.CreateExtractValue(product, 0));
+    }
+
     FunctionCallee addMemFunc = M.getOrInsertFunction(
-        "AddDynamicallyAllocatedMemory", Type::getVoidTy(Ctx),
-        Type::getInt64Ty(Ctx), allocated_ptr->getType());
+        "AddDynamicallyAllocatedMemory", Type::getVoidTy(Ctx), int64_type,
+        allocated_ptr->getType(), int64_type);
 
     Value *name_id = GetInstructionValueId(I, Ctx);
-    builder.CreateCall(addMemFunc, {name_id, allocated_ptr});
+    builder.CreateCall(addMemFunc, {name_id, allocated_ptr, size});
+
+    if (IsPoolSite(I)) {
+      call->setCalledFunction(M.getOrInsertFunction(
+          funcName == "malloc" ? "PoolAlloc" : "PoolCalloc",
+          calledFunc->getFunctionType()));
+    }
 
     return true;
   }
@@ -620,17 +1939,22 @@ private:
     Value *deallocated_ptr = call->getArgOperand(0);
     Value *allocated_ptr = call;
 
-    FunctionCallee deallocMemFunc = M.getOrInsertFunction(
-        "RemoveDynamicallAllocatedMemory", Type::getVoidTy(Ctx),
-        Type::getInt64Ty(Ctx), deallocated_ptr->getType());
+    Type *int64_type = Type::getInt64Ty(Ctx);
+    Value *size =
+        builder.CreateZExtOrTrunc(call->getArgOperand(1), int64_type);
 
-    FunctionCallee addMemFunc = M.getOrInsertFunction(
-        "AddDynamicallyAllocatedMemory", Type::getVoidTy(Ctx),
-        Type::getInt64Ty(Ctx), allocated_ptr->getType());
+    FunctionCallee reallocMemFunc = M.getOrInsertFunction(
+        "ReallocDynamicallyAllocatedMemory", Type::getVoidTy(Ctx), int64_type,
+        deallocated_ptr->getType(), allocated_ptr->getType(), int64_type);
 
     Value *name_id = GetInstructionValueId(I, Ctx);
-    builder.CreateCall(deallocMemFunc, {name_id, deallocated_ptr});
-    builder.CreateCall(addMemFunc, {name_id, allocated_ptr});
+    builder.CreateCall(reallocMemFunc,
+                       {name_id, deallocated_ptr, allocated_ptr, size});
+
+    if (pooling_enabled_) {
+      call->setCalledFunction(
+          M.getOrInsertFunction("PoolRealloc", calledFunc->getFunctionType()));
+    }
 
     return true;
   }
@@ -660,11 +1984,45 @@ private:
 
     Value *name_id = GetInstructionValueId(I, Ctx);
     builder.CreateCall(removeMemFunc, {name_id, freed_ptr});
+
+    if (pooling_enabled_) {
+      call->setCalledFunction(
+          M.getOrInsertFunction("PoolFree", calledFunc->getFunctionType()));
+    }
+
     return true;
   }
 
-  void InstrumentInstruction(Instruction &I, Module &M, LLVMContext &Ctx,
-                             IRBuilder<> &builder) {
+  // Loads and stores also pass access size, so runtime could find offset
+  // of accessed field inside of allocation
+  void InstrumentMemoryAccess(Instruction &I, Value *ptr, Module &M,
+                              LLVMContext &Ctx, IRBuilder<> &builder) {
+    builder.SetInsertPoint(&I);
+
+    Type *int64_type = Type::getInt64Ty(Ctx);
+    FunctionCallee logFunc = M.getOrInsertFunction(
+        "LogDynamicMemoryAccess", Type::getVoidTy(Ctx), int64_type,
+        ptr->getType(), int64_type, int64_type);
+
+    uint64_t size = M.getDataLayout()
+                        .getTypeStoreSize(getLoadStoreType(&I))
+                        .getKnownMinValue();
+    uint64_t kind = isa<StoreInst>(I) ? kMemoryAccessStore : kMemoryAccessLoad;
+    const Value *object = getUnderlyingObject(ptr);
+    if (isa<AllocaInst>(object)) {
+      kind |= kMemoryAccessStack;
+    } else if (isa<GlobalVariable>(object)) {
+      kind |= kMemoryAccessGlobal;
+    }
+
+    Value *name_id = GetInstructionValueId(I, Ctx);
+    Value *args[] = {name_id, ptr, ConstantInt::get(int64_type, size),
+                     ConstantInt::get(int64_type, kind)};
+    builder.CreateCall(logFunc, args);
+  }
+
+  void InstrumentInstruction(Instruction &I, bool log_accesses, Module &M,
+                             LLVMContext &Ctx, IRBuilder<> &builder) {
     if (HandleMemAllocCall(I, M, Ctx, builder)) {
       return;
     }
@@ -675,12 +2033,18 @@ private:
       return;
     }
 
-    if (isa<CallBase>(I)) {
+    // Pointers coming into phis are accessed, if at all, elsewhere
+    if (isa<CallBase>(I) || isa<PHINode>(I) || !log_accesses) {
       return;
     }
 
     for (ssize_t i = 0; i < I.getNumOperands(); ++i) {
       Value *op = I.getOperand(i);
+      if (op == getLoadStorePointerOperand(&I)) {
+        InstrumentMemoryAccess(I, op, M, Ctx, builder);
+        continue;
+      }
+
       if (op->getType()->isPointerTy()) {
         builder.SetInsertPoint(&I);
 
@@ -693,24 +2057,1152 @@ private:
       }
     }
   }
+
+private:
+  bool instrument_;
+  NodeIds ids_;
+  MapVector<Instruction *, std::string> site_names_;
+
+  bool pooling_enabled_{false};
+  std::set<std::string> pool_sites_;
+
+  struct MemoryScope {
+    uint64_t id;
+    uint64_t parent;
+    std::string name;
+  };
+  std::vector<MemoryScope> scopes_;
+  std::vector<uint64_t> scope_accesses_;
 };
 
 // ------------------------------------------------------------------------------------------------
 
-PassPluginLibraryInfo getPassPluginInfo() {
-  const auto callback = [](PassBuilder &PB) {
-    PB.registerPipelineStartEPCallback([=](ModulePassManager &MPM, auto) {
-      MPM.addPass(ControlFlowBuilderPass{});
-      MPM.addPass(DefUseBuilderPass{});
-      MPM.addPass(MemoryAllocPass{});
-      return true;
-    });
-  };
+// Memory stride pass
 
-  return {LLVM_PLUGIN_API_VERSION, "MyPlugin", "0.0.1", callback};
-};
+struct MemoryStridePass : public PassInfoMixin<MemoryStridePass> {
+public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+    if (IsLogging(M)) {
+      return PreservedAnalyses::none();
+    }
 
-} // namespace
+    TimeTraceScope pass_scope{"MemoryStridePass",
+                              [&] { return GetTraceDetail(M); }};
+    ids_ = NodeIds{M};
+    TimeTraceScope scope{kInstrumentScope};
+
+    LLVMContext &Ctx = M.getContext();
+    IRBuilder<> builder{Ctx};
+
+    for (auto &F : M) {
+      if (F.isDeclaration() || IsImported(F) || IsInternal(F) ||
+          IsLogging(F)) {
+        continue;
+      }
+
+      if (F.getName() == "main") {
+        InstrumentMain(F, M, Ctx, builder);
+      }
+
+      if (IsFilteredOut(F, ids_)) {
+        continue;
+      }
+
+      for (auto &I : instructions(F)) {
+        InstrumentInstruction(I, M, Ctx, builder);
+      }
+    }
+    ids_.MarkInstrumentation(M);
+
+    return PreservedAnalyses::all();
+  }
+
+private:
+  void InstrumentMain(Function &F, Module &M, LLVMContext &Ctx,
+                      IRBuilder<> &builder) {
+    Type *ret_type = Type::getVoidTy(Ctx);
+    Type *ptr_type = PointerType::get(Ctx, 0);
+
+    assert(F.getName() == "main");
+
+    FunctionCallee printStrides =
+        M.getOrInsertFunction("PrintMemoryStrides",
+                              FunctionType::get(ret_type, {ptr_type}, false));
+
+    builder.SetInsertPoint(&F.back().back());
+    Value *funcName =
+        builder.CreateGlobalString(GetInstrumentMemoryStridesOutputFile());
+    CreateCallAtMainExits(F, builder, printStrides, {funcName});
+  }
+
+  void InstrumentInstruction(Instruction &I, Module &M, LLVMContext &Ctx,
+                             IRBuilder<> &builder) {
+    Value *ptr = getLoadStorePointerOperand(&I);
+    if (!ptr) {
+      return;
+    }
+
+    Type *int64_type = Type::getInt64Ty(Ctx);
+    FunctionCallee logFunc = M.getOrInsertFunction(
+        "LogMemoryStride", Type::getVoidTy(Ctx), int64_type, ptr->getType(),
+        int64_type);
+
+    uint64_t size = M.getDataLayout()
+                        .getTypeStoreSize(getLoadStoreType(&I))
+                        .getKnownMinValue();
+
+    builder.SetInsertPoint(&I);
+    Value *args[] = {ConstantInt::get(int64_type, ids_.Get(&I)), ptr,
+                     ConstantInt::get(int64_type, size)};
+    builder.CreateCall(logFunc, args);
+  }
+
+private:
+  NodeIds ids_;
+};
+
+// ------------------------------------------------------------------------------------------------
+
+// Calling context pass
+
+struct CallingContextPass : public PassInfoMixin<CallingContextPass> {
+public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+    if (IsLogging(M)) {
+      return PreservedAnalyses::none();
+    }
+
+    TimeTraceScope pass_scope{"CallingContextPass",
+                              [&] { return GetTraceDetail(M); }};
+    ids_ = NodeIds{M};
+    TimeTraceScope scope{kInstrumentScope};
+
+    // Blocks are counted per context with CALLING_CONTEXT_BLOCKS env
+    // variable, as they cost much more than function boundaries
+    count_blocks_ = std::getenv("CALLING_CONTEXT_BLOCKS") != nullptr;
+
+    LLVMContext &Ctx = M.getContext();
+    IRBuilder<> builder{Ctx};
+
+    std::vector<Function *> functions;
+    for (auto &F : M) {
+      if (F.isDeclaration() || IsImported(F) || IsInternal(F) ||
+          IsLogging(F)) {
+        continue;
+      }
+
+      functions.push_back(&F);
+    }
+
+    RegisterFunctions(functions, M, Ctx, builder);
+
+    for (Function *F : functions) {
+      if (F->getName() == "main") {
+        InstrumentMain(*F, M, Ctx, builder);
+      }
+
+      if (!IsFilteredOut(*F, ids_)) {
+        InstrumentFunction(*F, M, Ctx, builder);
+      }
+    }
+    ids_.MarkInstrumentation(M);
+
+    return PreservedAnalyses::all();
+  }
+
+private:
+  // Passes function names to runtime from a module constructor, so contexts
+  // could be printed with names
+  void RegisterFunctions(const std::vector<Function *> &functions, Module &M,
+                         LLVMContext &Ctx, IRBuilder<> &builder) {
+    if (functions.empty()) {
+      return;
+    }
+
+    Type *int64_type = Type::getInt64Ty(Ctx);
+    FunctionCallee registerFunc = M.getOrInsertFunction(
+        "RegisterFunction", Type::getVoidTy(Ctx), int64_type,
+        PointerType::get(Ctx, 0));
+
+    Function *ctor = Function::Create(
+        FunctionType::get(Type::getVoidTy(Ctx), false),
+        GlobalValue::InternalLinkage, "__pass_register_functions", M);
+    builder.SetInsertPoint(BasicBlock::Create(Ctx, "", ctor));
+
+    for (Function *F : functions) {
+      builder.CreateCall(registerFunc,
+                         {ConstantInt::get(int64_type, ids_.Get(F)),
+                          builder.CreateGlobalString(F->getName())});
+    }
+
+    builder.CreateRetVoid();
+    appendToGlobalCtors(M, ctor, 0);
+  }
+
+  void InstrumentMain(Function &F, Module &M, LLVMContext &Ctx,
+                      IRBuilder<> &builder) {
+    Type *ret_type = Type::getVoidTy(Ctx);
+    Type *ptr_type = PointerType::get(Ctx, 0);
+
+    assert(F.getName() == "main");
+
+    FunctionCallee printContexts = M.getOrInsertFunction(
+        "PrintCallingContexts",
+        FunctionType::get(ret_type, {ptr_type, ptr_type}, false));
+
+    builder.SetInsertPoint(&F.back().back());
+    Value *funcName =
+        builder.CreateGlobalString(GetInstrumentCallingContextsOutputFile());
+    Value *countsName = ConstantPointerNull::get(PointerType::get(Ctx, 0));
+    if (count_blocks_) {
+      countsName = builder.CreateGlobalString(
+          GetInstrumentCallingContextCountsOutputFile());
+    }
+    CreateCallAtMainExits(F, builder, printContexts, {funcName, countsName});
+  }
+
+  // Entry pushes the function on the shadow stack of runtime, every return
+  // and resume pops it
+  void InstrumentFunction(Function &F, Module &M, LLVMContext &Ctx,
+                          IRBuilder<> &builder) {
+    Type *int64_type = Type::getInt64Ty(Ctx);
+    FunctionCallee enterFunc = M.getOrInsertFunction(
+        "EnterFunction", Type::getVoidTy(Ctx), int64_type);
+    FunctionCallee exitFunc = M.getOrInsertFunction(
+        "ExitFunction", Type::getVoidTy(Ctx), int64_type);
+
+    Value *function_id = ConstantInt::get(int64_type, ids_.Get(&F));
+
+    std::vector<Instruction *> exits;
+    for (auto &BB : F) {
+      Instruction *terminator = BB.getTerminator();
+      if (isa<ReturnInst>(terminator) || isa<ResumeInst>(terminator)) {
+        exits.push_back(terminator);
+      }
+    }
+
+    if (count_blocks_) {
+      FunctionCallee blockFunc = M.getOrInsertFunction(
+          "CountContextBlock", Type::getVoidTy(Ctx), int64_type);
+      for (auto &BB : F) {
+        auto insert_point = BB.getFirstInsertionPt();
+        if (insert_point == BB.end() || insert_point->isEHPad()) {
+          continue;
+        }
+
+        builder.SetInsertPoint(&*insert_point);
+        builder.CreateCall(blockFunc,
+                           {ConstantInt::get(int64_type, ids_.Get(&BB))});
+      }
+    }
+
+    // Function is entered before its entry block is counted
+    builder.SetInsertPoint(&*F.getEntryBlock().getFirstInsertionPt());
+    builder.CreateCall(enterFunc, {function_id});
+
+    for (Instruction *exit : exits) {
+      builder.SetInsertPoint(exit);
+      builder.CreateCall(exitFunc, {function_id});
+    }
+  }
+
+private:
+  NodeIds ids_;
+  bool count_blocks_{false};
+};
+
+// ------------------------------------------------------------------------------------------------
+
+// Timing pass
+
+struct TimingPass : public PassInfoMixin<TimingPass> {
+public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+    if (IsLogging(M)) {
+      return PreservedAnalyses::none();
+    }
+
+    TimeTraceScope pass_scope{"TimingPass", [&] { return GetTraceDetail(M); }};
+    ids_ = NodeIds{M};
+    TimeTraceScope scope{kInstrumentScope};
+
+    // Block boundaries are timed with TIMING_BLOCKS env variable, they cost
+    // much more than function boundaries
+    time_blocks_ = std::getenv("TIMING_BLOCKS") != nullptr;
+
+    LLVMContext &Ctx = M.getContext();
+    IRBuilder<> builder{Ctx};
+
+    for (auto &F : M) {
+      if (F.isDeclaration() || IsImported(F) || IsInternal(F) ||
+          IsLogging(F)) {
+        continue;
+      }
+
+      if (F.getName() == "main") {
+        InstrumentMain(F, M, Ctx, builder);
+      }
+
+      if (!IsFilteredOut(F, ids_)) {
+        InstrumentFunction(F, M, Ctx, builder);
+      }
+    }
+    ids_.MarkInstrumentation(M);
+
+    return PreservedAnalyses::all();
+  }
+
+private:
+  void InstrumentMain(Function &F, Module &M, LLVMContext &Ctx,
+                      IRBuilder<> &builder) {
+    Type *ret_type = Type::getVoidTy(Ctx);
+    Type *ptr_type = PointerType::get(Ctx, 0);
+
+    assert(F.getName() == "main");
+
+    FunctionCallee printTimes =
+        M.getOrInsertFunction("PrintTimes",
+                              FunctionType::get(ret_type, {ptr_type}, false));
+
+    builder.SetInsertPoint(&F.back().back());
+    Value *funcName =
+        builder.CreateGlobalString(GetInstrumentTimesOutputFile());
+    CreateCallAtMainExits(F, builder, printTimes, {funcName});
+  }
+
+  void InstrumentFunction(Function &F, Module &M, LLVMContext &Ctx,
+                          IRBuilder<> &builder) {
+    Type *int64_type = Type::getInt64Ty(Ctx);
+    FunctionCallee enterFunc = M.getOrInsertFunction(
+        "TimeFunctionEnter", Type::getVoidTy(Ctx), int64_type);
+    FunctionCallee exitFunc = M.getOrInsertFunction(
+        "TimeFunctionExit", Type::getVoidTy(Ctx), int64_type);
+    FunctionCallee blockFunc = M.getOrInsertFunction(
+        "TimeBlock", Type::getVoidTy(Ctx), int64_type);
+
+    Value *function_id = ConstantInt::get(int64_type, ids_.Get(&F));
+
+    std::vector<Instruction *> exits;
+    for (auto &BB : F) {
+      Instruction *terminator = BB.getTerminator();
+      if (isa<ReturnInst>(terminator) || isa<ResumeInst>(terminator)) {
+        exits.push_back(terminator);
+      }
+    }
+
+    // Catchswitch blocks have no place for a call
+    if (time_blocks_) {
+      for (auto &BB : F) {
+        auto insert_point = BB.getFirstInsertionPt();
+        if (insert_point == BB.end() || insert_point->isEHPad()) {
+          continue;
+        }
+
+        builder.SetInsertPoint(&*insert_point);
+        builder.CreateCall(blockFunc,
+                           {ConstantInt::get(int64_type, ids_.Get(&BB))});
+      }
+    }
+
+    // Function is entered before its entry block
+    builder.SetInsertPoint(&*F.getEntryBlock().getFirstInsertionPt());
+    builder.CreateCall(enterFunc, {function_id});
+
+    for (Instruction *exit : exits) {
+      builder.SetInsertPoint(exit);
+      builder.CreateCall(exitFunc, {function_id});
+    }
+  }
+
+private:
+  NodeIds ids_;
+  bool time_blocks_{false};
+};
+
+// ------------------------------------------------------------------------------------------------
+// Loop trip count pass
+
+// Every loop has an iteration register in the frame of its function. It is
+// reset on edges entering the loop, incremented in latches and recorded on
+// edges leaving the loop, so each entry gives one trip count. Loops left by
+// return or exception aren't recorded.
+struct LoopTripCountPass : public PassInfoMixin<LoopTripCountPass> {
+public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+    if (IsLogging(M)) {
+      return PreservedAnalyses::none();
+    }
+
+    TimeTraceScope pass_scope{"LoopTripCountPass",
+                              [&] { return GetTraceDetail(M); }};
+    ids_ = NodeIds{M};
+    TimeTraceScope scope{kInstrumentScope};
+
+    LLVMContext &Ctx = M.getContext();
+    IRBuilder<> builder{Ctx};
+    auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M)
+                    .getManager();
+
+    bool changed_cfg = false;
+    for (auto &F : M) {
+      if (F.isDeclaration() || IsImported(F) || IsInternal(F) ||
+          IsLogging(F)) {
+        continue;
+      }
+
+      if (F.getName() == "main") {
+        InstrumentMain(F, M, Ctx, builder);
+      }
+
+      if (IsFilteredOut(F, ids_)) {
+        continue;
+      }
+
+      changed_cfg |=
+          InstrumentLoops(F, FAM.getResult<LoopAnalysis>(F), M, Ctx, builder);
+    }
+    ids_.MarkInstrumentation(M);
+
+    return changed_cfg ? PreservedAnalyses::none() : PreservedAnalyses::all();
+  }
+
+private:
+  void InstrumentMain(Function &F, Module &M, LLVMContext &Ctx,
+                      IRBuilder<> &builder) {
+    Type *ret_type = Type::getVoidTy(Ctx);
+    Type *ptr_type = PointerType::get(Ctx, 0);
+
+    assert(F.getName() == "main");
+
+    FunctionCallee printTripCounts =
+        M.getOrInsertFunction("PrintTripCounts",
+                              FunctionType::get(ret_type, {ptr_type}, false));
+
+    builder.SetInsertPoint(&F.back().back());
+    Value *funcName =
+        builder.CreateGlobalString(GetInstrumentTripCountsOutputFile());
+    CreateCallAtMainExits(F, builder, printTripCounts, {funcName});
+  }
+
+  // Loop is identified by its header block
+  struct LoopRegister {
+    uint64_t header;
+    AllocaInst *trips;
+  };
+
+  bool InstrumentLoops(Function &F, LoopInfo &LI, Module &M,
+                       LLVMContext &Ctx, IRBuilder<> &builder) {
+    if (LI.empty()) {
+      return false;
+    }
+
+    Type *int64_type = Type::getInt64Ty(Ctx);
+    FunctionCallee recordFunc = M.getOrInsertFunction(
+        "RecordTripCount", Type::getVoidTy(Ctx), int64_type, int64_type);
+
+    // An edge may leave several nested loops at once, it is split once
+    MapVector<std::pair<BasicBlock *, BasicBlock *>,
+              SmallVector<LoopRegister, 2>>
+        exits;
+
+    for (Loop *L : LI.getLoopsInPreorder()) {
+      BasicBlock *header = L->getHeader();
+
+      builder.SetInsertPoint(&*F.getEntryBlock().getFirstInsertionPt());
+      LoopRegister loop{ids_.Get(header), builder.CreateAlloca(int64_type)};
+
+      for (BasicBlock *pred : predecessors(header)) {
+        if (!L->contains(pred)) {
+          builder.SetInsertPoint(pred->getTerminator());
+          builder.CreateStore(ConstantInt::get(int64_type, 0), loop.trips);
+        }
+      }
+
+      SmallVector<BasicBlock *, 4> latches;
+      L->getLoopLatches(latches);
+      for (BasicBlock *latch : latches) {
+        builder.SetInsertPoint(&*latch->getFirstInsertionPt());
+        Value *trips = builder.CreateLoad(int64_type, loop.trips);
+        builder.CreateStore(builder.CreateAdd(trips, builder.getInt64(1)),
+                            loop.trips);
+      }
+
+      SmallVector<Loop::Edge, 4> exit_edges;
+      L->getExitEdges(exit_edges);
+      for (auto [from, to] : exit_edges) {
+        // Such edges can't be split
+        if (to->isEHPad() || isa<IndirectBrInst>(from->getTerminator()) ||
+            isa<CallBrInst>(from->getTerminator())) {
+          continue;
+        }
+
+        // Switch cases going to the same exit are one edge
+        auto &loops = exits[{const_cast<BasicBlock *>(from),
+                             const_cast<BasicBlock *>(to)}];
+        if (loops.empty() || loops.back().header != loop.header) {
+          loops.push_back(loop);
+        }
+      }
+    }
+
+    for (auto &[edge, loops] : exits) {
+      auto [from, to] = edge;
+      BasicBlock *exit = SplitEdge(from, to);
+      ids_.MarkSplit(*exit, *from);
+
+      // Only the first of switch cases going to the exit is split, the rest
+      // are redirected to the same block
+      Instruction *terminator = from->getTerminator();
+      for (unsigned i = 0; i < terminator->getNumSuccessors(); ++i) {
+        if (terminator->getSuccessor(i) == to) {
+          to->removePredecessor(from, /*KeepOneInputPHIs=*/true);
+          terminator->setSuccessor(i, exit);
+        }
+      }
+
+      builder.SetInsertPoint(exit->getTerminator());
+      for (const LoopRegister &loop : loops) {
+        Value *trips = builder.CreateLoad(int64_type, loop.trips);
+        builder.CreateCall(recordFunc,
+                           {ConstantInt::get(int64_type, loop.header), trips});
+      }
+    }
+
+    return !exits.empty();
+  }
+
+private:
+  NodeIds ids_;
+};
+
+// ------------------------------------------------------------------------------------------------
+// Coverage pass
+
+// Every block, or every edge with COVERAGE_MODE=edge, gets a byte in an array
+// of its module, set to 1 by an inline store when it runs. No calls and no
+// atomics on hot paths: a byte is only ever set, so racing threads write the
+// same value. The array is registered with the runtime from a module
+// constructor and dumped when main returns.
+struct CoveragePass : public PassInfoMixin<CoveragePass> {
+public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+    if (IsLogging(M)) {
+      return PreservedAnalyses::none();
+    }
+
+    TimeTraceScope pass_scope{"CoveragePass",
+                              [&] { return GetTraceDetail(M); }};
+    ids_ = NodeIds{M};
+    TimeTraceScope scope{kInstrumentScope};
+
+    LLVMContext &Ctx = M.getContext();
+    IRBuilder<> builder{Ctx};
+    const bool edges = IsEdgeMode();
+
+    // Ids are taken before edges are split
+    std::vector<Site> sites;
+    for (auto &F : M) {
+      if (F.isDeclaration() || IsImported(F) || IsInternal(F) ||
+          IsLogging(F)) {
+        continue;
+      }
+
+      if (F.getName() == "main") {
+        InstrumentMain(F, M, Ctx, builder);
+      }
+
+      if (IsFilteredOut(F, ids_)) {
+        continue;
+      }
+
+      if (edges) {
+        CollectEdges(F, sites);
+      } else {
+        CollectBlocks(F, sites);
+      }
+    }
+
+    bool changed_cfg = Instrument(sites, edges, M, Ctx, builder);
+    ids_.MarkInstrumentation(M);
+
+    return changed_cfg ? PreservedAnalyses::none() : PreservedAnalyses::all();
+  }
+
+private:
+  // Block site has only the from id, edge site goes from a terminator to
+  // a successor block, as control flow graph edges do
+  struct Site {
+    BasicBlock *from;
+    BasicBlock *to;
+    uint64_t from_id;
+    uint64_t to_id;
+  };
+
+  static bool IsEdgeMode() {
+    const char *mode = std::getenv("COVERAGE_MODE");
+    if (!mode || StringRef{mode} == "block") {
+      return false;
+    }
+    if (StringRef{mode} != "edge") {
+      report_fatal_error(Twine{"Unknown COVERAGE_MODE: "} + mode);
+    }
+    return true;
+  }
+
+  void CollectBlocks(Function &F, std::vector<Site> &sites) {
+    for (auto &BB : F) {
+      if (BB.getFirstInsertionPt() != BB.end()) {
+        sites.push_back({&BB, nullptr, ids_.Get(&BB), 0});
+      }
+    }
+  }
+
+  void CollectEdges(Function &F, std::vector<Site> &sites) {
+    for (auto &BB : F) {
+      Instruction *terminator = BB.getTerminator();
+      SmallPtrSet<BasicBlock *, 4> seen;
+      for (BasicBlock *successor : successors(&BB)) {
+        if (seen.insert(successor).second) {
+          sites.push_back({&BB, successor, ids_.Get(terminator),
+                           ids_.Get(successor)});
+        }
+      }
+    }
+  }
+
+  // Where the flag of a site is set, null if an edge can't be split
+  Instruction *GetInsertPoint(const Site &site, bool &changed_cfg) {
+    if (!site.to) {
+      return &*site.from->getFirstInsertionPt();
+    }
+
+    if (site.to->getSinglePredecessor() &&
+        site.to->getFirstInsertionPt() != site.to->end()) {
+      return &*site.to->getFirstInsertionPt();
+    }
+    if (site.from->getUniqueSuccessor()) {
+      return site.from->getTerminator();
+    }
+
+    Instruction *terminator = site.from->getTerminator();
+    for (unsigned i = 0; i < terminator->getNumSuccessors(); ++i) {
+      if (terminator->getSuccessor(i) != site.to) {
+        continue;
+      }
+      // EH pads, indirectbr and callbr edges aren't split
+      BasicBlock *split = SplitCriticalEdge(
+          terminator, i,
+          CriticalEdgeSplittingOptions().setMergeIdenticalEdges());
+      if (!split) {
+        return nullptr;
+      }
+      ids_.MarkSplit(*split, *site.from);
+      changed_cfg = true;
+      return split->getTerminator();
+    }
+    return nullptr;
+  }
+
+  bool Instrument(const std::vector<Site> &sites, bool edges, Module &M,
+                  LLVMContext &Ctx, IRBuilder<> &builder) {
+    Type *int8_type = Type::getInt8Ty(Ctx);
+    Type *int64_type = Type::getInt64Ty(Ctx);
+
+    // Sites without a place for the store don't get a flag, so they aren't
+    // reported as never run
+    bool changed_cfg = false;
+    std::vector<Instruction *> insert_points;
+    std::vector<uint64_t> ids;
+    for (const Site &site : sites) {
+      Instruction *insert_point = GetInsertPoint(site, changed_cfg);
+      if (!insert_point) {
+        continue;
+      }
+      insert_points.push_back(insert_point);
+      ids.push_back(site.from_id);
+      if (edges) {
+        ids.push_back(site.to_id);
+      }
+    }
+    if (insert_points.empty()) {
+      return changed_cfg;
+    }
+
+    ArrayType *flags_type = ArrayType::get(int8_type, insert_points.size());
+    auto *flags = new GlobalVariable(M, flags_type, false,
+                                     GlobalValue::InternalLinkage,
+                                     ConstantAggregateZero::get(flags_type),
+                                     "__pass_coverage_flags");
+    // Groups flags of all modules together, away from program data
+    if (Triple{M.getTargetTriple()}.isOSBinFormatELF()) {
+      flags->setSection("pass_cov");
+    }
+
+    for (size_t i = 0; i < insert_points.size(); ++i) {
+      builder.SetInsertPoint(insert_points[i]);
+      builder.CreateStore(
+          ConstantInt::get(int8_type, 1),
+          builder.CreateConstInBoundsGEP2_64(flags_type, flags, 0, i));
+    }
+
+    auto *ids_array = new GlobalVariable(
+        M, ArrayType::get(int64_type, ids.size()), true,
+        GlobalValue::PrivateLinkage, ConstantDataArray::get(Ctx, ids),
+        "__pass_coverage_ids");
+
+    FunctionCallee registerFunc = M.getOrInsertFunction(
+        "RegisterCoverage", Type::getVoidTy(Ctx), PointerType::get(Ctx, 0),
+        PointerType::get(Ctx, 0), int64_type, int64_type);
+
+    Function *ctor = Function::Create(
+        FunctionType::get(Type::getVoidTy(Ctx), false),
+        GlobalValue::InternalLinkage, "__pass_register_coverage", M);
+    builder.SetInsertPoint(BasicBlock::Create(Ctx, "", ctor));
+    builder.CreateCall(registerFunc,
+                       {flags, ids_array,
+                        ConstantInt::get(int64_type, insert_points.size()),
+                        ConstantInt::get(int64_type, edges)});
+    builder.CreateRetVoid();
+    appendToGlobalCtors(M, ctor, 0);
+
+    return changed_cfg;
+  }
+
+  void InstrumentMain(Function &F, Module &M, LLVMContext &Ctx,
+                      IRBuilder<> &builder) {
+    Type *ret_type = Type::getVoidTy(Ctx);
+    Type *ptr_type = PointerType::get(Ctx, 0);
+
+    assert(F.getName() == "main");
+
+    FunctionCallee printCoverage =
+        M.getOrInsertFunction("PrintCoverage",
+                              FunctionType::get(ret_type, {ptr_type}, false));
+
+    builder.SetInsertPoint(&F.back().back());
+    Value *fileName =
+        builder.CreateGlobalString(GetInstrumentCoverageOutputFile());
+    CreateCallAtMainExits(F, builder, printCoverage, {fileName});
+  }
+
+private:
+  NodeIds ids_;
+};
+
+// ------------------------------------------------------------------------------------------------
+// Lock contention pass
+
+// Lock functions and their profiled wrappers, which have the same types.
+// std::mutex members are called directly at -O0, optimized code calls
+// pthread functions inlined from them.
+const std::pair<StringRef, StringRef> kLockFunctions[] = {
+    {"pthread_mutex_lock", "ProfiledMutexLock"},
+    {"pthread_mutex_trylock", "ProfiledMutexTrylock"},
+    {"pthread_mutex_timedlock", "ProfiledMutexTimedlock"},
+    {"pthread_mutex_unlock", "ProfiledMutexUnlock"},
+    {"pthread_rwlock_rdlock", "ProfiledRwlockRdlock"},
+    {"pthread_rwlock_wrlock", "ProfiledRwlockWrlock"},
+    {"pthread_rwlock_tryrdlock", "ProfiledRwlockTryrdlock"},
+    {"pthread_rwlock_trywrlock", "ProfiledRwlockTrywrlock"},
+    {"pthread_rwlock_timedrdlock", "ProfiledRwlockTimedrdlock"},
+    {"pthread_rwlock_timedwrlock", "ProfiledRwlockTimedwrlock"},
+    {"pthread_rwlock_unlock", "ProfiledRwlockUnlock"},
+    {"pthread_spin_lock", "ProfiledSpinLock"},
+    {"pthread_spin_trylock", "ProfiledSpinTrylock"},
+    {"pthread_spin_unlock", "ProfiledSpinUnlock"},
+    // Condition waits unlock the mutex while waiting
+    {"pthread_cond_wait", "ProfiledCondWait"},
+    {"pthread_cond_timedwait", "ProfiledCondTimedwait"},
+    // libstdc++
+    {"_ZNSt5mutex4lockEv", "ProfiledStdMutexLock"},
+    {"_ZNSt5mutex8try_lockEv", "ProfiledStdMutexTryLock"},
+    {"_ZNSt5mutex6unlockEv", "ProfiledStdMutexUnlock"},
+    {"_ZNSt18condition_variable4waitERSt11unique_lockISt5mutexE",
+     "ProfiledStdConditionWait"},
+    // libc++
+    {"_ZNSt3__15mutex4lockEv", "ProfiledStdMutexLock"},
+    {"_ZNSt3__15mutex8try_lockEv", "ProfiledStdMutexTryLock"},
+    {"_ZNSt3__15mutex6unlockEv", "ProfiledStdMutexUnlock"},
+};
+
+// At -O0 std::mutex is locked by members of these templates, which are
+// shared definitions of std namespace and aren't instrumented themselves.
+// Calls of them from user code go to clones, where calls of std::mutex
+// members go to wrappers. Cloning stops there, so helpers like
+// __gthread_mutex_lock are never changed.
+const StringRef kLockHolderPrefixes[] = {
+    // libstdc++
+    "_ZNSt10lock_guard",
+    "_ZNSt11unique_lock",
+    "_ZNSt11scoped_lock",
+    // wait with a predicate
+    "_ZNSt18condition_variable4waitI",
+    // libc++
+    "_ZNSt3__110lock_guard",
+    "_ZNSt3__111unique_lock",
+    "_ZNSt3__111scoped_lock",
+};
+
+// Lock calls are substituted with wrappers like allocations with the pool
+// allocator, so call instructions and their ids stay. Site of a call, its
+// control flow node, is passed to runtime right before it.
+struct LockContentionPass : public PassInfoMixin<LockContentionPass> {
+public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+    if (IsLogging(M)) {
+      return PreservedAnalyses::none();
+    }
+
+    TimeTraceScope pass_scope{"LockContentionPass",
+                              [&] { return GetTraceDetail(M); }};
+    ids_ = NodeIds{M};
+    holders_.clear();
+    TimeTraceScope scope{kInstrumentScope};
+
+    LLVMContext &Ctx = M.getContext();
+    IRBuilder<> builder{Ctx};
+
+    for (auto &F : M) {
+      if (F.isDeclaration() || IsImported(F) || IsInternal(F) ||
+          IsLogging(F)) {
+        continue;
+      }
+
+      if (F.getName() == "main") {
+        InstrumentMain(F, M, Ctx, builder);
+      }
+
+      if (IsFilteredOut(F, ids_)) {
+        continue;
+      }
+
+      for (auto &I : instructions(F)) {
+        if (auto *call = dyn_cast<CallBase>(&I)) {
+          InstrumentLockCall(*call, M, Ctx, builder);
+        }
+      }
+    }
+    ids_.MarkInstrumentation(M);
+
+    return PreservedAnalyses::all();
+  }
+
+private:
+  void InstrumentLockCall(CallBase &call, Module &M, LLVMContext &Ctx,
+                          IRBuilder<> &builder) {
+    Function *callee = call.getCalledFunction();
+    if (!callee) {
+      return;
+    }
+
+    // Lock functions are checked first, std::mutex members are std too
+    if (!RedirectLockCall(call, *callee, M)) {
+      return;
+    }
+
+    Type *int64_type = Type::getInt64Ty(Ctx);
+    FunctionCallee setSiteFunc = M.getOrInsertFunction(
+        "SetLockSite", Type::getVoidTy(Ctx), int64_type);
+
+    builder.SetInsertPoint(&call);
+    builder.CreateCall(setSiteFunc,
+                       {ConstantInt::get(int64_type, ids_.Get(&call))});
+  }
+
+  // Calls a wrapper of the lock function or a clone of the lock holder
+  // member instead of the callee, false if it's neither of them
+  bool RedirectLockCall(CallBase &call, Function &callee, Module &M) {
+    const auto *lock_it = find_if(kLockFunctions, [&](const auto &entry) {
+      return entry.first == callee.getName();
+    });
+    if (lock_it != std::end(kLockFunctions)) {
+      call.setCalledFunction(
+          M.getOrInsertFunction(lock_it->second, call.getFunctionType()));
+      return true;
+    }
+
+    if (Function *holder = GetProfiledHolder(callee, M)) {
+      call.setCalledFunction(holder);
+      return true;
+    }
+
+    return false;
+  }
+
+  // Clone of a lock holder member with its lock calls redirected, null if it
+  // has no body or doesn't lock. The site set before the call of the clone
+  // is taken by the first wrapper called from it.
+  Function *GetProfiledHolder(Function &F, Module &M) {
+    auto [it, inserted] = holders_.try_emplace(&F, nullptr);
+    if (!inserted) {
+      return it->second;
+    }
+
+    bool is_holder = any_of(kLockHolderPrefixes, [&](StringRef prefix) {
+      return F.getName().starts_with(prefix);
+    });
+    if (F.isDeclaration() || !is_holder) {
+      return nullptr;
+    }
+
+    ValueToValueMapTy values;
+    Function *clone = CloneFunction(&F, values);
+    clone->setName(F.getName() + ".locks");
+    clone->setLinkage(GlobalValue::InternalLinkage);
+    clone->setComdat(nullptr);
+
+    bool locks = false;
+    for (auto &I : instructions(clone)) {
+      auto *call = dyn_cast<CallBase>(&I);
+      if (call && call->getCalledFunction()) {
+        locks |= RedirectLockCall(*call, *call->getCalledFunction(), M);
+      }
+    }
+
+    if (!locks) {
+      clone->eraseFromParent();
+      return nullptr;
+    }
+
+    // Recursive calls may have added entries
+    holders_[&F] = clone;
+    return clone;
+  }
+
+  void InstrumentMain(Function &F, Module &M, LLVMContext &Ctx,
+                      IRBuilder<> &builder) {
+    Type *ret_type = Type::getVoidTy(Ctx);
+    Type *ptr_type = PointerType::get(Ctx, 0);
+
+    assert(F.getName() == "main");
+
+    FunctionCallee printLockContention =
+        M.getOrInsertFunction("PrintLockContention",
+                              FunctionType::get(ret_type, {ptr_type}, false));
+
+    builder.SetInsertPoint(&F.back().back());
+    Value *fileName =
+        builder.CreateGlobalString(GetInstrumentLockContentionOutputFile());
+    CreateCallAtMainExits(F, builder, printLockContention, {fileName});
+  }
+
+private:
+  NodeIds ids_;
+  // Clones of lock holder members, null for ones which don't lock
+  DenseMap<Function *, Function *> holders_;
+};
+
+// ------------------------------------------------------------------------------------------------
+// Runtime attributes
+
+// Probes only touch runtime state, pointers passed to them are never
+// dereferenced
+const StringRef kProbeFunctions[] = {
+    "PrepareIncreasePasses",
+    "IncreaseNPasses",
+    "AddUsage",
+    "AddDynamicallyAllocatedMemory",
+    "LogIfMemoryIsDynamicallyAllocated",
+    "LogDynamicMemoryAccess",
+    "RemoveDynamicallAllocatedMemory",
+    "ReallocDynamicallyAllocatedMemory",
+    "EnterMemoryScope",
+    "LogMemoryStride",
+    "EnterFunction",
+    "ExitFunction",
+    "CountContextBlock",
+    "TimeFunctionEnter",
+    "TimeFunctionExit",
+    "TimeBlock",
+    "ProfileValue",
+    "RecordTripCount",
+    "SetLockSite",
+};
+
+// Runs after instrumenting passes. Declarations of runtime functions get
+// attributes, so instrumented optimized code keeps loads and stores of the
+// program movable around probes and doesn't expect unwinding from them.
+struct RuntimeAttributesPass : public PassInfoMixin<RuntimeAttributesPass> {
+public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+    if (IsLogging(M)) {
+      return PreservedAnalyses::all();
+    }
+
+    for (StringRef name : kLoggingFunctions) {
+      Function *F = M.getFunction(name);
+      // Pool allocator replaces malloc, it keeps attributes of a call
+      if (!F || name.starts_with("Pool")) {
+        continue;
+      }
+
+      F->setDoesNotThrow();
+      if (is_contained(kProbeFunctions, name)) {
+        F->setMemoryEffects(MemoryEffects::inaccessibleMemOnly());
+        F->setWillReturn();
+      }
+    }
+
+    return PreservedAnalyses::all();
+  }
+};
+
+// Runs enabled passes unless the module was already instrumented, e.g. at
+// ThinLTO pre-link by a plugin loaded both by compiler and linker. The mark
+// is named metadata, so it is kept in bitcode.
+struct InstrumentOncePass : public PassInfoMixin<InstrumentOncePass> {
+public:
+  explicit InstrumentOncePass(ModulePassManager passes)
+      : passes_(std::move(passes)) {}
+
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+    if (M.getNamedMetadata(kInstrumentedMetadata)) {
+      return PreservedAnalyses::all();
+    }
+
+    PreservedAnalyses preserved = passes_.run(M, MAM);
+    M.getOrInsertNamedMetadata(kInstrumentedMetadata);
+    return preserved;
+  }
+
+private:
+  ModulePassManager passes_;
+
+  static constexpr const char *kInstrumentedMetadata = "pass.instrumented";
+};
+
+// ------------------------------------------------------------------------------------------------
+
+// Passes are selected with comma separated PASS_LIST env variable
+std::set<std::string> GetEnabledPasses() {
+  const char *pass_list = std::getenv("PASS_LIST");
+  StringRef passes = pass_list ? pass_list : "control_flow,def_use,memory";
+
+  SmallVector<StringRef> names;
+  passes.split(names, ',', -1, false);
+
+  std::set<std::string> enabled;
+  for (StringRef name : names) {
+    name = name.trim();
+    if (!is_contained(kPassNames, name)) {
+      report_fatal_error("Unknown pass in PASS_LIST: " + name);
+    }
+    enabled.insert(name.str());
+  }
+
+  return enabled;
+}
+
+void AddEnabledPasses(ModulePassManager &MPM) {
+  auto enabled = GetEnabledPasses();
+  ModulePassManager passes;
+
+  if (enabled.count("control_flow")) {
+    passes.addPass(ControlFlowBuilderPass{});
+  }
+  if (enabled.count("def_use")) {
+    passes.addPass(DefUseBuilderPass{});
+  }
+  if (enabled.count("memory")) {
+    passes.addPass(MemoryAllocPass{});
+  }
+  if (enabled.count("memory_stride")) {
+    passes.addPass(MemoryStridePass{});
+  }
+  if (enabled.count("calling_context")) {
+    passes.addPass(CallingContextPass{});
+  }
+  if (enabled.count("timing")) {
+    passes.addPass(TimingPass{});
+  }
+  if (enabled.count("loops")) {
+    passes.addPass(LoopTripCountPass{});
+  }
+  if (enabled.count("coverage")) {
+    passes.addPass(CoveragePass{});
+  }
+  if (enabled.count("locks")) {
+    passes.addPass(LockContentionPass{});
+  }
+
+  passes.addPass(RuntimeAttributesPass{});
+
+  MPM.addPass(InstrumentOncePass{std::move(passes)});
+}
+
+// Only LLVM 20 and later pass the phase to optimizer callbacks
+bool IsThinLTOPreLink() { return false; }
+
+bool IsThinLTOPreLink(ThinOrFullLTOPhase phase) {
+  return phase == ThinOrFullLTOPhase::ThinLTOPreLink;
+}
+
+// Where passes are added to pipeline, selected with PASS_EXTENSION_POINT env
+// variable:
+// - pipeline_start - every TU separately, before optimizations;
+// - optimizer_early - every TU, after simplification and inlining, before
+//   loop vectorization;
+// - optimizer_last - every TU, after all optimizations;
+// - full_lto - once for the whole program at full LTO link;
+// - thin_lto - in every ThinLTO backend, after optimizations. The same
+//   callback runs at ThinLTO pre-link, where the module is skipped.
+void RegisterPasses(PassBuilder &PB) {
+  const char *extension_point = std::getenv("PASS_EXTENSION_POINT");
+  StringRef point = extension_point ? extension_point : "pipeline_start";
+
+  // Callback signatures differ between LLVM versions
+  const auto add_passes = [](ModulePassManager &MPM, auto...) {
+    AddEnabledPasses(MPM);
+  };
+
+  if (point == "pipeline_start") {
+    PB.registerPipelineStartEPCallback(add_passes);
+  } else if (point == "optimizer_early") {
+    PB.registerOptimizerEarlyEPCallback(add_passes);
+  } else if (point == "optimizer_last") {
+    PB.registerOptimizerLastEPCallback(add_passes);
+  } else if (point == "full_lto") {
+    PB.registerFullLinkTimeOptimizationEarlyEPCallback(add_passes);
+  } else if (point == "thin_lto") {
+    // Without the phase pre-link can't be told from backend, then modules
+    // are instrumented where the plugin runs first
+    PB.registerOptimizerLastEPCallback(
+        [](ModulePassManager &MPM, OptimizationLevel, auto... phase) {
+          if (!IsThinLTOPreLink(phase...)) {
+            AddEnabledPasses(MPM);
+          }
+        });
+  } else {
+    report_fatal_error("Unknown PASS_EXTENSION_POINT: " + point);
+  }
+}
+
+PassPluginLibraryInfo getPassPluginInfo() {
+  const auto callback = [](PassBuilder &PB) { RegisterPasses(PB); };
+
+  return {LLVM_PLUGIN_API_VERSION, "MyPlugin", "0.0.1", callback};
+};
+
+} // namespace
+
+namespace pass {
+
+void BuildStaticGraphs(Module &M, ModuleAnalysisManager &MAM) {
+  auto enabled = GetEnabledPasses();
+
+  // Other passes don't build graphs
+  if (enabled.count("control_flow")) {
+    ControlFlowBuilderPass{false}.run(M, MAM);
+  }
+  if (enabled.count("def_use")) {
+    DefUseBuilderPass{false}.run(M, MAM);
+  }
+  if (enabled.count("memory")) {
+    MemoryAllocPass{false}.run(M, MAM);
+  }
+}
+
+} // namespace pass
 
 extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
   return getPassPluginInfo();
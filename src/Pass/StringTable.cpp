@@ -0,0 +1,119 @@
+#include "Pass/StringTable.hpp"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <set>
+#include <stdexcept>
+#include <vector>
+
+namespace dot {
+
+namespace {
+
+const char kStringTableComment[] = "// strings: ";
+
+// Tables are read once, all graph files of a module share one
+std::shared_ptr<const std::vector<std::string>>
+LoadLabels(const std::string &filename) {
+  static std::mutex mutex;
+  static std::map<std::string, std::shared_ptr<const std::vector<std::string>>>
+      tables;
+
+  std::lock_guard<std::mutex> lock{mutex};
+  auto &table = tables[filename];
+  if (table) {
+    return table;
+  }
+
+  std::ifstream in{filename};
+  if (!in) {
+    throw std::runtime_error("Can't open string table " + filename);
+  }
+
+  auto labels = std::make_shared<std::vector<std::string>>();
+  std::string line;
+  while (std::getline(in, line)) {
+    labels->push_back(line);
+  }
+
+  table = labels;
+  return table;
+}
+
+// Whether the table was already opened by this process
+bool IsStarted(const std::string &filename) {
+  static std::mutex mutex;
+  static std::set<std::string> started;
+
+  std::lock_guard<std::mutex> lock{mutex};
+  return !started.insert(filename).second;
+}
+
+} // namespace
+
+StringTable::StringTable(std::string filename)
+    : filename_(std::move(filename)) {
+  if (!IsStarted(filename_)) {
+    out_.open(filename_, std::ios::trunc);
+  } else {
+    std::ifstream in{filename_};
+    std::string line;
+    while (std::getline(in, line)) {
+      indexes_.emplace(line, indexes_.size());
+    }
+
+    out_.open(filename_, std::ios::app);
+  }
+  if (!out_) {
+    throw std::runtime_error{"Can't open string table " + filename_};
+  }
+}
+
+uint64_t StringTable::Intern(std::string_view label) {
+  // One label per line
+  std::string line{label};
+  line = std::regex_replace(line, std::regex("\n"), "\\n");
+
+  auto [it, inserted] = indexes_.emplace(line, indexes_.size());
+  if (inserted) {
+    out_ << line << "\n";
+  }
+
+  return it->second;
+}
+
+std::string ResolveStringRefs(const std::string &graph) {
+  size_t comment_pos = graph.find(kStringTableComment);
+  if (comment_pos == std::string::npos) {
+    return graph;
+  }
+
+  size_t filename_pos = comment_pos + sizeof(kStringTableComment) - 1;
+  std::string filename =
+      graph.substr(filename_pos, graph.find('\n', filename_pos) - filename_pos);
+
+  auto labels = LoadLabels(filename);
+
+  std::string resolved;
+  std::regex ref_regex(R"(strref=(\d+))");
+  auto last = graph.begin();
+  for (auto it = std::sregex_iterator(graph.begin(), graph.end(), ref_regex);
+       it != std::sregex_iterator(); ++it) {
+    uint64_t index = std::stoull((*it)[1].str());
+    if (index >= labels->size()) {
+      throw std::runtime_error("No string " + std::to_string(index) + " in " +
+                               filename);
+    }
+
+    resolved.append(last, (*it)[0].first);
+    resolved += "label=\"" + (*labels)[index] + "\"";
+    last = (*it)[0].second;
+  }
+  resolved.append(last, graph.end());
+
+  return resolved;
+}
+
+} // namespace dot
@@ -1,7 +1,10 @@
 #include "Pass/Util.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <stdexcept>
 #include <cstdlib>
+#include <thread>
 
 namespace util {
 
@@ -24,4 +27,57 @@ std::ofstream OpenFile(const char *env_var_name, const char *backup_name) {
   return out;
 }
 
+std::vector<std::string> ReadLines(const char *filename) {
+  std::ifstream in{filename};
+  if (!in) {
+    throw std::runtime_error{std::string{"Can't open file "} + filename};
+  }
+
+  std::vector<std::string> lines;
+  std::string line;
+  while (std::getline(in, line)) {
+    line = line.substr(0, line.find('#'));
+
+    size_t begin = line.find_first_not_of(" \t\r");
+    if (begin == std::string::npos) {
+      continue;
+    }
+
+    size_t end = line.find_last_not_of(" \t\r");
+    lines.push_back(line.substr(begin, end - begin + 1));
+  }
+
+  return lines;
+}
+
+size_t GetJobs(const char *env_var_name) {
+  const char *jobs = std::getenv(env_var_name);
+  if (jobs) {
+    return std::max<size_t>(std::stoull(jobs), 1);
+  }
+
+  return std::max<size_t>(std::thread::hardware_concurrency(), 1);
+}
+
+void ParallelFor(size_t size, size_t jobs,
+                 const std::function<void(size_t)> &task) {
+  std::atomic<size_t> next{0};
+  auto worker = [&] {
+    for (size_t i = next++; i < size; i = next++) {
+      task(i);
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < std::min(jobs, size); ++i) {
+    workers.emplace_back(worker);
+  }
+
+  // Current thread is one of workers
+  worker();
+  for (auto &thread : workers) {
+    thread.join();
+  }
+}
+
 } // namespace util
@@ -1,13 +1,37 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <optional>
 #include <regex>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "Pass/Coverage.hpp"
+#include "Pass/CycleReport.hpp"
+#include "Pass/StringTable.hpp"
+#include "Pass/Util.hpp"
+
+// Functions, blocks and branches in reports
+constexpr size_t kReportTop = 20;
+
+std::string InterpolateColor(double ratio) {
+  int red = static_cast<int>(255 * ratio);
+  int green = static_cast<int>(255 * (1.0 - ratio));
+  char buffer[8];
+  std::snprintf(buffer, sizeof(buffer), "#%02X%02X00", red, green);
+  return std::string(buffer);
+}
+
 std::string ReadFile(std::string_view filename) {
   std::ifstream file(filename.data());
 
@@ -20,9 +44,263 @@ std::string ReadFile(std::string_view filename) {
   return buffer.str();
 }
 
-void ProceedFile(std::string_view filename, std::string edges_file_content,
+// Runtime lines indexed by node, so a graph file is matched in time of its
+// own size, not of the whole runtime file
+struct RuntimeInfo {
+  std::vector<std::string> lines;
+  // Edge target, none for node attributes
+  std::vector<std::optional<uint64_t>> targets;
+  // Edges going from the node and its attributes
+  std::unordered_map<uint64_t, std::vector<size_t>> lines_by_node;
+  // Sum of counts of edges coming to the node, for blocks and functions it
+  // is their execution count
+  std::unordered_map<uint64_t, uint64_t> in_counts;
+  std::map<std::pair<uint64_t, uint64_t>, uint64_t> edge_counts;
+  // Output of the coverage pass, it may be concatenated with other runtime
+  // files
+  dot::Coverage coverage;
+};
+
+RuntimeInfo ParseRuntimeInfo(const std::string &edges_file_content) {
+  RuntimeInfo info;
+  std::string line;
+
+  std::regex edgeRegex(R"(node(\d+).*->.*node(\d+).*)");
+  // node attributes from runtime, e.g. memory stride colors
+  std::regex attrs_regex(R"(\s*node(\d+)\s*\[.*)");
+  std::regex label_regex(R"re(label="(\d+)")re");
+
+  std::stringstream edges_file{edges_file_content};
+  while (std::getline(edges_file, line)) {
+    if (info.coverage.ParseLine(line)) {
+      continue;
+    }
+
+    std::smatch match;
+    std::optional<uint64_t> target;
+    if (std::regex_match(line, match, edgeRegex)) {
+      target = std::stoull(match[2]);
+
+      std::smatch label_match;
+      if (std::regex_search(line, label_match, label_regex)) {
+        uint64_t count = std::stoull(label_match[1].str());
+        info.in_counts[*target] += count;
+        info.edge_counts[{std::stoull(match[1]), *target}] += count;
+      }
+    } else if (!std::regex_match(line, match, attrs_regex)) {
+      continue;
+    }
+
+    info.lines_by_node[std::stoull(match[1])].push_back(info.lines.size());
+    info.targets.push_back(target);
+    info.lines.push_back(line);
+  }
+
+  return info;
+}
+
+// Instructions are executed as many times as their block. The entry block
+// has no predecessors, it is executed once per call of the function, and
+// at least once if any block of the function was.
+std::unordered_map<uint64_t, uint64_t>
+GetBlockCounts(const dot::GraphCosts &costs, const RuntimeInfo &info) {
+  auto get_in_count = [&](uint64_t node) -> uint64_t {
+    auto count_it = info.in_counts.find(node);
+    return count_it != info.in_counts.end() ? count_it->second : 0;
+  };
+
+  std::unordered_map<uint64_t, uint64_t> counts;
+  std::unordered_set<uint64_t> executed_functions;
+  for (const auto &[block, function] : costs.functions) {
+    counts[block] = get_in_count(block);
+    if (counts[block] > 0) {
+      executed_functions.insert(function);
+    }
+  }
+
+  for (const auto &[function, entry] : costs.entry_blocks) {
+    counts[entry] = get_in_count(function);
+    if (counts[entry] == 0 && executed_functions.count(function)) {
+      counts[entry] = 1;
+    }
+  }
+
+  return counts;
+}
+
+// Block and instruction nodes colored by count times cost, relative to the
+// most expensive node of their kind in the file
+std::string ColorByCycles(const dot::GraphCosts &costs,
+                          const RuntimeInfo &info, dot::CycleReport &report) {
+  std::unordered_map<uint64_t, uint64_t> block_counts =
+      GetBlockCounts(costs, info);
+
+  std::unordered_map<uint64_t, uint64_t> cycles;
+  std::unordered_map<uint64_t, uint64_t> block_cycles;
+  for (const auto &[node, cost] : costs.costs) {
+    auto block_it = costs.blocks.find(node);
+    if (block_it == costs.blocks.end()) {
+      continue;
+    }
+
+    cycles[node] = block_counts[block_it->second] * cost;
+    block_cycles[block_it->second] += cycles[node];
+  }
+
+  auto get_max = [](const std::unordered_map<uint64_t, uint64_t> &values) {
+    uint64_t max_value = 1;
+    for (const auto &[node, value] : values) {
+      max_value = std::max(max_value, value);
+    }
+    return max_value;
+  };
+
+  std::stringstream attrs;
+  auto add_colors = [&](const std::unordered_map<uint64_t, uint64_t> &values,
+                        bool with_label) {
+    uint64_t max_value = get_max(values);
+    for (const auto &[node, value] : values) {
+      if (value == 0) {
+        continue;
+      }
+
+      attrs << "node" << node << " [fillcolor=\""
+            << InterpolateColor(static_cast<double>(value) / max_value)
+            << "\"";
+      if (with_label) {
+        attrs << ", xlabel=\"" << value << " cycles\"";
+      }
+      attrs << "];\n";
+    }
+  };
+
+  add_colors(cycles, false);
+  add_colors(block_cycles, true);
+
+  report.Add(costs, cycles);
+  return attrs.str();
+}
+
+// Branch which successor probability estimated by the compiler is the
+// farthest from the measured one. Mismatches of frequent branches go first,
+// they are worth __builtin_expect or PGO most.
+struct Mismatch {
+  std::string label;
+  double estimated;
+  double measured;
+  uint64_t count;
+
+  double GetScore() const { return std::abs(measured - estimated) * count; }
+};
+
+class MismatchReport {
+public:
+  void Add(std::vector<Mismatch> mismatches) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    for (auto &mismatch : mismatches) {
+      mismatches_.push_back(std::move(mismatch));
+    }
+  }
+
+  void Print(std::ostream &out, size_t top) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    if (mismatches_.empty()) {
+      return;
+    }
+
+    std::sort(mismatches_.begin(), mismatches_.end(),
+              [](const Mismatch &lhs, const Mismatch &rhs) {
+                return lhs.GetScore() > rhs.GetScore();
+              });
+
+    out << "Static estimates vs profile:\n"
+        << "  estimated  measured          runs  branch\n";
+    for (size_t i = 0; i < std::min(top, mismatches_.size()); ++i) {
+      const auto &mismatch = mismatches_[i];
+      out << std::fixed << std::setprecision(1) << std::setw(10)
+          << 100 * mismatch.estimated << "%" << std::setw(9)
+          << 100 * mismatch.measured << "%" << std::setw(14)
+          << mismatch.count << "  " << mismatch.label << "\n";
+    }
+  }
+
+private:
+  std::mutex mutex_;
+  std::vector<Mismatch> mismatches_;
+};
+
+// Static edges of branches carry probability estimated by the compiler,
+// executed ones are compared with measured probabilities
+std::vector<Mismatch> FindMismatches(const std::string &file_string,
+                                     const dot::GraphCosts &costs,
+                                     const RuntimeInfo &info) {
+  std::regex prob_regex(
+      R"(\s*node(\d+) -> node(\d+) \[.*prob=([^,\]]+).*)");
+
+  std::map<uint64_t, std::vector<std::pair<uint64_t, double>>> branches;
+  std::string line;
+  std::stringstream ss{file_string};
+  while (std::getline(ss, line)) {
+    std::smatch match;
+    if (std::regex_match(line, match, prob_regex)) {
+      branches[std::stoull(match[1].str())].emplace_back(
+          std::stoull(match[2].str()), std::stod(match[3].str()));
+    }
+  }
+
+  auto get_label = [&](uint64_t cluster) {
+    auto label_it = costs.labels.find(cluster);
+    return label_it != costs.labels.end() ? label_it->second
+                                          : std::to_string(cluster);
+  };
+
+  std::vector<Mismatch> mismatches;
+  for (const auto &[from, successors] : branches) {
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    for (const auto &[to, estimated] : successors) {
+      auto count_it = info.edge_counts.find({from, to});
+      counts.push_back(count_it != info.edge_counts.end() ? count_it->second
+                                                          : 0);
+      total += counts.back();
+    }
+
+    if (total == 0) {
+      continue;
+    }
+
+    std::optional<Mismatch> worst;
+    for (size_t i = 0; i < successors.size(); ++i) {
+      const auto &[to, estimated] = successors[i];
+      Mismatch mismatch{"", estimated,
+                        static_cast<double>(counts[i]) / total, total};
+      if (!worst || mismatch.GetScore() > worst->GetScore()) {
+        mismatch.label = get_label(to);
+        worst = mismatch;
+      }
+    }
+
+    std::string block = std::to_string(from);
+    if (auto block_it = costs.blocks.find(from);
+        block_it != costs.blocks.end()) {
+      auto function_it = costs.functions.find(block_it->second);
+      block = (function_it != costs.functions.end()
+                   ? get_label(function_it->second) + ": "
+                   : "") +
+              get_label(block_it->second);
+    }
+
+    worst->label = block + " -> " + worst->label;
+    mismatches.push_back(*worst);
+  }
+
+  return mismatches;
+}
+
+void ProceedFile(std::string_view filename, const RuntimeInfo &info,
+                 dot::CycleReport &report, MismatchReport &mismatches,
                  std::string out_file_name) {
-  std::string file_string = ReadFile(filename.data());
+  std::string file_string = dot::ResolveStringRefs(ReadFile(filename.data()));
 
   std::unordered_set<uint64_t> nodes;
   std::regex node_regex(R"(.*node(\d+).*)");
@@ -35,29 +313,41 @@ void ProceedFile(std::string_view filename, std::string edges_file_content,
     nodes.insert(val);
   }
 
-  std::vector<std::string> valid_lines;
-  std::string line;
-
-  std::regex edgeRegex(R"(node(\d+).*->.*node(\d+).*)");
+  std::vector<size_t> valid_lines;
+  for (uint64_t node : nodes) {
+    auto lines_it = info.lines_by_node.find(node);
+    if (lines_it == info.lines_by_node.end()) {
+      continue;
+    }
 
-  std::stringstream edges_file{edges_file_content};
-  while (std::getline(edges_file, line)) {
-    std::smatch match;
-    if (std::regex_match(line, match, edgeRegex)) {
-      auto num1 = std::stoull(match[1]);
-      auto num2 = std::stoull(match[2]);
-      if (nodes.count(num1) && nodes.count(num2)) {
-        valid_lines.push_back(line);
+    for (size_t index : lines_it->second) {
+      const auto &target = info.targets[index];
+      if (!target || nodes.count(*target)) {
+        valid_lines.push_back(index);
       }
     }
   }
 
+  // Order of runtime file is kept, later attributes override earlier ones
+  std::sort(valid_lines.begin(), valid_lines.end());
+
+  dot::GraphCosts costs = dot::ParseGraphCosts(file_string);
+  if (!info.coverage.Empty()) {
+    file_string = info.coverage.GrayOut(file_string, costs);
+  }
+
   std::stringstream out_content;
   out_content << "digraph G {\n" << "rankdir=TB;\n";
   out_content << file_string << "\n";
 
-  for (const auto &line : valid_lines) {
-    out_content << line << "\n";
+  // Runtime attributes go last, they override cost colors
+  if (!costs.costs.empty()) {
+    out_content << ColorByCycles(costs, info, report);
+  }
+  mismatches.Add(FindMismatches(file_string, costs, info));
+
+  for (size_t index : valid_lines) {
+    out_content << info.lines[index] << "\n";
   }
 
   out_content << "}\n";
@@ -67,8 +357,6 @@ void ProceedFile(std::string_view filename, std::string edges_file_content,
 }
 
 void BuildGraph(std::string_view out_file_name) {
-  std::system("mkdir -p png");
-
   std::string command = "dot -Tpng " + std::string(out_file_name) + " -o " +
                         std::string("png/") + std::string(out_file_name) +
                         ".png";
@@ -87,8 +375,9 @@ int main(int argc, char *argv[]) {
   std::string prefix = argv[2];
   std::string out_file_name = argv[3];
 
-  std::string edge_file_content = ReadFile(edge_file_name);
+  RuntimeInfo info = ParseRuntimeInfo(ReadFile(edge_file_name));
 
+  std::vector<std::string> filenames;
   for (const auto &entry :
        std::filesystem::directory_iterator(std::filesystem::current_path())) {
     if (!entry.is_regular_file())
@@ -96,11 +385,32 @@ int main(int argc, char *argv[]) {
 
     std::string filename = entry.path().filename().string();
     if (filename.starts_with(prefix)) {
-      std::string out_dot = out_file_name + filename + ".dot";
-      ProceedFile(filename, edge_file_content, out_dot);
-      BuildGraph(out_dot);
+      filenames.push_back(filename);
     }
   }
 
-  return 0;
+  std::filesystem::create_directories("png");
+
+  // Files of split graphs are laid out by several dot processes at once
+  dot::CycleReport report;
+  MismatchReport mismatches;
+  std::atomic<size_t> n_failed{0};
+  std::mutex errors_mutex;
+  auto proceed = [&](size_t i) {
+    std::string out_dot = out_file_name + filenames[i] + ".dot";
+    try {
+      ProceedFile(filenames[i], info, report, mismatches, out_dot);
+      BuildGraph(out_dot);
+    } catch (const std::exception &exception) {
+      n_failed++;
+      std::lock_guard<std::mutex> lock{errors_mutex};
+      std::cerr << filenames[i] << ": " << exception.what() << std::endl;
+    }
+  };
+
+  util::ParallelFor(filenames.size(), util::GetJobs("CONCAT_JOBS"), proceed);
+  report.Print(std::cout, kReportTop);
+  mismatches.Print(std::cout, kReportTop);
+
+  return n_failed == 0 ? 0 : EXIT_FAILURE;
 }
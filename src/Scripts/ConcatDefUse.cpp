@@ -1,13 +1,26 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <regex>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
+
+#include "Pass/Coverage.hpp"
+#include "Pass/CycleReport.hpp"
+#include "Pass/StringTable.hpp"
+#include "Pass/Util.hpp"
+
+// Functions and blocks in the estimated cycles report
+constexpr size_t kReportTop = 20;
 
 std::string InterpolateColor(double ratio) {
   int red = static_cast<int>(255 * ratio);
@@ -29,9 +42,45 @@ std::string ReadFile(std::string_view filename) {
   return buffer.str();
 }
 
-void ProceedFile(std::string_view filename, std::string nodes_file_content,
-                 std::string_view out_file_name) {
-  std::string file_string = ReadFile(filename);
+// Runtime file parsed once for all graph files
+struct RuntimeInfo {
+  std::unordered_map<uint64_t, uint64_t> values; // node id -> its value
+  std::vector<std::string> attrs_lines;
+  std::unordered_map<uint64_t, std::vector<size_t>> attrs_by_node;
+  // Output of the coverage pass, it may be concatenated with the values
+  dot::Coverage coverage;
+};
+
+RuntimeInfo ParseRuntimeInfo(const std::string &nodes_file_content) {
+  RuntimeInfo info;
+  std::regex edgeRegex(R"(node(\d+)\s+(\d+))");
+  // node attributes from runtime, e.g. memory stride colors
+  std::regex attrs_regex(R"(\s*node(\d+)\s*\[.*)");
+  std::string line;
+  std::stringstream ss(nodes_file_content);
+  while (std::getline(ss, line)) {
+    if (info.coverage.ParseLine(line)) {
+      continue;
+    }
+
+    std::smatch match;
+    if (std::regex_match(line, match, edgeRegex)) {
+      uint64_t node_id = std::stoull(match[1].str());
+      info.values[node_id] = std::stoull(match[2].str());
+    } else if (std::regex_match(line, match, attrs_regex)) {
+      uint64_t node_id = std::stoull(match[1].str());
+      info.attrs_by_node[node_id].push_back(info.attrs_lines.size());
+      info.attrs_lines.push_back(line);
+    }
+  }
+
+  return info;
+}
+
+void ProceedFile(std::string_view filename, const RuntimeInfo &info,
+                 dot::CycleReport &report, std::string_view out_file_name) {
+  std::string file_string = dot::ResolveStringRefs(ReadFile(filename));
+  dot::GraphCosts costs = dot::ParseGraphCosts(file_string);
 
   std::unordered_set<uint64_t> nodes;
   std::regex node_regex(R"(node(\d+))");
@@ -43,29 +92,38 @@ void ProceedFile(std::string_view filename, std::string nodes_file_content,
     nodes.insert(val);
   }
 
-  std::map<uint64_t, uint64_t> values; // node id -> its value
-  std::regex edgeRegex(R"(node(\d+)\s+(\d+))");
-  std::string line;
-  std::stringstream ss(nodes_file_content);
-  while (std::getline(ss, line)) {
-    std::smatch match;
-    if (std::regex_match(line, match, edgeRegex)) {
-      uint64_t node_id = std::stoull(match[1].str());
-      uint64_t value = std::stoull(match[2].str());
-      if (nodes.count(node_id)) {
-        values[node_id] = value;
-      }
+  // Node id -> its count times cost, so expensive instructions are hotter
+  // than cheap ones executed as often
+  std::unordered_map<uint64_t, uint64_t> values;
+  std::vector<size_t> attrs_lines;
+  for (uint64_t node_id : nodes) {
+    if (auto value_it = info.values.find(node_id);
+        value_it != info.values.end()) {
+      values[node_id] = value_it->second * costs.GetCost(node_id);
+    }
+
+    if (auto attrs_it = info.attrs_by_node.find(node_id);
+        attrs_it != info.attrs_by_node.end()) {
+      attrs_lines.insert(attrs_lines.end(), attrs_it->second.begin(),
+                         attrs_it->second.end());
     }
   }
 
-  uint64_t max_value =
-      std::max_element(values.begin(), values.end(), [](auto &a, auto &b) {
-        return a.second < b.second;
-      })->second;
+  // Order of runtime file is kept, later attributes override earlier ones
+  std::sort(attrs_lines.begin(), attrs_lines.end());
+
+  uint64_t max_value = 1;
+  if (!values.empty()) {
+    max_value =
+        std::max_element(values.begin(), values.end(), [](auto &a, auto &b) {
+          return a.second < b.second;
+        })->second;
+  }
 
   std::regex color_regex(R"((node(\d+).*?fillcolor=")([^"]*)(".*))");
   std::stringstream out_file_ss{file_string};
   std::string updated_string;
+  std::string line;
 
   while (std::getline(out_file_ss, line)) {
     std::smatch match;
@@ -86,12 +144,21 @@ void ProceedFile(std::string_view filename, std::string nodes_file_content,
     }
   }
 
+  if (!info.coverage.Empty()) {
+    updated_string = info.coverage.GrayOut(updated_string, costs);
+  }
+
   std::stringstream out_content;
   out_content << "digraph G {\n"
               << "rankdir=TB;\n";
   out_content << updated_string << "\n";
+  for (size_t index : attrs_lines) {
+    out_content << info.attrs_lines[index] << "\n";
+  }
   out_content << "}\n";
 
+  report.Add(costs, values);
+
   std::ofstream outFile(out_file_name.data());
   if (!outFile) {
     throw std::runtime_error("Can't open file for writing: " +
@@ -101,8 +168,6 @@ void ProceedFile(std::string_view filename, std::string nodes_file_content,
 }
 
 void BuildGraph(std::string_view filename) {
-  std::system("mkdir -p png");
-
   std::string command = "dot -Tpng " + std::string(filename) + " -o " +
                         std::string("png/") + std::string(filename) + ".png";
   std::system(command.c_str());
@@ -118,8 +183,9 @@ int main(int argc, char *argv[]) {
   std::string prefix = argv[2];
   std::string out_file_name = argv[3];
 
-  std::string edge_file_content = ReadFile(edge_filename);
+  RuntimeInfo info = ParseRuntimeInfo(ReadFile(edge_filename));
 
+  std::vector<std::string> filenames;
   for (const auto &entry :
        std::filesystem::directory_iterator(std::filesystem::current_path())) {
     if (!entry.is_regular_file())
@@ -127,11 +193,30 @@ int main(int argc, char *argv[]) {
 
     std::string filename = entry.path().filename().string();
     if (filename.starts_with(prefix)) {
-      std::string out_dot = out_file_name + filename + ".dot";
-      ProceedFile(filename, edge_file_content, out_dot);
-      BuildGraph(out_dot);
+      filenames.push_back(filename);
     }
   }
 
-  return 0;
+  std::filesystem::create_directories("png");
+
+  // Files of split graphs are laid out by several dot processes at once
+  dot::CycleReport report;
+  std::atomic<size_t> n_failed{0};
+  std::mutex errors_mutex;
+  auto proceed = [&](size_t i) {
+    std::string out_dot = out_file_name + filenames[i] + ".dot";
+    try {
+      ProceedFile(filenames[i], info, report, out_dot);
+      BuildGraph(out_dot);
+    } catch (const std::exception &exception) {
+      n_failed++;
+      std::lock_guard<std::mutex> lock{errors_mutex};
+      std::cerr << filenames[i] << ": " << exception.what() << std::endl;
+    }
+  };
+
+  util::ParallelFor(filenames.size(), util::GetJobs("CONCAT_JOBS"), proceed);
+  report.Print(std::cout, kReportTop);
+
+  return n_failed == 0 ? 0 : EXIT_FAILURE;
 }
@@ -0,0 +1,706 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "Pass/StringTable.hpp"
+#include "Pass/Util.hpp"
+
+// Compares profiles of a baseline and a candidate build. Static graphs are
+// colored by relative change of every node and edge, top regressions are
+// printed, and exit code tells whether any of them is above a threshold, so
+// the tool could gate a CI job. Node ids are computed from function names
+// and positions, so both builds give the same ids to the same code.
+
+// Exit code for regressions, failures to read or write files are
+// EXIT_FAILURE
+constexpr int kRegressionExitCode = 2;
+
+constexpr size_t kMaxLabelLength = 60;
+
+struct Options {
+  std::string baseline_file_name;
+  std::string candidate_file_name;
+  std::string prefix;
+  // Graphs of the baseline build, may start with a directory. Candidate
+  // graphs are used for both profiles without it.
+  std::string baseline_prefix;
+  std::string out_file_name;
+  // Percent of relative growth of normalized count, no gate if not set
+  std::optional<double> threshold;
+  // Counts below it in both profiles are noise
+  uint64_t min_count{100};
+  size_t top{20};
+};
+
+Options ParseOptions(int argc, char *argv[]) {
+  Options options;
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc) {
+        throw std::runtime_error("Missing value for " + arg);
+      }
+      return argv[++i];
+    };
+
+    if (arg == "--threshold") {
+      options.threshold = std::stod(value());
+    } else if (arg == "--min-count") {
+      options.min_count = std::stoull(value());
+    } else if (arg == "--top") {
+      options.top = std::stoull(value());
+    } else if (arg == "--baseline-prefix") {
+      options.baseline_prefix = value();
+    } else {
+      positional.push_back(arg);
+    }
+  }
+
+  if (positional.size() == 4) {
+    options.baseline_file_name = positional[0];
+    options.candidate_file_name = positional[1];
+    options.prefix = positional[2];
+    options.out_file_name = positional[3];
+  }
+
+  return options;
+}
+
+std::string InterpolateColor(double ratio) {
+  int red = static_cast<int>(255 * ratio);
+  int green = static_cast<int>(255 * (1.0 - ratio));
+  char buffer[8];
+  std::snprintf(buffer, sizeof(buffer), "#%02X%02X00", red, green);
+  return std::string(buffer);
+}
+
+std::string ReadFile(std::string_view filename) {
+  std::ifstream file(filename.data());
+
+  if (!file) {
+    throw std::runtime_error("Can't open file " + std::string(filename));
+  }
+
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  return buffer.str();
+}
+
+// Profile
+
+using EdgeKey = std::pair<uint64_t, uint64_t>;
+
+// Node counts (node_usage_count) and edge counts (n_passes_edges), edges
+// without count label are counted once. Other lines are ignored, so both
+// kinds could be compared at once.
+struct Profile {
+  std::unordered_map<uint64_t, uint64_t> nodes;
+  std::map<EdgeKey, uint64_t> edges;
+  uint64_t node_total{0};
+  uint64_t edge_total{0};
+};
+
+Profile ParseProfile(const std::string &profile_content) {
+  Profile profile;
+  std::regex count_regex(R"(node(\d+)\s+(\d+))");
+  std::regex edge_regex(R"(\s*node(\d+)\s*->\s*node(\d+).*)");
+  std::regex label_regex(R"re(label="(\d+)")re");
+
+  std::string line;
+  std::stringstream ss{profile_content};
+  while (std::getline(ss, line)) {
+    std::smatch match;
+    if (std::regex_match(line, match, count_regex)) {
+      uint64_t count = std::stoull(match[2].str());
+      profile.nodes[std::stoull(match[1].str())] += count;
+      profile.node_total += count;
+    } else if (std::regex_match(line, match, edge_regex)) {
+      std::smatch label_match;
+      uint64_t count = std::regex_search(line, label_match, label_regex)
+                           ? std::stoull(label_match[1].str())
+                           : 1;
+      profile.edges[{std::stoull(match[1].str()),
+                     std::stoull(match[2].str())}] += count;
+      profile.edge_total += count;
+    }
+  }
+
+  return profile;
+}
+
+// Changes
+
+// Counts are normalized by total of their kind in their profile, so a
+// candidate run on bigger input doesn't look like a regression everywhere
+struct Change {
+  std::string name;
+  uint64_t base{0};
+  uint64_t candidate{0};
+  int64_t delta{0};
+  // Change of share of total, percentage points
+  double share_delta{0};
+  // Relative change of share, infinity for new code
+  double relative{0};
+};
+
+Change MakeChange(std::string name, uint64_t base, uint64_t candidate,
+                  uint64_t base_total, uint64_t candidate_total) {
+  Change change{std::move(name), base, candidate};
+  change.delta = static_cast<int64_t>(candidate) - static_cast<int64_t>(base);
+
+  double base_share =
+      base_total > 0 ? static_cast<double>(base) / base_total : 0;
+  double candidate_share =
+      candidate_total > 0 ? static_cast<double>(candidate) / candidate_total
+                          : 0;
+  change.share_delta = 100 * (candidate_share - base_share);
+
+  if (base_share > 0) {
+    change.relative = candidate_share / base_share - 1;
+  } else if (candidate_share > 0) {
+    change.relative = std::numeric_limits<double>::infinity();
+  }
+
+  return change;
+}
+
+// Green for code which got cheaper, red for code which got more expensive,
+// both saturate at twice the share
+std::string GetColor(const Change &change) {
+  double relative = std::clamp(change.relative, -1.0, 1.0);
+  return InterpolateColor(0.5 + relative / 2);
+}
+
+std::string FormatChange(const Change &change) {
+  std::stringstream ss;
+  ss << change.base << " -> " << change.candidate << " (";
+  if (std::isinf(change.relative)) {
+    ss << "new";
+  } else if (change.candidate == 0) {
+    ss << "removed";
+  } else {
+    ss << std::showpos << std::fixed << std::setprecision(1)
+       << 100 * change.relative << "%";
+  }
+  ss << ")";
+  return ss.str();
+}
+
+struct Diff {
+  std::unordered_map<uint64_t, Change> nodes;
+  std::vector<std::pair<EdgeKey, Change>> edges;
+  // Edges going from the node
+  std::unordered_map<uint64_t, std::vector<size_t>> edges_by_node;
+};
+
+Diff MakeDiff(const Profile &base, const Profile &candidate) {
+  Diff diff;
+
+  auto add_node = [&](uint64_t id) {
+    if (diff.nodes.count(id)) {
+      return;
+    }
+
+    auto base_it = base.nodes.find(id);
+    auto candidate_it = candidate.nodes.find(id);
+    diff.nodes.emplace(
+        id, MakeChange("node" + std::to_string(id),
+                       base_it != base.nodes.end() ? base_it->second : 0,
+                       candidate_it != candidate.nodes.end()
+                           ? candidate_it->second
+                           : 0,
+                       base.node_total, candidate.node_total));
+  };
+
+  for (const auto &[id, count] : base.nodes) {
+    add_node(id);
+  }
+  for (const auto &[id, count] : candidate.nodes) {
+    add_node(id);
+  }
+
+  std::map<EdgeKey, std::pair<uint64_t, uint64_t>> edge_counts;
+  for (const auto &[key, count] : base.edges) {
+    edge_counts[key].first = count;
+  }
+  for (const auto &[key, count] : candidate.edges) {
+    edge_counts[key].second = count;
+  }
+
+  for (const auto &[key, counts] : edge_counts) {
+    diff.edges_by_node[key.first].push_back(diff.edges.size());
+    diff.edges.emplace_back(
+        key, MakeChange("node" + std::to_string(key.first) + " -> node" +
+                            std::to_string(key.second),
+                        counts.first, counts.second, base.edge_total,
+                        candidate.edge_total));
+  }
+
+  return diff;
+}
+
+// Static graph
+
+// Labels of nodes and functions they belong to, collected from every graph
+// file for the report
+struct GraphInfo {
+  std::mutex mutex;
+  std::unordered_map<uint64_t, std::string> labels;
+  std::unordered_map<uint64_t, uint64_t> functions;
+  std::unordered_map<uint64_t, std::string> function_labels;
+};
+
+// Label without escapes and line breaks, short enough for a report line
+std::string ShortenLabel(std::string label) {
+  size_t escape = label.find('\\');
+  if (escape != std::string::npos) {
+    label.resize(escape);
+  }
+  if (label.size() > kMaxLabelLength) {
+    label.resize(kMaxLabelLength - 3);
+    label += "...";
+  }
+  return label;
+}
+
+// Nodes of one graph file in order of appearance
+struct Graph {
+  std::vector<uint64_t> nodes;
+  std::unordered_set<uint64_t> node_set;
+  std::unordered_map<uint64_t, std::string> labels;
+  std::unordered_map<uint64_t, uint64_t> functions;
+  std::unordered_map<uint64_t, std::string> function_labels;
+};
+
+Graph ParseGraph(const std::string &file_string) {
+  std::regex cluster_regex(R"(\s*subgraph cluster_(\d+) \{.*)");
+  std::regex function_label_regex(R"re(\s*label="(.*)";\s*)re");
+  std::regex node_regex(
+      R"re(\s*node(\d+)\s*\[.*?label="((?:[^"\\]|\\.)*)".*)re");
+  std::regex edge_regex(R"(\s*node(\d+)\s*->\s*node(\d+).*)");
+
+  Graph graph;
+  auto add_node = [&](uint64_t id, uint64_t function) {
+    if (graph.node_set.insert(id).second) {
+      graph.nodes.push_back(id);
+    }
+    if (function != 0) {
+      graph.functions.emplace(id, function);
+    }
+  };
+
+  // Function cluster is the outermost one
+  size_t depth = 0;
+  uint64_t function = 0;
+  bool expect_label = false;
+
+  std::string line;
+  std::stringstream ss{file_string};
+  while (std::getline(ss, line)) {
+    std::smatch match;
+    if (std::regex_match(line, match, cluster_regex)) {
+      if (depth++ == 0) {
+        function = std::stoull(match[1].str());
+        expect_label = true;
+      }
+    } else if (line == "}") {
+      if (depth > 0 && --depth == 0) {
+        function = 0;
+      }
+    } else if (expect_label &&
+               std::regex_match(line, match, function_label_regex)) {
+      graph.function_labels[function] = ShortenLabel(match[1].str());
+      expect_label = false;
+    } else if (std::regex_match(line, match, edge_regex)) {
+      add_node(std::stoull(match[1].str()), function);
+      add_node(std::stoull(match[2].str()), function);
+    } else if (std::regex_match(line, match, node_regex)) {
+      uint64_t id = std::stoull(match[1].str());
+      add_node(id, function);
+      graph.labels[id] = ShortenLabel(match[2].str());
+    }
+  }
+
+  return graph;
+}
+
+void AddToInfo(Graph &graph, GraphInfo &info) {
+  std::lock_guard<std::mutex> lock{info.mutex};
+  info.labels.merge(graph.labels);
+  info.functions.merge(graph.functions);
+  info.function_labels.merge(graph.function_labels);
+}
+
+void ProceedFile(std::string_view filename, const Diff &diff, GraphInfo &info,
+                 std::string_view out_file_name) {
+  std::string file_string = dot::ResolveStringRefs(ReadFile(filename));
+  Graph graph = ParseGraph(file_string);
+  const auto &nodes = graph.nodes;
+  const auto &node_set = graph.node_set;
+
+  std::stringstream out_content;
+  out_content << "digraph G {\n" << "rankdir=TB;\n";
+  out_content << file_string << "\n";
+
+  // Later attributes override static ones. Nodes missing in both profiles
+  // are blanked, so static colors are not taken for changes.
+  for (uint64_t id : nodes) {
+    auto change_it = diff.nodes.find(id);
+    if (change_it == diff.nodes.end()) {
+      if (!diff.edges_by_node.count(id)) {
+        out_content << "node" << id << " [fillcolor=\"#FFFFFF\"];\n";
+      }
+      continue;
+    }
+
+    out_content << "node" << id << " [fillcolor=\""
+                << GetColor(change_it->second) << "\", xlabel=\""
+                << FormatChange(change_it->second) << "\"];\n";
+  }
+
+  for (uint64_t id : nodes) {
+    auto edges_it = diff.edges_by_node.find(id);
+    if (edges_it == diff.edges_by_node.end()) {
+      continue;
+    }
+
+    for (size_t index : edges_it->second) {
+      const auto &[key, change] = diff.edges[index];
+      if (!node_set.count(key.second)) {
+        continue;
+      }
+
+      out_content << "node" << key.first << " -> node" << key.second
+                  << " [label=\"" << FormatChange(change) << "\", color=\""
+                  << GetColor(change) << "\", fontcolor=\"" << GetColor(change)
+                  << "\"];\n";
+    }
+  }
+
+  out_content << "}\n";
+
+  std::ofstream outFile(out_file_name.data());
+  if (!outFile) {
+    throw std::runtime_error("Can't open file for writing: " +
+                             std::string(out_file_name));
+  }
+  outFile << out_content.str();
+
+  AddToInfo(graph, info);
+}
+
+// Baseline graphs only map baseline nodes to their functions
+void ProceedBaselineFile(const std::string &filename, GraphInfo &info) {
+  Graph graph = ParseGraph(dot::ResolveStringRefs(ReadFile(filename)));
+  AddToInfo(graph, info);
+}
+
+// Regular files starting with the prefix, which may start with a directory
+std::vector<std::string> ListGraphs(const std::string &prefix) {
+  std::filesystem::path path{prefix};
+  std::filesystem::path directory = path.parent_path();
+  std::string name_prefix = path.filename().string();
+
+  std::vector<std::string> filenames;
+  for (const auto &entry : std::filesystem::directory_iterator(
+           directory.empty() ? std::filesystem::current_path() : directory)) {
+    if (!entry.is_regular_file())
+      continue;
+
+    std::string filename = entry.path().filename().string();
+    if (filename.starts_with(name_prefix)) {
+      filenames.push_back((directory / filename).string());
+    }
+  }
+
+  return filenames;
+}
+
+void BuildGraph(std::string_view filename) {
+  std::string command = "dot -Tpng " + std::string(filename) + " -o " +
+                        std::string("png/") + std::string(filename) + ".png";
+  std::system(command.c_str());
+}
+
+// Report
+
+// Node ids depend on positions in a function, so they move when the function
+// itself is changed. Function totals don't, they are sums of counts of its
+// nodes and of edges coming to them. Each profile is mapped to functions by
+// graphs of its own build, otherwise nodes a function lost or gained are
+// missed on one side.
+std::vector<Change> MakeFunctionChanges(const Profile &base,
+                                        const Profile &candidate,
+                                        const GraphInfo &base_info,
+                                        const GraphInfo &info) {
+  std::map<uint64_t, std::pair<uint64_t, uint64_t>> counts;
+  auto add = [&](uint64_t node, uint64_t count, bool is_candidate) {
+    const GraphInfo &side_info = is_candidate ? info : base_info;
+    auto function_it = side_info.functions.find(node);
+    if (function_it == side_info.functions.end()) {
+      return;
+    }
+
+    auto &function_counts = counts[function_it->second];
+    (is_candidate ? function_counts.second : function_counts.first) += count;
+  };
+
+  for (const auto &[id, count] : base.nodes) {
+    add(id, count, false);
+  }
+  for (const auto &[key, count] : base.edges) {
+    add(key.second, count, false);
+  }
+  for (const auto &[id, count] : candidate.nodes) {
+    add(id, count, true);
+  }
+  for (const auto &[key, count] : candidate.edges) {
+    add(key.second, count, true);
+  }
+
+  std::vector<Change> changes;
+  for (const auto &[function, function_counts] : counts) {
+    // Removed functions are named by the baseline
+    std::string name = "cluster_" + std::to_string(function);
+    for (const GraphInfo *side_info : {&info, &base_info}) {
+      auto label_it = side_info->function_labels.find(function);
+      if (label_it != side_info->function_labels.end()) {
+        name = label_it->second;
+        break;
+      }
+    }
+    changes.push_back(MakeChange(name, function_counts.first,
+                                 function_counts.second,
+                                 base.node_total + base.edge_total,
+                                 candidate.node_total + candidate.edge_total));
+  }
+
+  return changes;
+}
+
+// Code profiled in only one of the builds. Node ids of an edited function are
+// renumbered, so its old and new nodes look removed and added, they are
+// reported apart from changes of matched code.
+bool IsAddedOrRemoved(const Change &change) {
+  return change.base == 0 || change.candidate == 0;
+}
+
+// Only function totals gate, their ids don't move when code inside of them is
+// edited. New functions have no baseline to compare with.
+bool IsRegression(const Change &change, const Options &options) {
+  return options.threshold && !IsAddedOrRemoved(change) &&
+         std::max(change.base, change.candidate) >= options.min_count &&
+         100 * change.relative > *options.threshold;
+}
+
+// Only changes which grew by the key are regressions, largest first
+void PrintChanges(std::string_view title,
+                  const std::vector<const Change *> &changes, size_t top,
+                  double (*key)(const Change &)) {
+  std::vector<const Change *> grown;
+  for (const Change *change : changes) {
+    if (key(*change) > 0) {
+      grown.push_back(change);
+    }
+  }
+
+  std::sort(grown.begin(), grown.end(),
+            [&](const Change *lhs, const Change *rhs) {
+              return key(*lhs) > key(*rhs);
+            });
+  if (grown.size() > top) {
+    grown.resize(top);
+  }
+
+  std::cout << title << ":\n";
+  for (const Change *change : grown) {
+    std::cout << "  " << std::showpos << std::setw(12) << change->delta
+              << std::fixed << std::setprecision(2) << std::setw(9)
+              << change->share_delta << "pp" << std::noshowpos << "  "
+              << change->name << "  " << FormatChange(*change) << "\n";
+  }
+}
+
+double GetDelta(const Change &change) { return change.delta; }
+
+double GetShareDelta(const Change &change) { return change.share_delta; }
+
+double GetRelative(const Change &change) { return change.relative; }
+
+double GetBase(const Change &change) { return change.base; }
+
+double GetCandidate(const Change &change) { return change.candidate; }
+
+// Prints changes of code present in both profiles, then added and removed code
+void PrintAllChanges(std::string_view kind,
+                     const std::vector<const Change *> &changes, size_t top) {
+  std::vector<const Change *> matched;
+  std::vector<const Change *> added;
+  std::vector<const Change *> removed;
+  for (const Change *change : changes) {
+    if (!IsAddedOrRemoved(*change)) {
+      matched.push_back(change);
+    } else if (change->base == 0) {
+      added.push_back(change);
+    } else {
+      removed.push_back(change);
+    }
+  }
+
+  std::string name{kind};
+  PrintChanges("Top " + name + " by absolute delta", matched, top, GetDelta);
+  PrintChanges("Top " + name + " by normalized delta", matched, top,
+               GetShareDelta);
+  PrintChanges("Added " + name, added, top, GetCandidate);
+  PrintChanges("Removed " + name, removed, top, GetBase);
+}
+
+int main(int argc, char *argv[]) {
+  Options options = ParseOptions(argc, argv);
+  if (options.out_file_name.empty()) {
+    std::cerr << "Usage: " << argv[0]
+              << " <baseline_profile> <candidate_profile> <prefix>"
+                 " <out_file_name> [--threshold <percent>] [--min-count <n>]"
+                 " [--top <n>] [--baseline-prefix <prefix>]"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Missing profile must not pass the gate as if nothing changed
+  Profile base;
+  Profile candidate;
+  try {
+    base = ParseProfile(ReadFile(options.baseline_file_name));
+    candidate = ParseProfile(ReadFile(options.candidate_file_name));
+  } catch (const std::exception &exception) {
+    std::cerr << exception.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  Diff diff = MakeDiff(base, candidate);
+
+  std::vector<std::string> filenames;
+  for (const auto &entry :
+       std::filesystem::directory_iterator(std::filesystem::current_path())) {
+    if (!entry.is_regular_file())
+      continue;
+
+    std::string filename = entry.path().filename().string();
+    if (filename.starts_with(options.prefix)) {
+      filenames.push_back(filename);
+    }
+  }
+
+  std::vector<std::string> baseline_filenames;
+  if (!options.baseline_prefix.empty()) {
+    try {
+      baseline_filenames = ListGraphs(options.baseline_prefix);
+    } catch (const std::exception &exception) {
+      std::cerr << exception.what() << std::endl;
+      return EXIT_FAILURE;
+    }
+    if (baseline_filenames.empty()) {
+      std::cerr << "No baseline graphs " << options.baseline_prefix << "*"
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::filesystem::create_directories("png");
+
+  GraphInfo info;
+  std::atomic<size_t> n_failed{0};
+  std::mutex errors_mutex;
+  auto proceed = [&](size_t i) {
+    std::string out_dot = options.out_file_name + filenames[i] + ".dot";
+    try {
+      ProceedFile(filenames[i], diff, info, out_dot);
+      BuildGraph(out_dot);
+    } catch (const std::exception &exception) {
+      n_failed++;
+      std::lock_guard<std::mutex> lock{errors_mutex};
+      std::cerr << filenames[i] << ": " << exception.what() << std::endl;
+    }
+  };
+
+  util::ParallelFor(filenames.size(), util::GetJobs("CONCAT_JOBS"), proceed);
+
+  GraphInfo base_info;
+  auto proceed_baseline = [&](size_t i) {
+    try {
+      ProceedBaselineFile(baseline_filenames[i], base_info);
+    } catch (const std::exception &exception) {
+      n_failed++;
+      std::lock_guard<std::mutex> lock{errors_mutex};
+      std::cerr << baseline_filenames[i] << ": " << exception.what()
+                << std::endl;
+    }
+  };
+
+  util::ParallelFor(baseline_filenames.size(), util::GetJobs("CONCAT_JOBS"),
+                    proceed_baseline);
+
+  // Node names are completed with labels from graphs
+  std::vector<const Change *> changes;
+  for (auto &[id, change] : diff.nodes) {
+    auto label_it = info.labels.find(id);
+    if (label_it != info.labels.end()) {
+      change.name += " \"" + label_it->second + "\"";
+    }
+    changes.push_back(&change);
+  }
+  for (const auto &[key, change] : diff.edges) {
+    changes.push_back(&change);
+  }
+
+  std::vector<Change> function_changes = MakeFunctionChanges(
+      base, candidate, baseline_filenames.empty() ? info : base_info, info);
+  std::vector<const Change *> functions;
+  for (const auto &change : function_changes) {
+    functions.push_back(&change);
+  }
+
+  std::cout << "Nodes: " << base.node_total << " -> " << candidate.node_total
+            << ", edges: " << base.edge_total << " -> " << candidate.edge_total
+            << "\n";
+
+  PrintAllChanges("functions", functions, options.top);
+  PrintAllChanges("nodes and edges", changes, options.top);
+
+  std::vector<const Change *> regressions;
+  for (const auto *change : functions) {
+    if (IsRegression(*change, options)) {
+      regressions.push_back(change);
+    }
+  }
+
+  if (n_failed != 0) {
+    return EXIT_FAILURE;
+  }
+
+  if (!regressions.empty()) {
+    std::stringstream title;
+    title << regressions.size() << " regressions above "
+          << *options.threshold << "%";
+    PrintChanges(title.str(), regressions, options.top, GetRelative);
+    return kRegressionExitCode;
+  }
+
+  return 0;
+}
@@ -1,11 +1,20 @@
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <regex>
 #include <set>
 #include <sstream>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "Pass/StringTable.hpp"
+#include "Pass/Util.hpp"
+
 std::string ReadFile(std::string_view filename) {
   std::ifstream file(filename.data());
 
@@ -18,25 +27,51 @@ std::string ReadFile(std::string_view filename) {
   return buffer.str();
 }
 
-void ProceedFile(std::string file1_input, std::string file2_input,
-                std::string out_name) {
-  std::vector<std::string> vec_file1_lines;
-  std::set<std::string> set_file1_nodes;
+// Runtime lines indexed by node, so a graph file is matched in time of its
+// own size, not of the whole runtime file
+struct RuntimeInfo {
+  std::vector<std::string> lines;
+  // Edge target, empty for node attributes
+  std::vector<std::string> targets;
+  // Edges going from the node and its attributes
+  std::unordered_map<std::string, std::vector<size_t>> lines_by_node;
+  // Every node mentioned in runtime file
+  std::unordered_set<std::string> nodes;
+};
+
+RuntimeInfo ParseRuntimeInfo(const std::string &file1_input) {
+  RuntimeInfo info;
 
   std::regex re_file1("^\\s*(node\\d+)\\s*->\\s*(node\\d+).*");
+  // node attributes from runtime, e.g. allocation site annotations
+  std::regex re_file1_attrs("^\\s*(node\\d+)\\s*\\[.*");
 
   std::stringstream stream_file1(file1_input);
 
   std::string str_line;
   while (std::getline(stream_file1, str_line)) {
-    vec_file1_lines.push_back(str_line);
     std::smatch match_result;
+    std::string str_target;
     if (std::regex_match(str_line, match_result, re_file1)) {
-      set_file1_nodes.insert(match_result[1].str());
-      set_file1_nodes.insert(match_result[2].str());
+      str_target = match_result[2].str();
+      info.nodes.insert(str_target);
+    } else if (!std::regex_match(str_line, match_result, re_file1_attrs)) {
+      continue;
     }
+
+    info.nodes.insert(match_result[1].str());
+    info.lines_by_node[match_result[1].str()].push_back(info.lines.size());
+    info.targets.push_back(str_target);
+    info.lines.push_back(str_line);
   }
 
+  return info;
+}
+
+void ProceedFile(const RuntimeInfo &info, std::string file2_input,
+                 std::string out_name) {
+  std::string str_line;
+
   std::vector<std::string> vec_file2_lines;
   std::set<std::string> set_file2_nodes;
   std::regex re_file2("^\\s*(node\\d+).*");
@@ -47,7 +82,7 @@ void ProceedFile(std::string file1_input, std::string file2_input,
     std::smatch match_result;
     if (std::regex_match(str_line, match_result, re_file2)) {
       std::string str_node = match_result[1].str();
-      if (set_file1_nodes.find(str_node) != set_file1_nodes.end()) {
+      if (info.nodes.count(str_node)) {
         vec_file2_lines.push_back(str_line);
         set_file2_nodes.insert(str_node);
       }
@@ -56,19 +91,25 @@ void ProceedFile(std::string file1_input, std::string file2_input,
     }
   }
 
-  std::vector<std::string> vec_filtered_file1_lines;
-  for (const auto &str_current_line : vec_file1_lines) {
-    std::smatch match_result;
-    if (std::regex_match(str_current_line, match_result, re_file1)) {
-      std::string str_node1 = match_result[1].str();
-      std::string str_node2 = match_result[2].str();
-      if (set_file2_nodes.find(str_node1) != set_file2_nodes.end() &&
-          set_file2_nodes.find(str_node2) != set_file2_nodes.end()) {
-        vec_filtered_file1_lines.push_back(str_current_line);
+  std::vector<size_t> vec_filtered_file1_lines;
+  for (const auto &str_node : set_file2_nodes) {
+    auto lines_it = info.lines_by_node.find(str_node);
+    if (lines_it == info.lines_by_node.end()) {
+      continue;
+    }
+
+    for (size_t index : lines_it->second) {
+      const auto &str_target = info.targets[index];
+      if (str_target.empty() ||
+          set_file2_nodes.find(str_target) != set_file2_nodes.end()) {
+        vec_filtered_file1_lines.push_back(index);
       }
     }
   }
 
+  // Order of runtime file is kept, later attributes override earlier ones
+  std::sort(vec_filtered_file1_lines.begin(), vec_filtered_file1_lines.end());
+
   std::ofstream stream_output(out_name);
   if (!stream_output) {
     throw std::runtime_error{"stream output opening error"};
@@ -81,16 +122,14 @@ void ProceedFile(std::string file1_input, std::string file2_input,
     stream_output << str_current_line << "\n";
   }
 
-  for (const auto &str_current_line : vec_filtered_file1_lines) {
-    stream_output << str_current_line << "\n";
+  for (size_t index : vec_filtered_file1_lines) {
+    stream_output << info.lines[index] << "\n";
   }
 
   stream_output << "}\n";
 }
 
 void BuildGraph(std::string_view filename) {
-  std::system("mkdir -p png");
-
   std::string command = "dot -Tpng " + std::string(filename) + " -o " +
                         std::string("png/") + std::string(filename) + ".png";
   std::system(command.c_str());
@@ -107,8 +146,9 @@ int main(int argc, char *argv[]) {
   std::string prefix = argv[2];
   std::string out_file_name = argv[3];
 
-  std::string edge_file_content = ReadFile(edge_filename);
+  RuntimeInfo info = ParseRuntimeInfo(ReadFile(edge_filename));
 
+  std::vector<std::string> filenames;
   for (const auto &entry :
        std::filesystem::directory_iterator(std::filesystem::current_path())) {
     if (!entry.is_regular_file())
@@ -116,13 +156,30 @@ int main(int argc, char *argv[]) {
 
     std::string filename = entry.path().filename().string();
     if (filename.starts_with(prefix)) {
-      std::string out_dot = out_file_name + filename + ".dot";
-      std::string file_input = ReadFile(filename);
+      filenames.push_back(filename);
+    }
+  }
 
-      ProceedFile(edge_file_content, file_input, out_dot);
+  std::filesystem::create_directories("png");
+
+  // Files of split graphs are laid out by several dot processes at once
+  std::atomic<size_t> n_failed{0};
+  std::mutex errors_mutex;
+  auto proceed = [&](size_t i) {
+    std::string out_dot = out_file_name + filenames[i] + ".dot";
+    try {
+      std::string file_input = dot::ResolveStringRefs(ReadFile(filenames[i]));
+
+      ProceedFile(info, file_input, out_dot);
       BuildGraph(out_dot);
+    } catch (const std::exception &exception) {
+      n_failed++;
+      std::lock_guard<std::mutex> lock{errors_mutex};
+      std::cerr << filenames[i] << ": " << exception.what() << std::endl;
     }
-  }
+  };
 
-  return 0;
-}
\ No newline at end of file
+  util::ParallelFor(filenames.size(), util::GetJobs("CONCAT_JOBS"), proceed);
+
+  return n_failed == 0 ? 0 : EXIT_FAILURE;
+}
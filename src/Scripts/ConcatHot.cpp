@@ -0,0 +1,461 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Pass/StringTable.hpp"
+#include "Pass/Util.hpp"
+
+// Keeps only hot part of static graphs: nodes above a count threshold or
+// top-K of them by profile weight, with their k-hop neighborhoods. The rest
+// of every function is collapsed into one summary node with aggregated
+// count, so graphs of real programs stay readable and cheap to render.
+
+struct Options {
+  std::string profile_file_name;
+  std::string prefix;
+  std::string out_file_name;
+  uint64_t threshold{1};
+  // Zero means no limit
+  size_t top_k{100};
+  size_t hops{1};
+};
+
+Options ParseOptions(int argc, char *argv[]) {
+  Options options;
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc) {
+        throw std::runtime_error("Missing value for " + arg);
+      }
+      return argv[++i];
+    };
+
+    if (arg == "--threshold") {
+      options.threshold = std::stoull(value());
+    } else if (arg == "--top-k") {
+      options.top_k = std::stoull(value());
+    } else if (arg == "--hops") {
+      options.hops = std::stoull(value());
+    } else {
+      positional.push_back(arg);
+    }
+  }
+
+  if (positional.size() == 3) {
+    options.profile_file_name = positional[0];
+    options.prefix = positional[1];
+    options.out_file_name = positional[2];
+  }
+
+  return options;
+}
+
+std::string InterpolateColor(double ratio) {
+  int red = static_cast<int>(255 * ratio);
+  int green = static_cast<int>(255 * (1.0 - ratio));
+  char buffer[8];
+  std::snprintf(buffer, sizeof(buffer), "#%02X%02X00", red, green);
+  return std::string(buffer);
+}
+
+std::string ReadFile(std::string_view filename) {
+  std::ifstream file(filename.data());
+
+  if (!file) {
+    throw std::runtime_error("Can't open file " + std::string(filename));
+  }
+
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  return buffer.str();
+}
+
+// Profile
+
+// Node counts (node_usage_count) and edge counts (n_passes_edges), edges
+// without count label are counted once
+struct Profile {
+  std::unordered_map<uint64_t, uint64_t> counts;
+  std::vector<std::string> edge_lines;
+  std::vector<std::pair<uint64_t, uint64_t>> edges;
+  std::vector<uint64_t> edge_counts;
+};
+
+Profile ParseProfile(const std::string &profile_content) {
+  Profile profile;
+  std::regex count_regex(R"(node(\d+)\s+(\d+))");
+  std::regex edge_regex(R"(\s*node(\d+)\s*->\s*node(\d+).*)");
+  std::regex label_regex(R"re(label="(\d+)")re");
+
+  std::string line;
+  std::stringstream ss{profile_content};
+  while (std::getline(ss, line)) {
+    std::smatch match;
+    if (std::regex_match(line, match, count_regex)) {
+      profile.counts[std::stoull(match[1].str())] +=
+          std::stoull(match[2].str());
+    } else if (std::regex_match(line, match, edge_regex)) {
+      profile.edges.emplace_back(std::stoull(match[1].str()),
+                                 std::stoull(match[2].str()));
+
+      std::smatch label_match;
+      profile.edge_counts.push_back(
+          std::regex_search(line, label_match, label_regex)
+              ? std::stoull(label_match[1].str())
+              : 1);
+      profile.edge_lines.push_back(line);
+    }
+  }
+
+  return profile;
+}
+
+// Static graph
+
+struct Edge {
+  size_t from;
+  size_t to;
+  uint64_t count;
+  // Original line, kept when both ends are kept
+  std::string line;
+};
+
+// Nodes are numbered in order of appearance. Function 0 holds nodes outside
+// of function clusters.
+struct Graph {
+  std::vector<uint64_t> ids;
+  std::vector<std::string> lines;
+  std::vector<size_t> functions;
+  std::unordered_map<uint64_t, size_t> indexes;
+
+  std::vector<uint64_t> function_ids{0};
+  std::vector<std::string> function_labels{""};
+
+  std::vector<Edge> edges;
+};
+
+size_t GetNode(Graph &graph, uint64_t id, size_t function) {
+  auto [it, inserted] = graph.indexes.try_emplace(id, graph.ids.size());
+  if (inserted) {
+    graph.ids.push_back(id);
+    graph.lines.push_back("node" + std::to_string(id) + ";");
+    graph.functions.push_back(function);
+  }
+
+  return it->second;
+}
+
+Graph ParseGraph(const std::string &file_string) {
+  Graph graph;
+  std::regex cluster_regex(R"(\s*subgraph cluster_(\d+) \{.*)");
+  std::regex label_regex(R"(\s*label=(".*");\s*)");
+  std::regex node_regex(R"(\s*node(\d+)\s*\[.*)");
+  std::regex edge_regex(R"(\s*node(\d+)\s*->\s*node(\d+).*)");
+
+  // Function cluster is the outermost one
+  size_t depth = 0;
+  size_t function = 0;
+  bool expect_label = false;
+
+  std::string line;
+  std::stringstream ss{file_string};
+  while (std::getline(ss, line)) {
+    std::smatch match;
+    if (std::regex_match(line, match, cluster_regex)) {
+      if (depth++ == 0) {
+        function = graph.function_ids.size();
+        graph.function_ids.push_back(std::stoull(match[1].str()));
+        graph.function_labels.push_back("\"\"");
+        expect_label = true;
+      }
+    } else if (line == "}") {
+      if (depth > 0 && --depth == 0) {
+        function = 0;
+      }
+    } else if (expect_label && std::regex_match(line, match, label_regex)) {
+      graph.function_labels[function] = match[1].str();
+      expect_label = false;
+    } else if (std::regex_match(line, match, edge_regex)) {
+      size_t from = GetNode(graph, std::stoull(match[1].str()), function);
+      size_t to = GetNode(graph, std::stoull(match[2].str()), function);
+      graph.edges.push_back({from, to, 0, line});
+    } else if (std::regex_match(line, match, node_regex)) {
+      size_t node = GetNode(graph, std::stoull(match[1].str()), function);
+      graph.lines[node] = line;
+      graph.functions[node] = function;
+    }
+  }
+
+  return graph;
+}
+
+// Selection
+
+// Weight of a node is its count or count of edges going through it
+std::vector<uint64_t> GetWeights(Graph &graph, const Profile &profile) {
+  std::vector<uint64_t> in(graph.ids.size(), 0);
+  std::vector<uint64_t> out(graph.ids.size(), 0);
+
+  for (size_t i = 0; i < profile.edges.size(); ++i) {
+    auto from_it = graph.indexes.find(profile.edges[i].first);
+    auto to_it = graph.indexes.find(profile.edges[i].second);
+    if (from_it == graph.indexes.end() || to_it == graph.indexes.end()) {
+      continue;
+    }
+
+    out[from_it->second] += profile.edge_counts[i];
+    in[to_it->second] += profile.edge_counts[i];
+    graph.edges.push_back({from_it->second, to_it->second,
+                           profile.edge_counts[i], profile.edge_lines[i]});
+  }
+
+  std::vector<uint64_t> weights(graph.ids.size(), 0);
+  for (size_t node = 0; node < graph.ids.size(); ++node) {
+    auto count_it = profile.counts.find(graph.ids[node]);
+    uint64_t count = count_it != profile.counts.end() ? count_it->second : 0;
+    weights[node] = std::max({count, in[node], out[node]});
+  }
+
+  return weights;
+}
+
+// Nodes not lighter than threshold, at most top_k heaviest of them.
+// nth_element keeps selection linear in number of nodes.
+std::vector<size_t> SelectHot(const std::vector<uint64_t> &weights,
+                              uint64_t threshold, size_t top_k) {
+  std::vector<size_t> hot;
+  for (size_t node = 0; node < weights.size(); ++node) {
+    if (weights[node] > 0 && weights[node] >= threshold) {
+      hot.push_back(node);
+    }
+  }
+
+  if (top_k > 0 && hot.size() > top_k) {
+    std::nth_element(hot.begin(), hot.begin() + top_k, hot.end(),
+                     [&](size_t lhs, size_t rhs) {
+                       return weights[lhs] > weights[rhs];
+                     });
+    hot.resize(top_k);
+  }
+
+  return hot;
+}
+
+// Breadth-first search in both directions from hot nodes
+std::vector<bool> KeepNeighborhood(const Graph &graph,
+                                   const std::vector<size_t> &hot,
+                                   size_t hops) {
+  std::vector<std::vector<size_t>> adjacent(graph.ids.size());
+  for (const auto &edge : graph.edges) {
+    adjacent[edge.from].push_back(edge.to);
+    adjacent[edge.to].push_back(edge.from);
+  }
+
+  constexpr size_t kUnreached = std::numeric_limits<size_t>::max();
+  std::vector<size_t> distance(graph.ids.size(), kUnreached);
+  std::queue<size_t> queue;
+  for (size_t node : hot) {
+    distance[node] = 0;
+    queue.push(node);
+  }
+
+  while (!queue.empty()) {
+    size_t node = queue.front();
+    queue.pop();
+    if (distance[node] == hops) {
+      continue;
+    }
+
+    for (size_t next : adjacent[node]) {
+      if (distance[next] == kUnreached) {
+        distance[next] = distance[node] + 1;
+        queue.push(next);
+      }
+    }
+  }
+
+  std::vector<bool> kept(graph.ids.size());
+  for (size_t node = 0; node < graph.ids.size(); ++node) {
+    kept[node] = distance[node] != kUnreached;
+  }
+
+  return kept;
+}
+
+// Output
+
+std::string GetSummaryName(const Graph &graph, size_t function) {
+  return "summary_" + std::to_string(graph.function_ids[function]);
+}
+
+void ProceedFile(std::string_view filename, const Profile &profile,
+                 const Options &options, std::string_view out_file_name) {
+  Graph graph = ParseGraph(dot::ResolveStringRefs(ReadFile(filename)));
+  std::vector<uint64_t> weights = GetWeights(graph, profile);
+  std::vector<bool> kept = KeepNeighborhood(
+      graph, SelectHot(weights, options.threshold, options.top_k),
+      options.hops);
+
+  uint64_t max_weight = 1;
+  for (uint64_t weight : weights) {
+    max_weight = std::max(max_weight, weight);
+  }
+
+  // Per function: kept nodes, number and total weight of collapsed ones
+  size_t n_functions = graph.function_ids.size();
+  std::vector<std::vector<size_t>> kept_nodes(n_functions);
+  std::vector<uint64_t> collapsed(n_functions, 0);
+  std::vector<uint64_t> collapsed_weight(n_functions, 0);
+  for (size_t node = 0; node < graph.ids.size(); ++node) {
+    size_t function = graph.functions[node];
+    if (kept[node]) {
+      kept_nodes[function].push_back(node);
+    } else {
+      collapsed[function]++;
+      collapsed_weight[function] += weights[node];
+    }
+  }
+
+  std::regex color_regex(R"((.*?fillcolor=")([^"]*)(".*))");
+  std::stringstream out_content;
+  out_content << "digraph G {\n" << "rankdir=TB;\n";
+
+  for (size_t function = 0; function < n_functions; ++function) {
+    if (kept_nodes[function].empty() && collapsed[function] == 0) {
+      continue;
+    }
+
+    if (function != 0) {
+      out_content << "subgraph cluster_" << graph.function_ids[function]
+                  << " {\n";
+      out_content << "label=" << graph.function_labels[function] << ";\n";
+    }
+
+    for (size_t node : kept_nodes[function]) {
+      std::smatch match;
+      if (weights[node] > 0 &&
+          std::regex_match(graph.lines[node], match, color_regex)) {
+        out_content << match[1].str()
+                    << InterpolateColor(static_cast<double>(weights[node]) /
+                                        static_cast<double>(max_weight))
+                    << match[3].str() << "\n";
+      } else {
+        out_content << graph.lines[node] << "\n";
+      }
+    }
+
+    if (collapsed[function] > 0) {
+      out_content << GetSummaryName(graph, function) << " [label=\""
+                  << collapsed[function] << " nodes\\ncount "
+                  << collapsed_weight[function]
+                  << "\", shape=box, style=dashed];\n";
+    }
+
+    if (function != 0) {
+      out_content << "}\n";
+    }
+  }
+
+  // Edges between kept nodes are written as is, others are merged into
+  // edges of summary nodes with total count
+  std::map<std::pair<std::string, std::string>, uint64_t> summary_edges;
+  auto get_name = [&](size_t node) {
+    return kept[node] ? "node" + std::to_string(graph.ids[node])
+                      : GetSummaryName(graph, graph.functions[node]);
+  };
+
+  for (const auto &edge : graph.edges) {
+    if (kept[edge.from] && kept[edge.to]) {
+      out_content << edge.line << "\n";
+      continue;
+    }
+
+    std::string from = get_name(edge.from);
+    std::string to = get_name(edge.to);
+    if (from != to) {
+      summary_edges[{from, to}] += edge.count;
+    }
+  }
+
+  for (const auto &[ends, count] : summary_edges) {
+    out_content << ends.first << " -> " << ends.second << " [style=dashed";
+    if (count > 0) {
+      out_content << ", label=\"" << count << "\"";
+    }
+    out_content << "];\n";
+  }
+
+  out_content << "}\n";
+
+  std::ofstream outFile(out_file_name.data());
+  if (!outFile) {
+    throw std::runtime_error("Can't open file for writing: " +
+                             std::string(out_file_name));
+  }
+  outFile << out_content.str();
+}
+
+void BuildGraph(std::string_view filename) {
+  std::string command = "dot -Tpng " + std::string(filename) + " -o " +
+                        std::string("png/") + std::string(filename) + ".png";
+  std::system(command.c_str());
+}
+
+int main(int argc, char *argv[]) {
+  Options options = ParseOptions(argc, argv);
+  if (options.out_file_name.empty()) {
+    std::cerr << "Usage: " << argv[0]
+              << " <profile_file> <prefix> <out_file_name> [--threshold <n>]"
+                 " [--top-k <n>] [--hops <n>]"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  Profile profile = ParseProfile(ReadFile(options.profile_file_name));
+
+  std::vector<std::string> filenames;
+  for (const auto &entry :
+       std::filesystem::directory_iterator(std::filesystem::current_path())) {
+    if (!entry.is_regular_file())
+      continue;
+
+    std::string filename = entry.path().filename().string();
+    if (filename.starts_with(options.prefix)) {
+      filenames.push_back(filename);
+    }
+  }
+
+  std::filesystem::create_directories("png");
+
+  std::atomic<size_t> n_failed{0};
+  std::mutex errors_mutex;
+  auto proceed = [&](size_t i) {
+    std::string out_dot = options.out_file_name + filenames[i] + ".dot";
+    try {
+      ProceedFile(filenames[i], profile, options, out_dot);
+      BuildGraph(out_dot);
+    } catch (const std::exception &exception) {
+      n_failed++;
+      std::lock_guard<std::mutex> lock{errors_mutex};
+      std::cerr << filenames[i] << ": " << exception.what() << std::endl;
+    }
+  };
+
+  util::ParallelFor(filenames.size(), util::GetJobs("CONCAT_JOBS"), proceed);
+
+  return n_failed == 0 ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,135 @@
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <atomic>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Pass/Pass.hpp"
+#include "Pass/Util.hpp"
+
+// Writes static graphs for already compiled bitcode or textual IR files
+// without recompiling and instrumenting them. Files are processed in
+// parallel, each one in its own LLVMContext.
+
+namespace fs = std::filesystem;
+
+struct Options {
+  size_t jobs{std::thread::hardware_concurrency()};
+  std::string out_dir;
+  std::vector<std::string> inputs;
+};
+
+Options ParseOptions(int argc, char *argv[]) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc) {
+        throw std::runtime_error("Missing value for " + arg);
+      }
+      return argv[++i];
+    };
+
+    if (arg == "-j" || arg == "--jobs") {
+      options.jobs = std::stoull(value());
+    } else if (arg == "--out-dir") {
+      options.out_dir = value();
+    } else if (arg == "--list") {
+      for (auto &input : util::ReadLines(value().c_str())) {
+        options.inputs.push_back(input);
+      }
+    } else {
+      options.inputs.push_back(arg);
+    }
+  }
+
+  options.jobs = std::max<size_t>(options.jobs, 1);
+  return options;
+}
+
+// Returns error message, empty on success
+std::string ExtractGraphs(const fs::path &input) {
+  llvm::LLVMContext Ctx;
+  llvm::SMDiagnostic error;
+
+  std::unique_ptr<llvm::Module> M =
+      llvm::parseIRFile(input.string(), error, Ctx);
+  if (!M) {
+    std::string message;
+    llvm::raw_string_ostream ss{message};
+    error.print("GraphExtractor", ss);
+    return message;
+  }
+
+  // Graph names follow the source file, as if the plugin was run on it
+  if (!M->getSourceFileName().empty()) {
+    M->setModuleIdentifier(M->getSourceFileName());
+  }
+
+  llvm::LoopAnalysisManager LAM;
+  llvm::FunctionAnalysisManager FAM;
+  llvm::CGSCCAnalysisManager CGAM;
+  llvm::ModuleAnalysisManager MAM;
+
+  llvm::PassBuilder PB;
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  pass::BuildStaticGraphs(*M, MAM);
+  return "";
+}
+
+int main(int argc, char *argv[]) {
+  Options options = ParseOptions(argc, argv);
+  if (options.inputs.empty()) {
+    std::cerr << "Usage: " << argv[0]
+              << " [-j <jobs>] [--out-dir <dir>] [--list <file>]"
+                 " <file.bc|file.ll>..."
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Inputs are resolved before graphs directory becomes current one
+  std::vector<fs::path> inputs;
+  for (const auto &input : options.inputs) {
+    inputs.push_back(fs::absolute(input));
+  }
+
+  if (!options.out_dir.empty()) {
+    fs::create_directories(options.out_dir);
+    fs::current_path(options.out_dir);
+  }
+
+  std::atomic<size_t> n_failed{0};
+  std::mutex errors_mutex;
+
+  util::ParallelFor(inputs.size(), options.jobs, [&](size_t i) {
+    std::string error;
+    try {
+      error = ExtractGraphs(inputs[i]);
+    } catch (const std::exception &exception) {
+      error = inputs[i].string() + ": " + exception.what() + "\n";
+    }
+
+    if (!error.empty()) {
+      n_failed++;
+      std::lock_guard<std::mutex> lock{errors_mutex};
+      std::cerr << error;
+    }
+  });
+
+  std::cout << "Processed " << inputs.size() - n_failed << " of "
+            << inputs.size() << " files" << std::endl;
+  return n_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
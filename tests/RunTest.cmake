@@ -0,0 +1,49 @@
+# Builds SOURCES with the plugin, runs the program in WORK_DIR and matches
+# the OUTPUT file written by the runtime against MATCH and NOT_MATCH regexes.
+# ENV variables are set for the compiler and linker, the plugin reads them.
+# Runtime is compiled without FLAGS, so it isn't part of LTO.
+foreach(list SOURCES RUNTIME FLAGS ENV)
+  string(REPLACE "|" ";" ${list} "${${list}}")
+endforeach()
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+function(run)
+  execute_process(COMMAND ${ARGN} WORKING_DIRECTORY ${WORK_DIR}
+                  RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "Failed (${result}): ${ARGN}")
+  endif()
+endfunction()
+
+set(objects)
+foreach(source ${RUNTIME})
+  get_filename_component(name ${source} NAME_WE)
+  run(${CXX} -c ${source} -I${INCLUDE} -o ${name}.o)
+  list(APPEND objects ${name}.o)
+endforeach()
+
+foreach(source ${SOURCES})
+  get_filename_component(name ${source} NAME_WE)
+  run(${CMAKE_COMMAND} -E env ${ENV}
+      ${CXX} -x c++ -c ${source} -fpass-plugin=${PLUGIN} ${FLAGS}
+      -o ${name}.o)
+  list(APPEND objects ${name}.o)
+endforeach()
+
+set(link_flags)
+if(LINK_PLUGIN)
+  set(link_flags -Wl,--load-pass-plugin=${PLUGIN})
+endif()
+run(${CMAKE_COMMAND} -E env ${ENV}
+    ${CXX} ${FLAGS} ${link_flags} ${objects} -lpthread -o a.out)
+run(${WORK_DIR}/a.out)
+
+file(READ ${WORK_DIR}/${OUTPUT} output)
+if(MATCH AND NOT output MATCHES "${MATCH}")
+  message(FATAL_ERROR "${OUTPUT} doesn't match \"${MATCH}\":\n${output}")
+endif()
+if(NOT_MATCH AND output MATCHES "${NOT_MATCH}")
+  message(FATAL_ERROR "${OUTPUT} matches \"${NOT_MATCH}\":\n${output}")
+endif()
@@ -0,0 +1,13 @@
+int values[64];
+
+int main() {
+  // the only load of values[3] runs once
+  int first = values[3];
+
+  int sum = 0;
+  for (int i = 0; i < 64; ++i) {
+    sum += values[i];
+  }
+
+  return sum + first;
+}
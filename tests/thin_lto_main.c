@@ -0,0 +1,10 @@
+int Square(int x);
+
+int main() {
+  int sum = 0;
+  for (int i = 0; i < 7; ++i) {
+    sum += Square(i);
+  }
+
+  return sum == 91 ? 0 : 1;
+}
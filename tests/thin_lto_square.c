@@ -0,0 +1 @@
+int Square(int x) { return x * x; }